@@ -39,6 +39,7 @@ unsigned char OpenSprinkler::hw_rev;
 unsigned char OpenSprinkler::nboards;
 unsigned char OpenSprinkler::nstations;
 unsigned char OpenSprinkler::station_bits[MAX_NUM_BOARDS];
+uint32_t OpenSprinkler::state_versions[NUM_STATE_DOMAINS];
 unsigned char OpenSprinkler::engage_booster;
 uint16_t OpenSprinkler::baseline_current;
 
@@ -73,9 +74,17 @@ unsigned char OpenSprinkler::masters[NUM_MASTER_ZONES][NUM_MASTER_OPTS];
 time_os_t OpenSprinkler::masters_last_on[NUM_MASTER_ZONES];
 RCSwitch OpenSprinkler::rfswitch;
 
+#if !defined(ARDUINO)
+StationData OpenSprinkler::stations[MAX_NUM_STATIONS];
+StationCode OpenSprinkler::station_codes[MAX_NUM_STATIONS];
+unsigned char OpenSprinkler::station_codes_ok[MAX_NUM_BOARDS];
+unsigned char OpenSprinkler::station_name_order[MAX_NUM_STATIONS];
+#endif
+
 extern char tmp_buffer[];
 extern char ether_buffer[];
 extern ProgramData pd;
+extern ulong get_flowcount_rt();
 
 extern const char* user_agent_string;
 
@@ -102,6 +111,7 @@ extern const char* user_agent_string;
 	#if defined(OSPI)
 		unsigned char OpenSprinkler::pin_sr_data = PIN_SR_DATA;
 	#endif
+	ShiftRegister* OpenSprinkler::shift_register = NULL;
 #endif
 
 #if defined(USE_OTF)
@@ -733,7 +743,10 @@ void OpenSprinkler::reboot_dev(uint8_t cause) {
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include "utils.h"
+#include "logwriter.h"
+#include "ioworker.h"
 #include "opensprinkler_server.h"
+#include <pthread.h>
 
 /** Initialize network with the given mac address and http port */
 unsigned char OpenSprinkler::start_network() {
@@ -794,6 +807,9 @@ bool OpenSprinkler::load_hardware_mac(unsigned char* mac, bool wired) {
 void OpenSprinkler::reboot_dev(uint8_t cause) {
 	nvdata.reboot_cause = cause;
 	nvdata_save();
+	IOWorker::flush();
+	LogWriter::flush();
+	file_sync();
 #if defined(DEMO)
 	// do nothing
 #else
@@ -951,15 +967,6 @@ void OpenSprinkler::begin() {
 
 #else
 
-	// shift register setup
-	pinMode(PIN_SR_OE, OUTPUT);
-	// pull shift register OE high to disable output
-	digitalWrite(PIN_SR_OE, HIGH);
-	pinMode(PIN_SR_LATCH, OUTPUT);
-	digitalWrite(PIN_SR_LATCH, HIGH);
-
-	pinMode(PIN_SR_CLOCK, OUTPUT);
-
 	#if defined(OSPI)
 		pin_sr_data = PIN_SR_DATA;
 		// detect RPi revision
@@ -967,10 +974,14 @@ void OpenSprinkler::begin() {
 		if (rev==0x0002 || rev==0x0003)
 			pin_sr_data = PIN_SR_DATA_ALT;
 		// if this is revision 1, use PIN_SR_DATA_ALT
-		pinMode(pin_sr_data, OUTPUT);
+
+		// shift register setup, with OE high to disable output
+		shift_register = ShiftRegister::open(PIN_SR_OE, PIN_SR_LATCH, PIN_SR_CLOCK, pin_sr_data);
 	#else
-		pinMode(PIN_SR_DATA, OUTPUT);
+		shift_register = ShiftRegister::open(PIN_SR_OE, PIN_SR_LATCH, PIN_SR_CLOCK, PIN_SR_DATA);
 	#endif
+	DEBUG_PRINT("shift register: ");
+	DEBUG_PRINTLN(shift_register->name());
 
 #endif
 
@@ -1344,7 +1355,7 @@ void OpenSprinkler::apply_all_station_bits() {
 		}
 	}
 
-#else
+#elif defined(ARDUINO)
 	digitalWrite(PIN_SR_LATCH, LOW);
 	unsigned char bid, s, sbits;
 
@@ -1358,16 +1369,11 @@ void OpenSprinkler::apply_all_station_bits() {
 
 		for(s=0;s<8;s++) {
 			digitalWrite(PIN_SR_CLOCK, LOW);
-	#if defined(OSPI) // if OSPI, use dynamically assigned pin_sr_data
-			digitalWrite(pin_sr_data, (sbits & ((unsigned char)1<<(7-s))) ? HIGH : LOW );
-	#else
 			digitalWrite(PIN_SR_DATA, (sbits & ((unsigned char)1<<(7-s))) ? HIGH : LOW );
-	#endif
 			digitalWrite(PIN_SR_CLOCK, HIGH);
 		}
 	}
 
-	#if defined(ARDUINO)
 	if((hw_type==HW_TYPE_DC) && engage_booster) {
 		// for DC controller: boost voltage
 		digitalWrite(PIN_BOOST_EN, LOW);  // disable output path
@@ -1381,9 +1387,16 @@ void OpenSprinkler::apply_all_station_bits() {
 	} else {
 		digitalWrite(PIN_SR_LATCH, HIGH);
 	}
-	#else
-	digitalWrite(PIN_SR_LATCH, HIGH);
-	#endif
+
+#else
+	unsigned char sbits[MAX_EXT_BOARDS+1];
+
+	// Shift out all station bit values, from the highest board to the lowest.
+	// The shift register skips the write if nothing changed since the last latch
+	for(unsigned char bid=0;bid<=MAX_EXT_BOARDS;bid++) {
+		sbits[bid] = status.enabled ? station_bits[MAX_EXT_BOARDS-bid] : 0;
+	}
+	shift_register->write(sbits, sizeof(sbits));
 #endif
 
 	if(iopts[IOPT_SPE_AUTO_REFRESH]) {
@@ -1631,9 +1644,106 @@ bool OpenSprinkler::parse_rfstation_code(RFStationData *data, RFStationCode *cod
 	return true;
 }
 
+/** Parse special station data into the values used to switch the station */
+bool OpenSprinkler::parse_station_code(unsigned char type, unsigned char *sped, StationCode *code) {
+	switch(type) {
+	case STN_TYPE_RF:
+		return parse_rfstation_code((RFStationData *)sped, &code->rf);
+
+	case STN_TYPE_REMOTE_IP:
+	{
+		RemoteIPStationData *data = (RemoteIPStationData *)sped;
+		uint32_t ip4 = hex2ulong(data->ip, sizeof(data->ip));
+		code->remote.ip[0] = ip4>>24;
+		code->remote.ip[1] = (ip4>>16)&0xff;
+		code->remote.ip[2] = (ip4>>8)&0xff;
+		code->remote.ip[3] = ip4&0xff;
+		code->remote.port = (uint16_t)hex2ulong(data->port, sizeof(data->port));
+		code->remote.sid = (uint16_t)hex2ulong(data->sid, sizeof(data->sid));
+		return true;
+	}
+
+	case STN_TYPE_REMOTE_OTC:
+	{
+		RemoteOTCStationData *data = (RemoteOTCStationData *)sped;
+		memcpy(code->otc.token, data->token, sizeof(code->otc.token));
+		code->otc.token[sizeof(code->otc.token)-1] = 0; // ensure the string ends properly
+		code->otc.sid = (uint16_t)hex2ulong(data->sid, sizeof(data->sid));
+		return true;
+	}
+
+	case STN_TYPE_GPIO:
+	{
+		GPIOStationData *data = (GPIOStationData *)sped;
+		code->gpio.pin = (data->pin[0] - '0') * 10 + (data->pin[1] - '0');
+		code->gpio.active = data->active - '0';
+		return true;
+	}
+
+	case STN_TYPE_HTTP:
+	case STN_TYPE_HTTPS:
+	{
+		// split a copy of the data into server, port, on and off commands
+		char *p = code->http.data;
+		memcpy(p, sped, STATION_SPECIAL_DATA_SIZE);
+		p[STATION_SPECIAL_DATA_SIZE] = 0;
+		char * server = strtok(p, ",");
+		char * port = strtok(NULL, ",");
+		char * on_cmd = strtok(NULL, ",");
+		char * off_cmd = strtok(NULL, ",");
+		if(server==NULL) return false;
+		if(server!=p) memmove(p, server, strlen(server)+1); // the server comes first
+		code->http.port = port ? atoi(port) : 0;
+		code->http.on = on_cmd ? on_cmd-p : -1;
+		code->http.off = off_cmd ? off_cmd-p : -1;
+		return true;
+	}
+	}
+	return false;
+}
+
+#if !defined(ARDUINO)
+static int station_name_cmp(const void *a, const void *b) {
+	unsigned char i = *(const unsigned char *)a, j = *(const unsigned char *)b;
+	int c = strncmp(OpenSprinkler::stations[i].name, OpenSprinkler::stations[j].name, STATION_NAME_SIZE);
+	return c ? c : (int)i-(int)j;
+}
+
+/** Load the station table from file, then parse the special data and sort
+ * the names, so stations are switched and ordered without reading the file */
+void OpenSprinkler::stations_load() {
+	memset(stations, 0, sizeof(stations));
+	file_read_block(STATIONS_FILENAME, stations, 0, sizeof(stations));
+	for(unsigned int sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		station_code_update(sid);
+	}
+	station_names_sort();
+}
+
+void OpenSprinkler::station_code_update(unsigned char sid) {
+	unsigned char bid=sid>>3,s=sid&0x07;
+	if(parse_station_code(stations[sid].type, stations[sid].sped, station_codes+sid)) {
+		station_codes_ok[bid] |= (1<<s);
+	} else {
+		station_codes_ok[bid] &= ~(1<<s);
+	}
+}
+
+void OpenSprinkler::station_names_sort() {
+	for(unsigned int sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		station_name_order[sid] = sid;
+	}
+	qsort(station_name_order, MAX_NUM_STATIONS, 1, station_name_cmp);
+}
+#endif
+
 /** Get station data */
 void OpenSprinkler::get_station_data(unsigned char sid, StationData* data) {
+#if !defined(ARDUINO)
+	memcpy(data, stations+sid, sizeof(StationData));
+#else
 	file_read_block(STATIONS_FILENAME, data, (uint32_t)sid*sizeof(StationData), sizeof(StationData));
+#endif
 }
 
 /** Set station data */
@@ -1646,7 +1756,11 @@ void OpenSprinkler::set_station_data(unsigned char sid, StationData* data) {
 /** Get station name */
 void OpenSprinkler::get_station_name(unsigned char sid, char tmp[]) {
 	tmp[STATION_NAME_SIZE]=0;
+#if !defined(ARDUINO)
+	memcpy(tmp, stations[sid].name, STATION_NAME_SIZE);
+#else
 	file_read_block(STATIONS_FILENAME, tmp, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, name), STATION_NAME_SIZE);
+#endif
 }
 
 /** Set station name */
@@ -1657,12 +1771,32 @@ void OpenSprinkler::set_station_name(unsigned char sid, char tmp[]) {
 	size_t len = strlen(n0);
 	if(len!=strlen(tmp) || memcmp(n0, tmp, len)!=0) { // only write if the name has changed
 		file_write_block(STATIONS_FILENAME, tmp, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, name), STATION_NAME_SIZE);
+#if !defined(ARDUINO)
+		memcpy(stations[sid].name, tmp, STATION_NAME_SIZE);
+		station_names_sort();
+#endif
+		state_changed(STATE_STATIONS);
 	}
 }
 
+/** Set station type and special data */
+void OpenSprinkler::set_station_special(unsigned char sid, const char *buf) {
+	file_write_block(STATIONS_FILENAME, buf, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), STATION_SPECIAL_DATA_SIZE+1);
+#if !defined(ARDUINO)
+	stations[sid].type = buf[0];
+	memcpy(stations[sid].sped, buf+1, STATION_SPECIAL_DATA_SIZE);
+	station_code_update(sid);
+#endif
+	state_changed(STATE_STATIONS);
+}
+
 /** Get station type */
 unsigned char OpenSprinkler::get_station_type(unsigned char sid) {
+#if !defined(ARDUINO)
+	return stations[sid].type;
+#else
 	return file_read_byte(STATIONS_FILENAME, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type));
+#endif
 }
 
 unsigned char OpenSprinkler::is_sequential_station(unsigned char sid) {
@@ -1723,6 +1857,7 @@ void OpenSprinkler::set_station_gid(unsigned char sid, unsigned char gid) {
 
 /** Save all station attribs to file (backward compatibility) */
 void OpenSprinkler::attribs_save() {
+	state_changed(STATE_STATIONS);
 	// re-package attribute bits and save
 	unsigned char bid, s, sid=0;
 	StationAttrib at, at0;
@@ -1740,16 +1875,27 @@ void OpenSprinkler::attribs_save() {
 			set_station_gid(sid, at.gid);
 
 			// only write if content has changed: this is important for LittleFS as otherwise the overhead is too large
+#if !defined(ARDUINO)
+			at0 = stations[sid].attrib;
+#else
 			file_read_block(STATIONS_FILENAME, &at0, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), sizeof(StationAttrib));
+#endif
 			if(memcmp(&at,&at0,sizeof(StationAttrib))!=0) {
 				file_write_block(STATIONS_FILENAME, &at, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), sizeof(StationAttrib)); // attribte bits are 1 byte long
+#if !defined(ARDUINO)
+				stations[sid].attrib = at;
+#endif
 			}
 			if(attrib_spe[bid]>>s==0) {
 				// if station special bit is 0, make sure to write type STANDARD
 				// only write if content has changed
-				file_read_block(STATIONS_FILENAME, &ty0, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1);
+				ty0 = get_station_type(sid);
 				if(ty!=ty0) {
 					file_write_block(STATIONS_FILENAME, &ty, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1); // attribte bits are 1 byte long
+#if !defined(ARDUINO)
+					stations[sid].type = ty;
+					station_code_update(sid);
+#endif
 				}
 			}
 		}
@@ -1770,10 +1916,19 @@ void OpenSprinkler::attribs_load() {
 	memset(attrib_dis, 0, nboards);
 	memset(attrib_spe, 0, nboards);
 	memset(attrib_grp, 0, MAX_NUM_STATIONS);
+#if !defined(ARDUINO)
+	stations_load(); // the attribs are taken from the station table
+#endif
 
 	for(bid=0;bid<MAX_NUM_BOARDS;bid++) {
 		for(s=0;s<8;s++,sid++) {
+#if !defined(ARDUINO)
+			at = stations[sid].attrib;
+			ty = stations[sid].type;
+#else
 			file_read_block(STATIONS_FILENAME, &at, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), sizeof(StationAttrib));
+			file_read_block(STATIONS_FILENAME, &ty, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1);
+#endif
 			attrib_mas[bid] |= (at.mas<<s);
 			attrib_igs[bid] |= (at.igs<<s);
 			attrib_mas2[bid]|= (at.mas2<<s);
@@ -1781,7 +1936,6 @@ void OpenSprinkler::attribs_load() {
 			attrib_igrd[bid]|= (at.igrd<<s);
 			attrib_dis[bid] |= (at.dis<<s);
 			attrib_grp[sid] = at.gid;
-			file_read_block(STATIONS_FILENAME, &ty, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1);
 			if(ty!=STN_TYPE_STANDARD) {
 				attrib_spe[bid] |= (1<<s);
 			}
@@ -1791,7 +1945,13 @@ void OpenSprinkler::attribs_load() {
 
 /** verify if a string matches password */
 unsigned char OpenSprinkler::password_verify(const char *pw) {
+#if !defined(ARDUINO)
+	char buf[MAX_SOPTS_SIZE+1];
+	sopt_copy(SOPT_PASSWORD, buf);
+	return (strncmp(buf, pw, MAX_SOPTS_SIZE)==0) ? 1 : 0;
+#else
 	return (file_cmp_block(SOPTS_FILENAME, pw, SOPT_PASSWORD*MAX_SOPTS_SIZE)==0) ? 1 : 0;
+#endif
 }
 
 // ==================
@@ -1818,33 +1978,41 @@ void OpenSprinkler::switch_special_station(unsigned char sid, unsigned char valu
 	if(!(os.attrib_spe[bid]&(1<<s))) return; // if this is not a special stations
 	unsigned char stype = get_station_type(sid);
 	if(stype!=STN_TYPE_STANDARD) {
-		// read station data
+#if !defined(ARDUINO)
+		// special data is parsed when the station table is loaded or changed
+		if(!(station_codes_ok[bid]&(1<<s))) return;
+		const StationCode *code = station_codes+sid;
+#else
+		// read and parse station data
 		StationData *pdata=(StationData*) tmp_buffer;
 		get_station_data(sid, pdata);
+		StationCode parsed, *code = &parsed;
+		if(!parse_station_code(stype, pdata->sped, code)) return;
+#endif
 		switch(stype) {
 
 		case STN_TYPE_RF:
-			switch_rfstation((RFStationData *)pdata->sped, value);
+			switch_rfstation(&code->rf, value);
 			break;
 
 		case STN_TYPE_REMOTE_IP:
-			switch_remotestation((RemoteIPStationData *)pdata->sped, value, dur);
+			switch_remotestation(&code->remote, value, dur);
 			break;
 
 		case STN_TYPE_REMOTE_OTC:
-			switch_remotestation((RemoteOTCStationData *)pdata->sped, value, dur);
+			switch_remotestation(&code->otc, value, dur);
 			break;
 
 		case STN_TYPE_GPIO:
-			switch_gpiostation((GPIOStationData *)pdata->sped, value);
+			switch_gpiostation(&code->gpio, value);
 			break;
 
 		case STN_TYPE_HTTP:
-			switch_httpstation((HTTPStationData *)pdata->sped, value, false);
+			switch_httpstation(&code->http, value, false);
 			break;
 
 		case STN_TYPE_HTTPS:
-			switch_httpstation((HTTPStationData *)pdata->sped, value, true);
+			switch_httpstation(&code->http, value, true);
 			break;
 
 		}
@@ -1863,6 +2031,7 @@ unsigned char OpenSprinkler::set_station_bit(unsigned char sid, unsigned char va
 		if((*data)&mask) return 0;  // if bit is already set, return no change
 		else {
 			(*data) = (*data) | mask;
+			state_changed(STATE_STATUS);
 			engage_booster = true; // if bit is changing from 0 to 1, set engage_booster
 			switch_special_station(sid, 1, dur); // handle special stations
 			return 1;
@@ -1871,6 +2040,7 @@ unsigned char OpenSprinkler::set_station_bit(unsigned char sid, unsigned char va
 		if(!((*data)&mask)) return 0; // if bit is already reset, return no change
 		else {
 			(*data) = (*data) & (~mask);
+			state_changed(STATE_STATUS);
 			if(hw_type == HW_TYPE_LATCH) {
 				engage_booster = true;  // if LATCH controller, engage booster when bit changes
 			}
@@ -1897,20 +2067,16 @@ void OpenSprinkler::clear_all_station_bits() {
 }
 
 /** Switch RF station
- * This function takes a RF code,
- * parses it into signals and timing,
+ * This function takes a parsed RF code (signals and timing)
  * and sends it out through RF transmitter.
  */
-void OpenSprinkler::switch_rfstation(RFStationData *data, bool turnon) {
-	RFStationCode code;
-	if(!parse_rfstation_code(data, &code)) return; // return if the timing parameter is 0
-
+void OpenSprinkler::switch_rfstation(const RFStationCode *code, bool turnon) {
 	if(PIN_RFTX == 255) return; // ignore RF station if RF pin disabled
 
 	rfswitch.enableTransmit(PIN_RFTX);
-	rfswitch.setProtocol(code.protocol);
-	rfswitch.setPulseLength(code.timing);
-	rfswitch.send(turnon ? code.on : code.off, code.bitlength);
+	rfswitch.setProtocol(code->protocol);
+	rfswitch.setPulseLength(code->timing);
+	rfswitch.send(turnon ? code->on : code->off, code->bitlength);
 }
 
 /** Switch GPIO station
@@ -1918,18 +2084,19 @@ void OpenSprinkler::switch_rfstation(RFStationData *data, bool turnon) {
  * First two bytes are zero padded GPIO pin number.
  * Third byte is either 0 or 1 for active low (GND) or high (+5V) relays
  */
-void OpenSprinkler::switch_gpiostation(GPIOStationData *data, bool turnon) {
-	unsigned char gpio = (data->pin[0] - '0') * 10 + (data->pin[1] - '0');
-	unsigned char activeState = data->active - '0';
-
-	pinMode(gpio, OUTPUT);
+void OpenSprinkler::switch_gpiostation(const GPIOStationCode *code, bool turnon) {
+	pinMode(code->pin, OUTPUT);
 	if (turnon)
-		digitalWrite(gpio, activeState);
+		digitalWrite(code->pin, code->active);
 	else
-		digitalWrite(gpio, 1-activeState);
+		digitalWrite(code->pin, 1-code->active);
 }
 
 /** Callback function for switching remote station */
+#if !defined(ARDUINO)
+thread_local char *http_response_buffer = NULL;
+#endif
+
 void remote_http_callback(char* buffer) {
 
 	DEBUG_PRINTLN(buffer);
@@ -2011,7 +2178,11 @@ int8_t OpenSprinkler::send_http_request(const char* server, uint16_t port, char*
 	} else {
 		DEBUG_PRINTLN(F("client no longer connected"));
 	}
-	memset(ether_buffer, 0, ETHER_BUFFER_SIZE);
+	char *response = ether_buffer;
+#if !defined(ARDUINO)
+	if(http_response_buffer) response = http_response_buffer;
+#endif
+	memset(response, 0, ETHER_BUFFER_SIZE);
 	uint32_t stoptime = millis()+timeout;
 
 	int pos = 0;
@@ -2023,7 +2194,7 @@ int8_t OpenSprinkler::send_http_request(const char* server, uint16_t port, char*
 		int nbytes = client->available();
 		if(nbytes>0) {
 			if(pos+nbytes>ETHER_BUFFER_SIZE) nbytes=ETHER_BUFFER_SIZE-pos; // cannot read more than buffer size
-			client->read((uint8_t*)ether_buffer+pos, nbytes);
+			client->read((uint8_t*)response+pos, nbytes);
 			pos+=nbytes;
 		}
 		if(millis()>stoptime) {
@@ -2037,15 +2208,15 @@ int8_t OpenSprinkler::send_http_request(const char* server, uint16_t port, char*
 		}
 	}
 #else
-	len = client->read((uint8_t *)ether_buffer+pos, ETHER_BUFFER_SIZE);
+	len = client->read((uint8_t *)response+pos, ETHER_BUFFER_SIZE);
 	pos += len;
 
 #endif
-	ether_buffer[pos]=0; // properly end buffer with 0
+	response[pos]=0; // properly end buffer with 0
 	client->stop();
 	delete client;
-	if(strlen(ether_buffer)==0) return HTTP_RQT_EMPTY_RETURN;
-	if(callback) callback(ether_buffer);
+	if(strlen(response)==0) return HTTP_RQT_EMPTY_RETURN;
+	if(callback) callback(response);
 	return HTTP_RQT_SUCCESS;
 }
 
@@ -2067,24 +2238,14 @@ int8_t OpenSprinkler::send_http_request(char* server_with_port, char* p, void(*c
 }
 
 /** Switch remote IP station
- * This function takes a remote station code,
- * parses it into remote IP, port, station index,
+ * This function takes a parsed remote station code
+ * (remote IP, port, station index)
  * and makes a HTTP GET request.
  * The remote controller is assumed to have the same
  * password as the main controller
  */
-void OpenSprinkler::switch_remotestation(RemoteIPStationData *data, bool turnon, uint16_t dur) {
-	RemoteIPStationData copy;
-	memcpy((char*)&copy, (char*)data, sizeof(RemoteIPStationData));
-
-	uint32_t ip4 = hex2ulong(copy.ip, sizeof(copy.ip));
-	uint16_t port = (uint16_t)hex2ulong(copy.port, sizeof(copy.port));
-
-	unsigned char ip[4];
-	ip[0] = ip4>>24;
-	ip[1] = (ip4>>16)&0xff;
-	ip[2] = (ip4>>8)&0xff;
-	ip[3] = ip4&0xff;
+void OpenSprinkler::switch_remotestation(const RemoteIPStationCode *code, bool turnon, uint16_t dur) {
+	const unsigned char *ip = code->ip;
 
 	char *p = tmp_buffer;
 	BufferFiller bf = BufferFiller(p, TMP_BUFFER_SIZE*2);
@@ -2102,7 +2263,7 @@ void OpenSprinkler::switch_remotestation(RemoteIPStationData *data, bool turnon,
 	}
 	bf.emit_p(PSTR("GET /cm?pw=$O&sid=$D&en=$D&t=$D"),
 						SOPT_PASSWORD,
-						(int)hex2ulong(copy.sid, sizeof(copy.sid)),
+						(int)code->sid,
 						turnon, timer);
 	bf.emit_p(PSTR(" HTTP/1.0\r\nHOST: $D.$D.$D.$D\r\n"),
 						ip[0],ip[1],ip[2],ip[3]);
@@ -2111,20 +2272,17 @@ void OpenSprinkler::switch_remotestation(RemoteIPStationData *data, bool turnon,
 
 	char server[20];
 	snprintf(server, 20, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-	send_http_request(server, port, p, remote_http_callback);
+	send_http_request(server, code->port, p, remote_http_callback);
 }
 
 /** Switch remote OTC station
- * This function takes a remote station code,
- * parses it into OTC token and station index,
+ * This function takes a parsed remote station code
+ * (OTC token and station index)
  * and makes a HTTPS GET request.
  * The remote controller is assumed to have the same
  * password as the main controller
  */
-void OpenSprinkler::switch_remotestation(RemoteOTCStationData *data, bool turnon, uint16_t dur) {
-	RemoteOTCStationData copy;
-	memcpy((char*)&copy, (char*)data, sizeof(RemoteOTCStationData));
-	copy.token[sizeof(copy.token)-1] = 0; // ensure the string ends properly
+void OpenSprinkler::switch_remotestation(const RemoteOTCStationCode *code, bool turnon, uint16_t dur) {
 	char *p = tmp_buffer;
 	BufferFiller bf = BufferFiller(p, TMP_BUFFER_SIZE*2);
 	// if turning on the zone and duration is defined, give duration as the timer value
@@ -2140,9 +2298,9 @@ void OpenSprinkler::switch_remotestation(RemoteOTCStationData *data, bool turnon
 		}
 	}
 	bf.emit_p(PSTR("GET /forward/v1/$S/cm?pw=$O&sid=$D&en=$D&t=$D"),
-						copy.token,
+						code->token,
 						SOPT_PASSWORD,
-						(int)hex2ulong(copy.sid, sizeof(copy.sid)),
+						(int)code->sid,
 						turnon, timer);
 	bf.emit_p(PSTR(" HTTP/1.0\r\nHOST: $S\r\nConnection:close\r\n"), DEFAULT_OTC_SERVER_APP);
 
@@ -2152,29 +2310,21 @@ void OpenSprinkler::switch_remotestation(RemoteOTCStationData *data, bool turnon
 }
 
 /** Switch http(s) station
- * This function takes an http(s) station code,
- * parses it into a server name and two HTTP GET requests.
+ * This function takes a parsed http(s) station code
+ * (a server name and two HTTP GET requests).
  */
-void OpenSprinkler::switch_httpstation(HTTPStationData *data, bool turnon, bool usessl) {
-
-	HTTPStationData copy;
-	// make a copy of the HTTP station data and work with it
-	memcpy((char*)&copy, (char*)data, sizeof(HTTPStationData));
-	char * server = strtok((char *)copy.data, ",");
-	char * port = strtok(NULL, ",");
-	char * on_cmd = strtok(NULL, ",");
-	char * off_cmd = strtok(NULL, ",");
-	char * cmd = turnon ? on_cmd : off_cmd;
+void OpenSprinkler::switch_httpstation(const HTTPStationCode *code, bool turnon, bool usessl) {
+	int16_t cmd = turnon ? code->on : code->off;
+	if(cmd<0) return; // proceed only if cmd is valid
+	const char *server = code->data;
 
 	char *p = tmp_buffer;
 	BufferFiller bf = BufferFiller(p, TMP_BUFFER_SIZE*2);
 
-	if(cmd==NULL || server==NULL) return; // proceed only if cmd and server are valid
-
-	bf.emit_p(PSTR("GET /$S HTTP/1.0\r\nHOST: $S\r\n"), cmd, server);
+	bf.emit_p(PSTR("GET /$S HTTP/1.0\r\nHOST: $S\r\n"), code->data+cmd, server);
 	bf.emit_p(PSTR("User-Agent: $S\r\n\r\n"), user_agent_string);
 
-	send_http_request(server, atoi(port), p, remote_http_callback, usessl);
+	send_http_request(server, code->port, p, remote_http_callback, usessl);
 }
 
 /** Prepare factory reset */
@@ -2198,6 +2348,7 @@ void OpenSprinkler::factory_reset() {
 	lcd_print_line_clear_pgm(PSTR("Please Wait..."), 1);
 #else
 	DEBUG_PRINT("factory reset...");
+	IOWorker::flush(); // files are removed below
 #endif
 
 	// 1. reset integer options (by saving default values)
@@ -2207,6 +2358,9 @@ void OpenSprinkler::factory_reset() {
 	for(int i=0; i<NUM_SOPTS; i++) {
 		file_write_block(SOPTS_FILENAME, tmp_buffer, (ulong)MAX_SOPTS_SIZE*i, MAX_SOPTS_SIZE);
 	}
+#if !defined(ARDUINO)
+	sopts_load();
+#endif
 	for(int i=0; i<NUM_SOPTS; i++) {
 		sopt_save(i, sopts[i]);
 	}
@@ -2244,6 +2398,7 @@ void OpenSprinkler::factory_reset() {
 	last_reboot_cause = nvdata.reboot_cause;
 
 	// 4. write program data: just need to write a program counter: 0
+	// (on Linux, ProgramData::init turns this into an empty program table)
 	file_write_byte(PROG_FILENAME, 0, 0);
 
 	// 5. write 'done' file
@@ -2293,6 +2448,10 @@ void OpenSprinkler::parse_otc_config() {
 /** Setup function for options */
 void OpenSprinkler::options_setup() {
 
+#if !defined(ARDUINO)
+	file_recover(); // finish saving the changes of a request cut short by a power loss
+#endif
+
 	// Check reset conditions:
 	if (file_read_byte(IOPTS_FILENAME, IOPT_FW_VERSION)!=OS_FW_VERSION ||  // fw major version has changed
 			!file_exists(DONE_FILENAME)) {  // done file doesn't exist
@@ -2302,6 +2461,9 @@ void OpenSprinkler::options_setup() {
 	} else	{
 
 		iopts_load();
+#if !defined(ARDUINO)
+		sopts_load();
+#endif
 		nvdata_load();
 		last_reboot_cause = nvdata.reboot_cause;
 		nvdata.reboot_cause = REBOOT_CAUSE_POWERON;
@@ -2433,19 +2595,29 @@ void OpenSprinkler::options_setup() {
 
 /** Load non-volatile controller status data from file */
 void OpenSprinkler::nvdata_load() {
+#if !defined(ARDUINO)
+	IOWorker::flush();
+#endif
 	file_read_block(NVCON_FILENAME, &nvdata, 0, sizeof(NVConData));
 	old_status = status;
 }
 
 /** Save non-volatile controller status data */
 void OpenSprinkler::nvdata_save() {
+#if defined(ARDUINO)
 	file_write_block(NVCON_FILENAME, &nvdata, 0, sizeof(NVConData));
+#else
+	IOWorker::write_block(NVCON_FILENAME, &nvdata, 0, sizeof(NVConData));
+#endif
 }
 
 void load_wt_monthly(char* wto);
 
 /** Load integer options from file */
 void OpenSprinkler::iopts_load() {
+#if !defined(ARDUINO)
+	IOWorker::flush();
+#endif
 	file_read_block(IOPTS_FILENAME, iopts, 0, NUM_IOPTS);
 	nboards = iopts[IOPT_EXT_BOARDS]+1;
 	nstations = nboards * 8;
@@ -2482,17 +2654,61 @@ void OpenSprinkler::populate_master() {
 
 /** Save integer options to file */
 void OpenSprinkler::iopts_save() {
+#if defined(ARDUINO)
 	file_write_block(IOPTS_FILENAME, iopts, 0, NUM_IOPTS);
+#else
+	IOWorker::write_block(IOPTS_FILENAME, iopts, 0, NUM_IOPTS);
+#endif
 	nboards = iopts[IOPT_EXT_BOARDS]+1;
 	nstations = nboards * 8;
 	status.enabled = iopts[IOPT_DEVICE_ENABLE];
+	state_changed(STATE_OPTIONS);
+}
+
+#if !defined(ARDUINO)
+char OpenSprinkler::sopts_cache[NUM_SOPTS][MAX_SOPTS_SIZE+1];
+uint16_t OpenSprinkler::sopts_len[NUM_SOPTS];
+// push_message() reads string options on the notification thread of the I/O worker,
+// while the main thread saves them
+static pthread_mutex_t sopts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Load all string options from file into the cache.
+ * The cache is written through by sopt_save, so the file is only read here */
+void OpenSprinkler::sopts_load() {
+	pthread_mutex_lock(&sopts_mutex);
+	memset(sopts_cache, 0, sizeof(sopts_cache));
+	for(unsigned char oid=0; oid<NUM_SOPTS; oid++) {
+		file_read_block(SOPTS_FILENAME, sopts_cache[oid], (ulong)MAX_SOPTS_SIZE*oid, MAX_SOPTS_SIZE);
+		sopts_len[oid] = strlen(sopts_cache[oid]);
+	}
+	pthread_mutex_unlock(&sopts_mutex);
+	state_changed(STATE_OPTIONS); // the options' ETag is keyed on this, not on the cache
+}
+
+uint16_t OpenSprinkler::sopt_copy(unsigned char oid, char *buf, uint16_t maxlen) {
+	pthread_mutex_lock(&sopts_mutex);
+	uint16_t len = sopts_len[oid] < maxlen ? sopts_len[oid] : maxlen;
+	memcpy(buf, sopts_cache[oid], len);
+	pthread_mutex_unlock(&sopts_mutex);
+	buf[len]=0;
+	return len;
+}
+
+uint16_t emit_sopt(unsigned char oid, char *buf, uint16_t maxlen) {
+	if(maxlen>MAX_SOPTS_SIZE) maxlen = MAX_SOPTS_SIZE;
+	return OpenSprinkler::sopt_copy(oid, buf, maxlen);
 }
+#endif
 
 /** Load a string option from file */
 void OpenSprinkler::sopt_load(unsigned char oid, char *buf, uint16_t maxlen) {
 	if(maxlen>MAX_SOPTS_SIZE) maxlen = MAX_SOPTS_SIZE; // cap maxlen
+#if !defined(ARDUINO)
+	sopt_copy(oid, buf, maxlen);
+#else
 	file_read_block(SOPTS_FILENAME, buf, MAX_SOPTS_SIZE*oid, maxlen);
 	buf[maxlen]=0;  // ensure the string ends properly
+#endif
 }
 
 /** Load a string option from file, return String */
@@ -2505,6 +2721,20 @@ String OpenSprinkler::sopt_load(unsigned char oid) {
 /** Save a string option to file */
 bool OpenSprinkler::sopt_save(unsigned char oid, const char *buf) {
 	// smart save: if value hasn't changed, don't write
+#if !defined(ARDUINO)
+	pthread_mutex_lock(&sopts_mutex);
+	if(strncmp(sopts_cache[oid], buf, MAX_SOPTS_SIZE)==0) {
+		pthread_mutex_unlock(&sopts_mutex);
+		return false;
+	}
+	int len = strlen(buf);
+	sopts_len[oid] = len<MAX_SOPTS_SIZE ? len : MAX_SOPTS_SIZE;
+	memcpy(sopts_cache[oid], buf, sopts_len[oid]);
+	sopts_cache[oid][sopts_len[oid]] = 0;
+	pthread_mutex_unlock(&sopts_mutex);
+	// copy ending 0 too
+	IOWorker::write_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid, len>=MAX_SOPTS_SIZE ? MAX_SOPTS_SIZE : len+1);
+#else
 	if(file_cmp_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid)==0) return false;
 	int len = strlen(buf);
 	if(len>=MAX_SOPTS_SIZE) {
@@ -2513,6 +2743,8 @@ bool OpenSprinkler::sopt_save(unsigned char oid, const char *buf) {
 		// copy ending 0 too
 		file_write_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid, len+1);
 	}
+#endif
+	state_changed(STATE_OPTIONS);
 	return true;
 }
 
@@ -2739,7 +2971,7 @@ void OpenSprinkler::lcd_print_screen(char c) {
 			lcd.write(status.sensor1_active?ICON_SOIL:(status.sensor1?'S':'s'));
 			break;
 		case SENSOR_TYPE_FLOW:
-			lcd.write(flowcount_rt>0?'F':'f');
+			lcd.write(get_flowcount_rt()>0?'F':'f');
 			break;
 		case SENSOR_TYPE_PSWITCH:
 			lcd.write(status.sensor1?'P':'p');
@@ -203,6 +203,37 @@ struct HTTPStationData {
 	unsigned char data[STATION_SPECIAL_DATA_SIZE];
 };
 
+/** Special station data parsed into what is needed to switch the station */
+struct RemoteIPStationCode {
+	unsigned char ip[4];
+	uint16_t port;
+	uint16_t sid;
+};
+
+struct RemoteOTCStationCode {
+	char token[DEFAULT_OTC_TOKEN_LENGTH+1];
+	uint16_t sid;
+};
+
+struct GPIOStationCode {
+	unsigned char pin;
+	unsigned char active;
+};
+
+struct HTTPStationCode {
+	char data[STATION_SPECIAL_DATA_SIZE+1]; // server, port, on and off commands, each ending with 0
+	uint16_t port;
+	int16_t on, off; // where the commands start in data, -1 if missing
+};
+
+union StationCode {
+	RFStationCode rf;
+	RemoteIPStationCode remote;
+	RemoteOTCStationCode otc;
+	GPIOStationCode gpio;
+	HTTPStationCode http;
+};
+
 /** Volatile controller status bits */
 struct ConStatus {
 	unsigned char enabled:1;         // operation enable (when set, controller operation is enabled)
@@ -234,6 +265,9 @@ struct OTCConfig {
 
 extern const char iopt_json_names[];
 extern const uint8_t iopt_max[];
+#if !defined(ARDUINO)
+extern thread_local char *http_response_buffer; // where send_http_request reads the response, ether_buffer if NULL
+#endif
 
 class OpenSprinkler {
 public:
@@ -248,6 +282,9 @@ public:
 #if defined(OSPI)
 	static unsigned char pin_sr_data;  // RPi shift register data pin to handle RPi rev. 1
 #endif
+#if !defined(ARDUINO)
+	static ShiftRegister *shift_register; // station output backend
+#endif
 
 	static OSMqtt mqtt;
 
@@ -307,7 +344,17 @@ public:
 	static void set_station_data(unsigned char sid, StationData* data); // set station data
 	static void get_station_name(unsigned char sid, char buf[]); // get station name
 	static void set_station_name(unsigned char sid, char buf[]); // set station name
+	static void set_station_special(unsigned char sid, const char *buf); // set station type and special data (type byte followed by the data)
 	static unsigned char get_station_type(unsigned char sid); // get station type
+#if !defined(ARDUINO)
+	static StationData stations[]; // station table, a copy of the station data file
+	static StationCode station_codes[]; // parsed special data of each station
+	static unsigned char station_codes_ok[]; // bits of the stations whose special data is usable
+	static unsigned char station_name_order[]; // all station indices, sorted by name
+	static void stations_load(); // load the station table
+	static void station_code_update(unsigned char sid);
+	static void station_names_sort();
+#endif
 	static unsigned char is_sequential_station(unsigned char sid);
 	static unsigned char is_master_station(unsigned char sid);
 	static unsigned char bound_to_master(unsigned char sid, unsigned char mas);
@@ -322,11 +369,12 @@ public:
 	static void attribs_save(); // repackage attrib bits and save (backward compatibility)
 	static void attribs_load(); // load and repackage attrib bits (backward compatibility)
 	static bool parse_rfstation_code(RFStationData *data, RFStationCode *code); // parse rf code into on/off/time sections
-	static void switch_rfstation(RFStationData *data, bool turnon);  // switch rf station
-	static void switch_remotestation(RemoteIPStationData *data, bool turnon, uint16_t dur=0); // switch remote IP station
-	static void switch_remotestation(RemoteOTCStationData *data, bool turnon, uint16_t dur=0); // switch remote OTC station
-	static void switch_gpiostation(GPIOStationData *data, bool turnon); // switch gpio station
-	static void switch_httpstation(HTTPStationData *data, bool turnon, bool usessl=false); // switch http station
+	static bool parse_station_code(unsigned char type, unsigned char *sped, StationCode *code); // parse special data, false if it is not usable
+	static void switch_rfstation(const RFStationCode *code, bool turnon);  // switch rf station
+	static void switch_remotestation(const RemoteIPStationCode *code, bool turnon, uint16_t dur=0); // switch remote IP station
+	static void switch_remotestation(const RemoteOTCStationCode *code, bool turnon, uint16_t dur=0); // switch remote OTC station
+	static void switch_gpiostation(const GPIOStationCode *code, bool turnon); // switch gpio station
+	static void switch_httpstation(const HTTPStationCode *code, bool turnon, bool usessl=false); // switch http station
 	
 	// -- options and data storeage
 	static void nvdata_load();
@@ -340,9 +388,18 @@ public:
 	static bool sopt_save(unsigned char oid, const char *buf);
 	static void sopt_load(unsigned char oid, char *buf, uint16_t maxlen=MAX_SOPTS_SIZE);
 	static String sopt_load(unsigned char oid);
+#if !defined(ARDUINO)
+	static char sopts_cache[NUM_SOPTS][MAX_SOPTS_SIZE+1]; // string options, a copy of the string options file, locked as the notification thread reads it
+	static uint16_t sopts_len[NUM_SOPTS]; // length of each string option
+	static void sopts_load(); // load the string option cache
+	static uint16_t sopt_copy(unsigned char oid, char *buf, uint16_t maxlen=MAX_SOPTS_SIZE); // copy a string option out of the cache, returns the length
+#endif
 	static void populate_master();
 	static unsigned char password_verify(const char *pw);  // verify password
 
+	static uint32_t state_versions[NUM_STATE_DOMAINS]; // counts the changes of each state domain
+	static void state_changed(unsigned char domain) { state_versions[domain]++; }
+
 	// -- controller operation
 	static void enable();   // enable controller operation
 	static void disable();  // disable controller operation, all stations will be closed immediately
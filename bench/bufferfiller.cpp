@@ -0,0 +1,125 @@
+/* OpenSprinkler Unified Firmware
+ * BufferFiller micro-benchmark (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/** Times the durations row of /jp for 200 stations, the loop that emits
+ * the most numbers, three ways: through the snprintf based emit_p that
+ * BufferFiller used before, through the current emit_p, and through the
+ * typed emitters. Build and run with: make bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "defines.h"
+#include "opensprinkler_server.h"
+
+// BufferFiller needs these from the firmware; $O and $X are not timed
+uint16_t emit_sopt(unsigned char oid, char *buf, uint16_t maxlen) { *buf = 0; return 0; }
+char dec2hexchar(unsigned char dec) { return (dec<10) ? '0'+dec : 'A'+dec-10; }
+
+/** emit_p as it was before numbers were converted by hand, $D and $L only */
+class OldFiller {
+	char *start;
+	char *ptr;
+	size_t len;
+public:
+	OldFiller (char *buf, size_t buffer_len) {
+		start = buf;
+		ptr = buf;
+		len = buffer_len;
+	}
+	unsigned int position () const { return ptr - start; }
+
+	void emit_p(PGM_P fmt, ...) {
+		va_list ap;
+		va_start(ap, fmt);
+		for (;;) {
+			char c = pgm_read_byte(fmt++);
+			if (c == 0)
+				break;
+			if (c != '$') {
+				*ptr++ = c;
+				continue;
+			}
+			c = pgm_read_byte(fmt++);
+			switch (c) {
+			case 'D':
+				snprintf((char*) ptr, len - position(),  "%d", va_arg(ap, int));
+				break;
+			case 'L':
+				snprintf((char*) ptr, len - position(), "%lu", (unsigned long) va_arg(ap, uint32_t));
+				break;
+			default:
+				*ptr++ = c;
+				continue;
+			}
+			ptr += strlen((char*) ptr);
+		}
+		*(ptr)=0;
+		va_end(ap);
+	}
+};
+
+#define BENCH_STATIONS 200
+#define BENCH_ROUNDS   20000
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+int main() {
+	static char a[4096], b[4096], c[4096];
+	uint16_t dur[BENCH_STATIONS];
+	srand(3);
+	for (int i = 0; i < BENCH_STATIONS; i++) dur[i] = (rand()%3) ? rand()%64800 : 0;
+
+	double t0 = now();
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		OldFiller f(a, sizeof(a));
+		for (int i = 0; i < BENCH_STATIONS-1; i++) f.emit_p(PSTR("$L,"), (unsigned long)dur[i]);
+		f.emit_p(PSTR("$L],\""), (unsigned long)dur[BENCH_STATIONS-1]);
+	}
+	double t1 = now();
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		BufferFiller f(b, sizeof(b));
+		for (int i = 0; i < BENCH_STATIONS-1; i++) f.emit_p(PSTR("$L,"), (unsigned long)dur[i]);
+		f.emit_p(PSTR("$L],\""), (unsigned long)dur[BENCH_STATIONS-1]);
+	}
+	double t2 = now();
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		BufferFiller f(c, sizeof(c));
+		for (int i = 0; i < BENCH_STATIONS; i++) {
+			if (i) f.emit_char(',');
+			f.emit_uint(dur[i]);
+		}
+		f.emit_p(PSTR("],\""));
+	}
+	double t3 = now();
+
+	if (strcmp(a, b) || strcmp(a, c)) {
+		printf("output differs\n");
+		return 1;
+	}
+	printf("%d stations: old emit_p %.2f us/row, emit_p %.2f us/row, typed %.2f us/row\n", BENCH_STATIONS,
+	       (t1-t0)/BENCH_ROUNDS*1e6, (t2-t1)/BENCH_ROUNDS*1e6, (t3-t2)/BENCH_ROUNDS*1e6);
+	return 0;
+}
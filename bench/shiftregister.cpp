@@ -0,0 +1,263 @@
+/* OpenSprinkler Unified Firmware
+ * Shift register backend check (OSPI)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/** Drives the bitbang, bulk and mock shift register backends with the
+ * bytes apply_all_station_bits hands them, and checks that a simulated
+ * chain of 74HC595s latches the same station bits for all of them. Also
+ * checks that unchanged bytes are not shifted out again, and that writing
+ * one pin of a group leaves the other pins of the group alone.
+ * gpio.cpp is linked against the fake gpiod below, not against libgpiod.
+ * Build and run with: make check
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <gpiod.h>
+#include "gpio.h"
+#include "utils.h"
+
+#define NBYTES (MAX_EXT_BOARDS+1)
+
+// OSPI wiring for the bitbang backend. gpio.cpp keeps the lines it has
+// requested, so the bulk backend is checked on another set of lines
+static const unsigned char bitbang_pins[] = {17, 22, 4, 27}; // oe, latch, clock, data
+static const unsigned char bulk_pins[] = {18, 23, 5, 26};
+static int pin_oe, pin_latch, pin_clock, pin_data; // lines the simulated chain is wired to
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { if(!(cond)) { printf("FAIL: %s\n", what); failures++; } } while(0)
+
+/** Fake gpiod: each line has a value, and lines requested together share
+ * a handle. As with the kernel, a write to a handle sets all of its lines,
+ * the lines not given a value are driven low */
+struct gpiod_line {
+	int pin;
+	int value;
+	int handle; // -1 if not requested
+};
+
+#define FAKE_MAX_HANDLES 16
+static struct gpiod_line fake_lines[GPIO_MAX];
+static struct gpiod_line *fake_handles[FAKE_MAX_HANDLES][GPIOD_LINE_BULK_MAX_LINES];
+static int fake_handle_n[FAKE_MAX_HANDLES];
+static int nhandles = 0;
+static int fake_chip;
+
+/** 74HC595 chain: clocks the data line in on a rising clock edge,
+ * and copies the chain to the outputs on a rising latch edge */
+static unsigned char chain[NBYTES*8];  // chain[0] is the bit clocked in last
+static unsigned char outputs[NBYTES*8];
+static unsigned long nlatch_edges = 0;
+static unsigned long nclock_edges = 0;
+static unsigned long nwrites = 0;
+static int data_on_edge = 0; // data line changed in the same write as a rising clock edge
+
+static void fake_set(int h, const int *values, int n) {
+	int old_clock = fake_lines[pin_clock].value;
+	int old_latch = fake_lines[pin_latch].value;
+	int old_data  = fake_lines[pin_data].value;
+	for(int i=0; i<fake_handle_n[h]; i++) {
+		fake_handles[h][i]->value = (i<n && values[i]) ? 1 : 0;
+	}
+	nwrites++;
+	if( !old_clock && fake_lines[pin_clock].value ) {
+		if( old_data != fake_lines[pin_data].value ) { data_on_edge++; }
+		memmove(chain+1, chain, sizeof(chain)-1);
+		chain[0] = fake_lines[pin_data].value;
+		nclock_edges++;
+	}
+	if( !old_latch && fake_lines[pin_latch].value ) {
+		memcpy(outputs, chain, sizeof(chain));
+		nlatch_edges++;
+	}
+}
+
+static int fake_request(struct gpiod_line **lines, int n, const int *values) {
+	if( nhandles >= FAKE_MAX_HANDLES ) { return -1; }
+	for(int i=0; i<n; i++) {
+		if( lines[i]->handle >= 0 ) { return -1; }
+	}
+	int h = nhandles++;
+	for(int i=0; i<n; i++) {
+		lines[i]->handle = h;
+		fake_handles[h][i] = lines[i];
+	}
+	fake_handle_n[h] = n;
+	if( values ) { fake_set(h, values, n); }
+	return 0;
+}
+
+extern "C" {
+struct gpiod_chip *gpiod_chip_open_by_name(const char*) { return (struct gpiod_chip*)&fake_chip; }
+void gpiod_chip_close(struct gpiod_chip*) {}
+const char *gpiod_chip_label(struct gpiod_chip*) { return "fake"; }
+struct gpiod_line *gpiod_chip_get_line(struct gpiod_chip*, unsigned int pin) {
+	if( pin >= GPIO_MAX ) { return NULL; }
+	fake_lines[pin].pin = pin;
+	return fake_lines + pin;
+}
+struct gpiod_chip_iter *gpiod_chip_iter_new(void) { return NULL; }
+void gpiod_chip_iter_free(struct gpiod_chip_iter*) {}
+void gpiod_chip_iter_free_noclose(struct gpiod_chip_iter*) {}
+struct gpiod_chip *gpiod_chip_iter_next(struct gpiod_chip_iter*) { return NULL; }
+int gpiod_line_request_input(struct gpiod_line *l, const char*) { return fake_request(&l, 1, NULL); }
+int gpiod_line_request_input_flags(struct gpiod_line *l, const char*, int) { return fake_request(&l, 1, NULL); }
+int gpiod_line_request_output(struct gpiod_line *l, const char*, int v) { return fake_request(&l, 1, &v); }
+int gpiod_line_request_falling_edge_events(struct gpiod_line*, const char*) { return -1; }
+int gpiod_line_request_falling_edge_events_flags(struct gpiod_line*, const char*, int) { return -1; }
+int gpiod_line_request_bulk_output(struct gpiod_line_bulk *b, const char*, const int *v) { return fake_request(b->lines, b->num_lines, v); }
+void gpiod_line_release(struct gpiod_line *l) { l->handle = -1; }
+void gpiod_line_release_bulk(struct gpiod_line_bulk *b) { for(unsigned i=0; i<b->num_lines; i++) { b->lines[i]->handle = -1; } }
+bool gpiod_line_is_requested(struct gpiod_line *l) { return l->handle >= 0; }
+int gpiod_line_get_value(struct gpiod_line *l) { return l->value; }
+int gpiod_line_set_value(struct gpiod_line *l, int v) {
+	if( l->handle < 0 ) { return -1; }
+	fake_set(l->handle, &v, 1);
+	return 0;
+}
+int gpiod_line_set_value_bulk(struct gpiod_line_bulk *b, const int *v) {
+	if( !b->num_lines || b->lines[0]->handle < 0 ) { return -1; }
+	fake_set(b->lines[0]->handle, v, b->num_lines);
+	return 0;
+}
+int gpiod_line_event_wait(struct gpiod_line*, const struct timespec*) { return -1; }
+int gpiod_line_event_read(struct gpiod_line*, struct gpiod_line_event*) { return -1; }
+int gpiod_line_event_read_multiple(struct gpiod_line*, struct gpiod_line_event*, unsigned int) { return -1; }
+int gpiod_line_event_get_fd(struct gpiod_line*) { return -1; }
+}
+
+// gpio.cpp needs this from utils.cpp
+BoardType get_board_type() { return BoardType::Unknown; }
+
+/** The bytes apply_all_station_bits hands the backend: highest board first */
+static void station_bytes(const unsigned char *station_bits, unsigned char *sbits) {
+	for(unsigned char bid=0; bid<=MAX_EXT_BOARDS; bid++) {
+		sbits[bid] = station_bits[MAX_EXT_BOARDS-bid];
+	}
+}
+
+/** Station bits of each board as latched by the simulated chain:
+ * the main board is the one nearest to the data line */
+static void latched_station_bits(unsigned char *station_bits) {
+	for(int bid=0; bid<NBYTES; bid++) {
+		unsigned char b = 0;
+		for(int s=0; s<8; s++) {
+			if( outputs[bid*8+s] ) { b |= 1<<s; }
+		}
+		station_bits[bid] = b;
+	}
+}
+
+static void fill(unsigned char *station_bits, unsigned seed) {
+	for(int bid=0; bid<NBYTES; bid++) {
+		seed = seed*1103515245u+12345u;
+		station_bits[bid] = seed>>16;
+	}
+}
+
+/** Writes a few station patterns, and checks the latched bits and that
+ * the shift register skips patterns it has latched already */
+static void check_backend(ShiftRegister *sr, const char *expect_name, MockShiftRegister *mock) {
+	char what[128];
+	unsigned char bits[NBYTES], sbits[NBYTES], latched[NBYTES];
+	printf("%s\n", sr->name());
+	snprintf(what, sizeof(what), "%s: backend is %s", sr->name(), expect_name);
+	CHECK(!strcmp(sr->name(), expect_name), what);
+	int oe = fake_lines[pin_oe].value;
+	for(unsigned seed=1; seed<=20; seed++) {
+		fill(bits, seed);
+		if( seed == 5 ) { memset(bits, 0, sizeof(bits)); }
+		if( seed == 6 ) { memset(bits, 0xFF, sizeof(bits)); }
+		station_bytes(bits, sbits);
+		unsigned long latches = mock ? mock->nlatches : nlatch_edges;
+		sr->write(sbits, sizeof(sbits));
+		if( mock ) {
+			CHECK(mock->nlatches == latches+1, "mock: latched once");
+			CHECK(mock->nbytes == NBYTES && !memcmp(mock->bytes, sbits, NBYTES), "mock: latched bytes");
+		} else {
+			snprintf(what, sizeof(what), "%s: latched once for seed %u", sr->name(), seed);
+			CHECK(nlatch_edges == latches+1, what);
+			latched_station_bits(latched);
+			snprintf(what, sizeof(what), "%s: latched station bits for seed %u", sr->name(), seed);
+			CHECK(!memcmp(latched, bits, NBYTES), what);
+		}
+		// the same bytes again: nothing is written
+		unsigned long writes = nwrites;
+		latches = mock ? mock->nlatches : nlatch_edges;
+		sr->write(sbits, sizeof(sbits));
+		snprintf(what, sizeof(what), "%s: unchanged bytes skipped", sr->name());
+		CHECK(nwrites == writes && (mock ? mock->nlatches : nlatch_edges) == latches, what);
+	}
+	snprintf(what, sizeof(what), "%s: output enable left alone", sr->name());
+	CHECK(fake_lines[pin_oe].value == oe, what);
+	snprintf(what, sizeof(what), "%s: data line stable on rising clock edges", sr->name());
+	CHECK(data_on_edge == 0, what);
+}
+
+/** Wires the simulated chain to the given oe, latch, clock and data lines */
+static void wire(const unsigned char *pins) {
+	pin_oe = pins[0];
+	pin_latch = pins[1];
+	pin_clock = pins[2];
+	pin_data = pins[3];
+	memset(chain, 0, sizeof(chain));
+	memset(outputs, 0, sizeof(outputs));
+	data_on_edge = 0;
+}
+
+int main() {
+	for(int i=0; i<GPIO_MAX; i++) { fake_lines[i].handle = -1; }
+
+	// bitbang: each pin requested and written on its own
+	wire(bitbang_pins);
+	pinMode(pin_latch, OUTPUT);
+	pinMode(pin_clock, OUTPUT);
+	pinMode(pin_data, OUTPUT);
+	BitbangShiftRegister bitbang(pin_latch, pin_clock, pin_data);
+	check_backend(&bitbang, "bitbang", NULL);
+	unsigned char bitbang_outputs[sizeof(outputs)];
+	memcpy(bitbang_outputs, outputs, sizeof(outputs));
+
+	// bulk: the pins are requested as one group
+	wire(bulk_pins);
+	ShiftRegister *bulk = ShiftRegister::open(pin_oe, pin_latch, pin_clock, pin_data);
+	CHECK(fake_lines[pin_oe].value == HIGH, "bulk: output enable starts high");
+	check_backend(bulk, "bulk", NULL);
+	CHECK(!memcmp(outputs, bitbang_outputs, sizeof(outputs)), "bulk: same outputs as bitbang");
+
+	// a single write to a grouped pin changes only that pin
+	digitalWrite(pin_oe, LOW);
+	CHECK(fake_lines[pin_oe].value == LOW, "group: output enable lowered");
+	CHECK(fake_lines[pin_latch].value == HIGH, "group: latch left high");
+	CHECK(!memcmp(outputs, bitbang_outputs, sizeof(outputs)), "group: outputs unchanged");
+	delete bulk;
+
+	// mock: records the bytes, drives nothing
+	MockShiftRegister mock;
+	check_backend(&mock, "mock", &mock);
+
+	if( failures ) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,220 @@
+/* OpenSprinkler Unified Firmware
+ * Data file transaction check (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/** Checks file_begin/file_commit/file_abort of utils.cpp on a scratch
+ * data folder: staged writes are seen by the thread's reads but not by
+ * the files, a commit writes all of them, an abort (also of a nested
+ * transaction) drops all of them. A power loss is simulated by a child
+ * that commits and exits right after the journal is written: file_recover
+ * applies the journal, and drops it if it is torn or fails its checksum.
+ * Build and run with: make check
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "OpenSprinkler.h"
+
+#define DATA_DIR "/tmp/os_transaction_check/"
+#define FILE_A   "a.dat"
+#define FILE_B   "b.dat"
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { if(!(cond)) { printf("FAIL: %s\n", what); failures++; } } while(0)
+
+// utils.cpp needs this from OpenSprinkler.cpp
+NVConData OpenSprinkler::nvdata;
+
+/** A power loss at the first fsync: the one that puts the journal's entry
+ * in the data folder on disk, after the journal is written and synced */
+static bool crash_at_fsync = false;
+extern "C" int __real_fsync(int fd);
+extern "C" int __wrap_fsync(int fd) {
+	if (crash_at_fsync) _exit(0);
+	return __real_fsync(fd);
+}
+
+/** Contents of a data file as on disk, read without the firmware's mappings */
+static int disk_read(const char *name, char *buf, int size) {
+	char path[128];
+	snprintf(path, sizeof(path), DATA_DIR "%s", name);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	int n = read(fd, buf, size-1);
+	close(fd);
+	buf[n < 0 ? 0 : n] = 0;
+	return n;
+}
+
+static bool disk_is(const char *name, const char *expect) {
+	char buf[64];
+	return disk_read(name, buf, sizeof(buf)) >= 0 && !strcmp(buf, expect);
+}
+
+static bool journal_exists() {
+	struct stat st;
+	return stat(DATA_DIR JOURNAL_FILENAME, &st) == 0;
+}
+
+static void reset(const char *a, const char *b) {
+	remove(DATA_DIR JOURNAL_FILENAME);
+	remove_file(FILE_A);
+	remove_file(FILE_B);
+	file_write_block(FILE_A, a, 0, strlen(a));
+	file_write_block(FILE_B, b, 0, strlen(b));
+}
+
+/** Commits in a child that loses power once the journal is written, and
+ * leaves the journal as the power loss left it */
+static void commit_and_crash(const char *a, const char *b) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		file_begin();
+		file_write_block(FILE_A, a, 0, strlen(a));
+		file_write_block(FILE_B, b, 0, strlen(b));
+		crash_at_fsync = true;
+		file_commit();
+		_exit(1); // not reached
+	}
+	int status;
+	waitpid(pid, &status, 0);
+}
+
+static void check_commit() {
+	char buf[16] = {0};
+	reset("aaaa", "bbbb");
+	file_begin();
+	file_write_block(FILE_A, "AA", 1, 2);
+	file_write_block(FILE_B, "BBBBBB", 0, 6);
+	file_read_block(FILE_A, buf, 0, 4);
+	CHECK(!memcmp(buf, "aAAa", 4), "commit: staged writes are read back");
+	CHECK(disk_is(FILE_A, "aaaa") && disk_is(FILE_B, "bbbb"), "commit: staged writes are not in the files");
+	CHECK(file_transaction(), "commit: in a transaction");
+	CHECK(file_commit(), "commit: journaled");
+	CHECK(!file_transaction(), "commit: transaction ended");
+	CHECK(disk_is(FILE_A, "aAAa") && disk_is(FILE_B, "BBBBBB"), "commit: all writes in the files");
+	CHECK(!journal_exists(), "commit: journal removed");
+}
+
+static void check_abort() {
+	char buf[16] = {0};
+	reset("aaaa", "bbbb");
+	file_begin();
+	file_write_block(FILE_A, "AAAA", 0, 4);
+	file_write_block(FILE_B, "BBBB", 0, 4);
+	CHECK(file_abort(), "abort: had writes to drop");
+	file_read_block(FILE_A, buf, 0, 4);
+	CHECK(!memcmp(buf, "aaaa", 4), "abort: writes not read back");
+	CHECK(disk_is(FILE_A, "aaaa") && disk_is(FILE_B, "bbbb"), "abort: no writes in the files");
+
+	// an inner abort drops the writes of the outer transaction too
+	file_begin();
+	file_write_block(FILE_A, "AAAA", 0, 4);
+	file_begin();
+	file_write_block(FILE_B, "BBBB", 0, 4);
+	CHECK(!file_abort(), "nested abort: nothing dropped before the outer transaction ends");
+	file_write_block(FILE_B, "CCCC", 0, 4);
+	CHECK(!file_commit(), "nested abort: outer commit fails");
+	CHECK(!file_transaction(), "nested abort: transaction ended");
+	CHECK(disk_is(FILE_A, "aaaa") && disk_is(FILE_B, "bbbb"), "nested abort: no writes in the files");
+
+	// an inner commit waits for the outer one
+	file_begin();
+	file_begin();
+	file_write_block(FILE_A, "AAAA", 0, 4);
+	CHECK(file_commit(), "nested commit: inner commit");
+	CHECK(disk_is(FILE_A, "aaaa"), "nested commit: inner commit writes nothing");
+	CHECK(file_commit(), "nested commit: outer commit");
+	CHECK(disk_is(FILE_A, "AAAA"), "nested commit: outer commit writes");
+
+	// the FileTransaction guard aborts when it goes out of scope
+	{
+		FileTransaction txn;
+		file_write_block(FILE_B, "XXXX", 0, 4);
+	}
+	CHECK(!file_transaction() && disk_is(FILE_B, "bbbb"), "guard: aborted when left without commit");
+}
+
+static void check_recover() {
+	char journal[4096];
+	int n;
+
+	// a complete journal is applied
+	reset("aaaa", "bbbb");
+	commit_and_crash("AAAA", "BBBBBB");
+	CHECK(journal_exists(), "recover: journal left by the power loss");
+	CHECK(disk_is(FILE_A, "aaaa") && disk_is(FILE_B, "bbbb"), "recover: no writes before recovery");
+	file_recover();
+	CHECK(disk_is(FILE_A, "AAAA") && disk_is(FILE_B, "BBBBBB"), "recover: complete journal applied");
+	CHECK(!journal_exists(), "recover: journal removed");
+
+	// a torn journal is dropped
+	reset("aaaa", "bbbb");
+	commit_and_crash("AAAA", "BBBBBB");
+	n = disk_read(JOURNAL_FILENAME, journal, sizeof(journal));
+	CHECK(n > 8, "torn: journal written");
+	if (n > 8) truncate(DATA_DIR JOURNAL_FILENAME, n-3);
+	file_recover();
+	CHECK(disk_is(FILE_A, "aaaa") && disk_is(FILE_B, "bbbb"), "torn: journal dropped");
+	CHECK(!journal_exists(), "torn: journal removed");
+
+	// a journal that fails its checksum is dropped
+	reset("aaaa", "bbbb");
+	commit_and_crash("AAAA", "BBBBBB");
+	int fd = open(DATA_DIR JOURNAL_FILENAME, O_RDWR);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		char c;
+		pread(fd, &c, 1, st.st_size-1);
+		c ^= 0x20;
+		pwrite(fd, &c, 1, st.st_size-1);
+	}
+	if (fd >= 0) close(fd);
+	file_recover();
+	CHECK(disk_is(FILE_A, "aaaa") && disk_is(FILE_B, "bbbb"), "checksum: journal dropped");
+	CHECK(!journal_exists(), "checksum: journal removed");
+
+	// no journal: nothing to do
+	file_recover();
+	CHECK(disk_is(FILE_A, "aaaa"), "no journal: files left alone");
+}
+
+int main() {
+	system("rm -rf " DATA_DIR " && mkdir -p " DATA_DIR);
+	set_data_dir(DATA_DIR);
+
+	check_commit();
+	check_abort();
+	check_recover();
+
+	system("rm -rf " DATA_DIR);
+	if (failures) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
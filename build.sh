@@ -21,8 +21,9 @@ function enable_i2c {
 }
 
 DEBUG=""
+LOOP=""
 
-while getopts ":s:d" opt; do
+while getopts ":s:dp" opt; do
   case $opt in
     s)
 	  SILENT=true
@@ -32,6 +33,10 @@ while getopts ":s:d" opt; do
       DEBUG="-DENABLE_DEBUG -DSERIAL_DEBUG"
 	  command shift
       ;;
+    p)
+      LOOP="-DPOLLING_LOOP"
+	  command shift
+      ;;
   esac
 done
 echo "Building OpenSprinkler..."
@@ -48,16 +53,16 @@ fi
 
 if [ "$1" == "demo" ]; then
 	echo "Installing required libraries..."
-	apt-get install -y libmosquitto-dev libssl-dev
+	apt-get install -y libmosquitto-dev libssl-dev zlib1g-dev
 	echo "Compiling demo firmware..."
 
     ws=$(ls external/TinyWebsockets/tiny_websockets_lib/src/*.cpp)
     otf=$(ls external/OpenThings-Framework-Firmware-Library/*.cpp)
-    g++ -o OpenSprinkler -DDEMO -DSMTP_OPENSSL $DEBUG -std=c++14 -include string.h -include cstdint main.cpp OpenSprinkler.cpp program.cpp opensprinkler_server.cpp utils.cpp weather.cpp gpio.cpp mqtt.cpp notifier.cpp smtp.c RCSwitch.cpp -Iexternal/TinyWebsockets/tiny_websockets_lib/include $ws -Iexternal/OpenThings-Framework-Firmware-Library/ $otf -lpthread -lmosquitto -lssl -lcrypto
+    g++ -o OpenSprinkler -DDEMO -DSMTP_OPENSSL $DEBUG $LOOP -std=c++14 -include string.h -include cstdint main.cpp OpenSprinkler.cpp program.cpp eventloop.cpp logstore.cpp logwriter.cpp ioworker.cpp eventstream.cpp opensprinkler_server.cpp utils.cpp weather.cpp gpio.cpp mqtt.cpp notifier.cpp smtp.c RCSwitch.cpp -Iexternal/TinyWebsockets/tiny_websockets_lib/include $ws -Iexternal/OpenThings-Framework-Firmware-Library/ $otf -lpthread -lmosquitto -lssl -lcrypto -lz -Wl,--wrap=listen,--wrap=accept,--wrap=accept4
 else
 	echo "Installing required libraries..."
 	apt-get update
-	apt-get install -y libmosquitto-dev libi2c-dev libssl-dev libgpiod-dev gpiod
+	apt-get install -y libmosquitto-dev libi2c-dev libssl-dev libgpiod-dev gpiod zlib1g-dev
     enable_i2c
 
 	USEGPIO="-DLIBGPIOD"
@@ -67,7 +72,7 @@ else
 
     ws=$(ls external/TinyWebsockets/tiny_websockets_lib/src/*.cpp)
     otf=$(ls external/OpenThings-Framework-Firmware-Library/*.cpp)
-    g++ -o OpenSprinkler -DOSPI $USEGPIO -DSMTP_OPENSSL $DEBUG -std=c++14 -include string.h -include cstdint main.cpp OpenSprinkler.cpp program.cpp opensprinkler_server.cpp utils.cpp weather.cpp gpio.cpp mqtt.cpp notifier.cpp smtp.c RCSwitch.cpp -Iexternal/TinyWebsockets/tiny_websockets_lib/include $ws -Iexternal/OpenThings-Framework-Firmware-Library/ $otf -lpthread -lmosquitto -lssl -lcrypto -li2c $GPIOLIB
+    g++ -o OpenSprinkler -DOSPI $USEGPIO -DSMTP_OPENSSL $DEBUG $LOOP -std=c++14 -include string.h -include cstdint main.cpp OpenSprinkler.cpp program.cpp eventloop.cpp logstore.cpp logwriter.cpp ioworker.cpp eventstream.cpp opensprinkler_server.cpp utils.cpp weather.cpp gpio.cpp mqtt.cpp notifier.cpp smtp.c RCSwitch.cpp -Iexternal/TinyWebsockets/tiny_websockets_lib/include $ws -Iexternal/OpenThings-Framework-Firmware-Library/ $otf -lpthread -lmosquitto -lssl -lcrypto -lz -li2c $GPIOLIB -Wl,--wrap=listen,--wrap=accept,--wrap=accept4
 
 fi
 
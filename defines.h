@@ -55,6 +55,7 @@ typedef unsigned long ulong;
 #define NVCON_FILENAME        "nvcon.dat"   // non-volatile controller data file, see OpenSprinkler.h --> struct NVConData
 #define PROG_FILENAME         "prog.dat"    // program data file
 #define DONE_FILENAME         "done.dat"    // used to indicate the completion of all files
+#define JOURNAL_FILENAME      "journal.dat" // changes being committed (Linux)
 
 /** Station macro defines */
 #define STN_TYPE_STANDARD    0x00 // standard solenoid station
@@ -160,6 +161,10 @@ typedef unsigned long ulong;
 	#define SUPPORT_HTTPS
 #endif
 
+#if !defined(ARDUINO) && !defined(POLLING_LOOP)
+	#define USE_EVENT_LOOP  // Linux: sleep in epoll until there is work to do, build with -DPOLLING_LOOP to poll every 1ms instead
+#endif
+
 /* Weather Adjustment Methods */
 enum {
 	WEATHER_METHOD_MANUAL = 0,
@@ -184,6 +189,15 @@ enum {
 	NUM_MASTER_OPTS,
 };
 
+/* State domains, each with a version that counts its changes */
+enum {
+	STATE_PROGRAMS = 0,
+	STATE_STATIONS,
+	STATE_OPTIONS,
+	STATE_STATUS, // station bits
+	NUM_STATE_DOMAINS,
+};
+
 // Sequential Groups
 #define NUM_SEQ_GROUPS		4
 #define PARALLEL_GROUP_ID	255
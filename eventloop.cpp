@@ -0,0 +1,192 @@
+/* OpenSprinkler Unified Firmware
+ * Event loop functions (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "eventloop.h"
+
+#if defined(USE_EVENT_LOOP)
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define EVENT_DATA_TIMER  0xFFFFFFFF
+#define EVENT_DATA_SOCKET 0xFFFFFFFE
+
+struct EventWatchStruct {
+	int fd;
+	void (*handler)(int);
+	int arg;
+};
+
+static EventWatchStruct watches[EVENT_LOOP_MAX_WATCHES];
+static unsigned char nwatches = 0;
+
+int EventLoop::epfd = -1;
+int EventLoop::tfd = -1;
+
+bool EventLoop::begin() {
+	if (epfd >= 0) return true;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		DEBUG_PRINTLN("epoll_create1 failed");
+		return false;
+	}
+	tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (tfd < 0) {
+		DEBUG_PRINTLN("timerfd_create failed");
+		close(epfd);
+		epfd = -1;
+		return false;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENT_DATA_TIMER;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+	arm_timer();
+	return true;
+}
+
+/** Fire at every second boundary of the wall clock, which is when
+ * os.now_tz() moves on. The timer is cancelled if the clock is set,
+ * so it can be re-aligned */
+void EventLoop::arm_timer() {
+	struct itimerspec its;
+	clock_gettime(CLOCK_REALTIME, &its.it_value);
+	its.it_value.tv_sec++;
+	its.it_value.tv_nsec = 0;
+	its.it_interval.tv_sec = 1;
+	its.it_interval.tv_nsec = 0;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME|TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+/** Sockets are edge-triggered: a socket that stays readable because nobody
+ * reads it does not keep waking the loop up. epoll drops closed fds by
+ * itself, and an fd that is already registered returns EEXIST */
+bool EventLoop::add_socket(int fd) {
+	if (epfd < 0 || fd < 0) return false;
+	struct epoll_event ev;
+	ev.events = EPOLLIN|EPOLLRDHUP|EPOLLET;
+	ev.data.u32 = EVENT_DATA_SOCKET;
+	return !epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) || errno == EEXIST;
+}
+
+void EventLoop::remove_socket(int fd) {
+	if (epfd < 0 || fd < 0) return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+bool EventLoop::watch(int fd, void (*handler)(int), int arg) {
+	if (epfd < 0 || fd < 0) return false;
+	if (nwatches >= EVENT_LOOP_MAX_WATCHES) {
+		DEBUG_PRINTF("event loop: no room to watch fd %d\n", fd);
+		return false;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = nwatches;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) return false;
+	watches[nwatches].fd = fd;
+	watches[nwatches].handler = handler;
+	watches[nwatches].arg = arg;
+	nwatches++;
+	return true;
+}
+
+void EventLoop::unwatch(int fd) {
+	unsigned char i;
+	for (i = 0; i < nwatches; i++) {
+		if (watches[i].fd == fd) break;
+	}
+	if (i == nwatches) return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	// move the last watch into the free slot and update its epoll data
+	nwatches--;
+	if (i < nwatches) {
+		watches[i] = watches[nwatches];
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, watches[i].fd, &ev);
+	}
+}
+
+unsigned char EventLoop::wait(int timeout) {
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int n = epoll_wait(epfd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+	unsigned char ready = 0;
+	for (int i = 0; i < n; i++) {
+		uint32_t data = events[i].data.u32;
+		if (data == EVENT_DATA_TIMER) {
+			uint64_t expirations;
+			if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED) {
+				arm_timer(); // the clock was set
+			}
+			ready |= EVENT_TIMER;
+		} else if (data == EVENT_DATA_SOCKET) {
+			ready |= EVENT_SOCKET;
+		} else if (data < nwatches) {
+			watches[data].handler(watches[data].arg);
+			ready |= EVENT_WATCH;
+		}
+	}
+	return ready;
+}
+
+#endif
+
+#if !defined(ARDUINO)
+/** The web server opens its sockets inside the OTF library. The build links
+ * with -Wl,--wrap=listen,--wrap=accept,--wrap=accept4, so the listening
+ * socket and each client it accepts are registered as they are created.
+ * Sockets of shared libraries such as mosquitto are not wrapped, and are
+ * added by their owners */
+#include <sys/socket.h>
+
+extern "C" {
+int __real_listen(int fd, int backlog);
+int __real_accept(int fd, struct sockaddr *addr, socklen_t *len);
+int __real_accept4(int fd, struct sockaddr *addr, socklen_t *len, int flags);
+
+int __wrap_listen(int fd, int backlog) {
+	int ret = __real_listen(fd, backlog);
+#if defined(USE_EVENT_LOOP)
+	if (!ret) EventLoop::add_socket(fd);
+#endif
+	return ret;
+}
+
+int __wrap_accept(int fd, struct sockaddr *addr, socklen_t *len) {
+	int cfd = __real_accept(fd, addr, len);
+#if defined(USE_EVENT_LOOP)
+	EventLoop::add_socket(cfd);
+#endif
+	return cfd;
+}
+
+int __wrap_accept4(int fd, struct sockaddr *addr, socklen_t *len, int flags) {
+	int cfd = __real_accept4(fd, addr, len, flags);
+#if defined(USE_EVENT_LOOP)
+	EventLoop::add_socket(cfd);
+#endif
+	return cfd;
+}
+}
+#endif
@@ -0,0 +1,57 @@
+/* OpenSprinkler Unified Firmware
+ * Event loop header file (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EVENTLOOP_H
+#define _EVENTLOOP_H
+
+#include "defines.h"
+
+#if defined(USE_EVENT_LOOP)
+
+#define EVENT_LOOP_MAX_WATCHES 8    // maximum number of fds with a handler
+#define EVENT_LOOP_MAX_EVENTS  16   // maximum number of events taken from epoll at a time
+
+/** Event sources returned by EventLoop::wait */
+#define EVENT_TIMER   0x01  // second tick
+#define EVENT_SOCKET  0x02  // activity on a network socket
+#define EVENT_WATCH   0x04  // a watched fd was handled
+
+/** Blocks the main loop until there is work to do: the next second boundary,
+ * activity on a registered socket (the web server and event stream sockets,
+ * the MQTT broker connection), or a watched fd such as a gpio line event.
+ * The web server's sockets are registered by the listen and accept wrappers
+ * in eventloop.cpp */
+class EventLoop {
+public:
+	static bool begin(); // returns false if epoll or the timer is not available
+	static unsigned char wait(int timeout); // timeout in ms, -1 to wait for the next second tick
+	static bool watch(int fd, void (*handler)(int), int arg); // handler(arg) is called when fd is readable
+	static void unwatch(int fd);
+	static bool add_socket(int fd); // wake up on activity on fd, until it is removed or closed
+	static void remove_socket(int fd);
+private:
+	static int epfd;
+	static int tfd;
+	static void arm_timer();
+};
+
+#endif
+
+#endif	// _EVENTLOOP_H
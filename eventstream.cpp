@@ -0,0 +1,277 @@
+/* OpenSprinkler Unified Firmware
+ * Event stream functions (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "eventstream.h"
+
+#if !defined(ARDUINO)
+
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "OpenSprinkler.h"
+#include "program.h"
+#include "eventloop.h"
+
+extern OpenSprinkler os;
+extern ProgramData pd;
+extern float flow_last_gpm;
+extern ulong get_flowcount_rt();
+extern unsigned char findKeyVal (const char *str,char *strbuf, uint16_t maxlen,const char *key,bool key_in_pgm=false,uint8_t *keyfound=NULL);
+
+#define CLIENT_FREE      0
+#define CLIENT_REQUEST   1  // waiting for the request header
+#define CLIENT_STREAMING 2
+
+struct EventClientStruct {
+	int fd;
+	unsigned char state;
+	uint16_t len;
+	time_t since; // when the client connected
+	char req[EVENT_STREAM_REQUEST_SIZE];
+};
+
+static EventClientStruct clients[EVENT_STREAM_MAX_CLIENTS];
+static unsigned char nstreaming = 0;
+static int last_nq = -1; // queue length last sent, -1 to send it again
+
+int EventStream::lfd = -1;
+
+bool EventStream::begin(uint16_t port) {
+	if (lfd >= 0) return true;
+	lfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (lfd < 0) return false;
+	int on = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(lfd, EVENT_STREAM_MAX_CLIENTS)) {
+		DEBUG_PRINTF("event stream: cannot listen on port %d\n", port);
+		close(lfd);
+		lfd = -1;
+		return false;
+	}
+#if defined(USE_EVENT_LOOP)
+	EventLoop::add_socket(lfd);
+#endif
+	DEBUG_PRINTF("event stream on port %d\n", port);
+	return true;
+}
+
+void EventStream::end() {
+	for (unsigned char i = 0; i < EVENT_STREAM_MAX_CLIENTS; i++) {
+		if (clients[i].state != CLIENT_FREE) drop(i);
+	}
+	if (lfd >= 0) {
+#if defined(USE_EVENT_LOOP)
+		EventLoop::remove_socket(lfd);
+#endif
+		close(lfd);
+		lfd = -1;
+	}
+}
+
+void EventStream::drop(unsigned char i) {
+	EventClientStruct *c = clients + i;
+	if (c->state == CLIENT_STREAMING) nstreaming--;
+#if defined(USE_EVENT_LOOP)
+	EventLoop::remove_socket(c->fd);
+#endif
+	close(c->fd);
+	c->state = CLIENT_FREE;
+}
+
+void EventStream::accept_clients() {
+	int fd;
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		unsigned char i;
+		for (i = 0; i < EVENT_STREAM_MAX_CLIENTS; i++) {
+			if (clients[i].state == CLIENT_FREE) break;
+		}
+		if (i == EVENT_STREAM_MAX_CLIENTS) {
+			static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+			send(fd, busy, sizeof(busy)-1, MSG_NOSIGNAL|MSG_DONTWAIT);
+			close(fd);
+			continue;
+		}
+#if defined(USE_EVENT_LOOP)
+		EventLoop::add_socket(fd);
+#endif
+		clients[i].fd = fd;
+		clients[i].state = CLIENT_REQUEST;
+		clients[i].len = 0;
+		clients[i].since = time(NULL);
+	}
+}
+
+/** Read what the client has sent so far. Once the header is complete,
+ * check the path and password, then either start the stream or answer
+ * with an error and close */
+void EventStream::read_request(unsigned char i) {
+	EventClientStruct *c = clients + i;
+	int n = recv(c->fd, c->req + c->len, EVENT_STREAM_REQUEST_SIZE - 1 - c->len, MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		drop(i);
+		return;
+	}
+	if (n > 0) c->len += n;
+	c->req[c->len] = 0;
+	if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+		if (c->len < EVENT_STREAM_REQUEST_SIZE - 1 && time(NULL) - c->since < EVENT_STREAM_TIMEOUT) return;
+		drop(i);
+		return;
+	}
+
+	const char *reply = NULL;
+	char *p = c->req;
+	if (strncmp(p, "GET /events", 11) || (p[11] != ' ' && p[11] != '?')) {
+		reply = "HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n";
+	} else {
+		// the query ends at the space before the protocol
+		char *q = p + 11;
+		char *e = strchr(q, ' ');
+		if (e) *e = 0;
+		bool allowed = true;
+#if !defined(DEMO)
+		if (!os.iopts[IOPT_IGNORE_PASSWORD]) {
+			char pw[TMP_BUFFER_SIZE];
+			allowed = (*q == '?') && findKeyVal(q + 1, pw, sizeof(pw), "pw") && os.password_verify(pw);
+		}
+#endif
+		if (!allowed) reply = "HTTP/1.1 401 Unauthorized\r\nConnection: close\r\n\r\n";
+	}
+	if (reply) {
+		send(c->fd, reply, strlen(reply), MSG_NOSIGNAL|MSG_DONTWAIT);
+		drop(i);
+		return;
+	}
+
+	static const char header[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n"
+		"retry: 3000\n\n";
+	if (send(c->fd, header, sizeof(header)-1, MSG_NOSIGNAL|MSG_DONTWAIT) != (ssize_t)sizeof(header)-1) {
+		drop(i);
+		return;
+	}
+	c->state = CLIENT_STREAMING;
+	nstreaming++;
+	last_nq = -1; // start the new client off with the queue state
+}
+
+/** Write a whole event to every streaming client. A client whose socket
+ * buffer cannot take it is too slow or gone, and is dropped rather than
+ * left with half an event */
+void EventStream::send_all(const char *buf, int len) {
+	for (unsigned char i = 0; i < EVENT_STREAM_MAX_CLIENTS; i++) {
+		if (clients[i].state != CLIENT_STREAMING) continue;
+		if (send(clients[i].fd, buf, len, MSG_NOSIGNAL|MSG_DONTWAIT) != len) drop(i);
+	}
+}
+
+void EventStream::loop() {
+	if (lfd < 0) return;
+	accept_clients();
+	for (unsigned char i = 0; i < EVENT_STREAM_MAX_CLIENTS; i++) {
+		if (clients[i].state == CLIENT_REQUEST) read_request(i);
+	}
+	if (!nstreaming) return;
+
+	char buf[128];
+	int len;
+	// queue length and pause state
+	static unsigned char last_pq = 0;
+	if (pd.nqueue != last_nq || os.status.pause_state != last_pq) {
+		last_nq = pd.nqueue;
+		last_pq = os.status.pause_state;
+		len = snprintf(buf, sizeof(buf), "event: queue\ndata: {\"nq\":%d,\"pq\":%d,\"pt\":%d}\n\n",
+		               last_nq, last_pq, (int)os.pause_timer);
+		send_all(buf, len);
+	}
+	// real-time flow rate, only when a flow sensor is connected
+	static ulong last_rt = 0;
+	if (os.iopts[IOPT_SENSOR1_TYPE] == SENSOR_TYPE_FLOW && get_flowcount_rt() != last_rt) {
+		last_rt = get_flowcount_rt();
+		len = snprintf(buf, sizeof(buf), "event: flowrate\ndata: {\"flcrt\":%lu,\"flwrt\":%d}\n\n",
+		               last_rt, FLOWCOUNT_RT_WINDOW);
+		send_all(buf, len);
+	}
+	// a comment now and then finds the clients that went away
+	static time_t last_keepalive = 0;
+	time_t now = time(NULL);
+	if (now - last_keepalive >= EVENT_STREAM_KEEPALIVE) {
+		last_keepalive = now;
+		send_all(":\n\n", 3);
+	}
+}
+
+void EventStream::push(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
+	if (!nstreaming) return;
+	char buf[160];
+	int len = 0;
+	switch (type) {
+	case NOTIFY_STATION_ON:
+		len = snprintf(buf, sizeof(buf), "event: station\ndata: {\"sid\":%u,\"on\":1,\"dur\":%lu}\n\n",
+		               lval, (ulong)fval);
+		break;
+	case NOTIFY_STATION_OFF:
+		len = snprintf(buf, sizeof(buf), "event: station\ndata: {\"sid\":%u,\"on\":0,\"dur\":%lu}\n\n",
+		               lval, (ulong)fval);
+		break;
+	case NOTIFY_FLOW_ALERT:
+		len = snprintf(buf, sizeof(buf), "event: flowalert\ndata: {\"sid\":%u,\"dur\":%lu,\"gpm\":%.2f}\n\n",
+		               lval, (ulong)fval, flow_last_gpm);
+		break;
+	case NOTIFY_PROGRAM_SCHED:
+		len = snprintf(buf, sizeof(buf), "event: program\ndata: {\"pid\":%u,\"wl\":%d,\"manual\":%d}\n\n",
+		               lval, (int)fval, bval);
+		break;
+	case NOTIFY_SENSOR1:
+	case NOTIFY_SENSOR2:
+		len = snprintf(buf, sizeof(buf), "event: sensor\ndata: {\"sensor\":%d,\"on\":%d}\n\n",
+		               type == NOTIFY_SENSOR1 ? 1 : 2, (int)fval);
+		break;
+	case NOTIFY_RAINDELAY:
+		len = snprintf(buf, sizeof(buf), "event: raindelay\ndata: {\"on\":%d,\"rdst\":%u}\n\n",
+		               (int)fval, os.nvdata.rd_stop_time);
+		break;
+	case NOTIFY_FLOWSENSOR:
+		len = snprintf(buf, sizeof(buf), "event: flow\ndata: {\"count\":%u}\n\n", lval);
+		break;
+	case NOTIFY_WEATHER_UPDATE:
+		len = snprintf(buf, sizeof(buf), "event: weather\ndata: {\"wl\":%d}\n\n", (int)fval);
+		break;
+	case NOTIFY_REBOOT:
+		len = snprintf(buf, sizeof(buf), "event: reboot\ndata: {}\n\n");
+		break;
+	default:
+		return;
+	}
+	if (len > 0 && len < (int)sizeof(buf)) send_all(buf, len);
+}
+
+#endif
@@ -0,0 +1,59 @@
+/* OpenSprinkler Unified Firmware
+ * Event stream header file (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EVENTSTREAM_H
+#define _EVENTSTREAM_H
+
+#include "defines.h"
+
+#if !defined(ARDUINO)
+
+#define EVENT_STREAM_MAX_CLIENTS  8     // maximum number of connected clients
+#define EVENT_STREAM_REQUEST_SIZE 512   // longest request header accepted
+#define EVENT_STREAM_TIMEOUT      5     // seconds a client has to send its request
+#define EVENT_STREAM_KEEPALIVE    15    // seconds between keep-alive comments
+
+/** Server-sent events
+ * Pushes state changes to clients as they happen, so that apps do not have
+ * to poll /jc. The OTF server answers each request and closes it, so the
+ * stream is served on a port of its own, given with -e <port>; without it
+ * the stream is off. GET /events?pw=xxx keeps the connection open as
+ * text/event-stream. Each notification passed to NotifQueue::add is sent
+ * as an event, whether or not it is enabled for the notifiers, and loop()
+ * adds queue and flow rate changes. Events are written without blocking;
+ * a client that cannot take a whole event is dropped, and reconnects on
+ * its own */
+class EventStream {
+public:
+	static bool begin(uint16_t port); // returns false if the port cannot be opened
+	static void loop(); // accept clients, read their requests, send queue and flow rate changes
+	static void push(uint16_t type, uint32_t lval, float fval, uint8_t bval); // send a notification
+	static void end();
+private:
+	static int lfd;
+	static void accept_clients();
+	static void read_request(unsigned char i);
+	static void send_all(const char *buf, int len);
+	static void drop(unsigned char i);
+};
+
+#endif
+
+#endif	// _EVENTSTREAM_H
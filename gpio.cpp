@@ -196,11 +196,15 @@ unsigned char digitalReadExt(unsigned char pin) {
 #include <poll.h>
 #include <pthread.h>
 #include <gpiod.h>
+#include <linux/spi/spidev.h>
 
 #include "utils.h"
 
 #define BUFFER_MAX 64
-#define GPIO_MAX	 64
+#define GPIO_EVENT_MAX 16
+
+#define GPIO_MODE_NONE  0xFF // line is not requested
+#define GPIO_MODE_EVENT 0xFE // input with pull-up and falling edge events
 
 // GPIO interfaces
 const char *gpio_consumer = "opensprinkler";
@@ -214,6 +218,25 @@ struct gpiod_line* gpio_lines[] = {
 	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
 	NULL, NULL, NULL, NULL, NULL,
 };
+static unsigned char gpio_modes[GPIO_MAX];  // requested mode of each opened line
+static signed char gpio_values[GPIO_MAX];   // last value written to each output, -1 if unknown
+static GPIOCounters gpio_counters[GPIO_MAX];
+
+#define GPIO_MAX_GROUPS     2
+#define GPIO_GROUP_MAX_PINS 8
+#define GPIO_GROUP_NONE     0xFF
+
+/** Output lines requested together. They share one kernel handle, and
+ * a write to the handle sets all of its lines, so they are always written
+ * together with the values the other lines already have */
+struct GPIOGroup {
+	struct gpiod_line_bulk bulk;
+	unsigned char pins[GPIO_GROUP_MAX_PINS];
+	unsigned char n;
+};
+static GPIOGroup gpio_groups[GPIO_MAX_GROUPS];
+static unsigned char ngroups = 0;
+static unsigned char gpio_group_of[GPIO_MAX]; // group of each opened line, GPIO_GROUP_NONE if none
 
 int assert_gpiod_chip() {
 	if( !chip ) {
@@ -266,6 +289,7 @@ int assert_gpiod_chip() {
 }
 
 int assert_gpiod_line(int pin) {
+	if( pin < 0 || pin >= GPIO_MAX ) { return -1; }
 	if( !gpio_lines[pin] ) {
 		if( assert_gpiod_chip() ) { return -1; }
 		gpio_lines[pin] = gpiod_chip_get_line(chip, pin);
@@ -276,41 +300,141 @@ int assert_gpiod_line(int pin) {
 		} else {
 			DEBUG_PRINT("opened gpio line ");
 			DEBUG_PRINT(pin);
+			gpio_modes[pin] = GPIO_MODE_NONE;
+			gpio_group_of[pin] = GPIO_GROUP_NONE;
 			return 0;
 		}
 	}
 	return 0;
 }
 
-/** Set pin mode, in or out */
-void pinMode(int pin, unsigned char mode) {
-	if( assert_gpiod_line(pin) ) { return; }
+/** Request a line in the given mode, unless it already is
+ * Each request and release is a kernel round trip, so the mode of each
+ * line is cached and callers can re-assert the mode as often as they like */
+static int gpio_request(int pin, unsigned char mode) {
+	if( assert_gpiod_line(pin) ) { return -1; }
+	if( gpio_modes[pin] == mode ) { return 0; }
+	if( gpio_group_of[pin] != GPIO_GROUP_NONE ) {
+		DEBUG_PRINT("cannot change mode of grouped pin ");
+		DEBUG_PRINTLN(pin);
+		return -1;
+	}
+	struct gpiod_line *line = gpio_lines[pin];
+	if( gpio_modes[pin] != GPIO_MODE_NONE ) {
+		gpiod_line_release(line);
+		gpio_modes[pin] = GPIO_MODE_NONE;
+		gpio_counters[pin].requests++;
+	}
+	int res;
 	switch(mode) {
 		case INPUT:
-			gpiod_line_request_input(gpio_lines[pin], gpio_consumer);
+			res = gpiod_line_request_input(line, gpio_consumer);
 			break;
 		case INPUT_PULLUP:
-			gpiod_line_request_input_flags(gpio_lines[pin], gpio_consumer, GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP);
+			res = gpiod_line_request_input_flags(line, gpio_consumer, GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP);
 			break;
 		case OUTPUT:
-			gpiod_line_request_output(gpio_lines[pin], gpio_consumer, LOW);
+			res = gpiod_line_request_output(line, gpio_consumer, LOW);
+			gpio_values[pin] = LOW;
+			break;
+		case GPIO_MODE_EVENT:
+			res = gpiod_line_request_falling_edge_events_flags(line, gpio_consumer, GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP);
 			break;
 		default:
 			DEBUG_PRINTLN("invalid pin direction");
-			break;
+			return -1;
 	}
+	gpio_counters[pin].requests++;
+	if( res ) {
+		DEBUG_PRINT("failed to request gpio line ");
+		DEBUG_PRINTLN(pin);
+		return -1;
+	}
+	gpio_modes[pin] = mode;
+	return 0;
+}
 
-	return;
+/** Set pin mode, in or out */
+void pinMode(int pin, unsigned char mode) {
+	gpio_request(pin, mode);
+}
+
+/** Request a group of output pins with one call, and set their initial values
+ * Returns the group, to write several of its pins at once with
+ * gpio_write_outputs, or -1 if the pins had to be requested one by one.
+ * The pins stay requested together: they can be written one by one,
+ * but not switched to another mode */
+int gpio_request_outputs(const unsigned char *pins, unsigned char n, const unsigned char *values) {
+	int vals[GPIO_GROUP_MAX_PINS] = {0};
+	unsigned char i;
+	if( ngroups < GPIO_MAX_GROUPS && n <= GPIO_GROUP_MAX_PINS ) {
+		GPIOGroup *g = gpio_groups + ngroups;
+		gpiod_line_bulk_init(&g->bulk);
+		for(i=0; i<n; i++) {
+			if( assert_gpiod_line(pins[i]) || gpio_modes[pins[i]] != GPIO_MODE_NONE ) { break; }
+			gpiod_line_bulk_add(&g->bulk, gpio_lines[pins[i]]);
+			g->pins[i] = pins[i];
+			vals[i] = values[i];
+		}
+		if( i == n && !gpiod_line_request_bulk_output(&g->bulk, gpio_consumer, vals) ) {
+			g->n = n;
+			for(i=0; i<n; i++) {
+				gpio_modes[pins[i]] = OUTPUT;
+				gpio_values[pins[i]] = values[i];
+				gpio_group_of[pins[i]] = ngroups;
+				gpio_counters[pins[i]].requests++;
+			}
+			return ngroups++;
+		}
+	}
+	// some line is in use already: request them one by one
+	for(i=0; i<n; i++) {
+		pinMode(pins[i], OUTPUT);
+		digitalWrite(pins[i], values[i]);
+	}
+	return -1;
+}
+
+/** Write several pins of a group with one call
+ * values are in the order the pins were requested in, and bit i of
+ * mask selects whether the i-th pin is written. Pins that already have
+ * their value are left out, and if none is left, nothing is written */
+void gpio_write_outputs(int group, const unsigned char *values, unsigned char mask) {
+	if( group < 0 || group >= ngroups ) { return; }
+	GPIOGroup *g = gpio_groups + group;
+	int vals[GPIO_GROUP_MAX_PINS];
+	unsigned char i, changed = 0;
+	for(i=0; i<g->n; i++) {
+		unsigned char pin = g->pins[i];
+		if( (mask>>i)&1 ) {
+			vals[i] = values[i];
+			if( gpio_values[pin] != vals[i] ) { changed |= 1<<i; }
+		} else {
+			vals[i] = gpio_values[pin];
+		}
+	}
+	if( !changed ) { return; }
+	int res = gpiod_line_set_value_bulk(&g->bulk, vals);
+	for(i=0; i<g->n; i++) {
+		if( !((changed>>i)&1) ) { continue; }
+		unsigned char pin = g->pins[i];
+		gpio_counters[pin].writes++;
+		gpio_values[pin] = res ? -1 : vals[i];
+	}
+	if( res ) {
+		DEBUG_PRINTLN("failed to write gpio group");
+	}
 }
 
 /** Read digital value */
 unsigned char digitalRead(int pin) {
-	if( !gpio_lines[pin] ) {
+	if( pin < 0 || pin >= GPIO_MAX || !gpio_lines[pin] ) {
 		DEBUG_PRINT("tried to read uninitialized pin ");
 		DEBUG_PRINTLN(pin);
 		return 0;
 	}
 	int val = gpiod_line_get_value(gpio_lines[pin]);
+	gpio_counters[pin].reads++;
 	if( val < 0 ) {
 		DEBUG_PRINT("failed to read value on pin ");
 		DEBUG_PRINTLN(pin);
@@ -319,26 +443,298 @@ unsigned char digitalRead(int pin) {
 	return val;
 }
 
-/** Write digital value */
+/** Write digital value
+ * Writing the value an output already has is skipped */
 void digitalWrite(int pin, unsigned char value) {
-	if( !gpio_lines[pin] ) {
+	if( pin < 0 || pin >= GPIO_MAX || !gpio_lines[pin] ) {
 		DEBUG_PRINT("tried to write uninitialized pin ");
 		DEBUG_PRINTLN(pin);
 		return;
 	}
+	if( gpio_modes[pin] == OUTPUT && gpio_values[pin] == value ) { return; }
+	if( gpio_group_of[pin] != GPIO_GROUP_NONE ) {
+		GPIOGroup *g = gpio_groups + gpio_group_of[pin];
+		unsigned char values[GPIO_GROUP_MAX_PINS];
+		for(unsigned char i=0; i<g->n; i++) {
+			if( g->pins[i] == pin ) {
+				values[i] = value;
+				gpio_write_outputs(gpio_group_of[pin], values, 1<<i);
+				break;
+			}
+		}
+		return;
+	}
 
 	int res;
 	res = gpiod_line_set_value(gpio_lines[pin], value);
+	gpio_counters[pin].writes++;
 	if( res ) {
 		DEBUG_PRINT("failed to write value on pin ");
 		DEBUG_PRINTLN(pin);
+		gpio_values[pin] = -1;
+	} else {
+		gpio_values[pin] = value;
 	}
 }
 
+/** Kernel calls made for a pin, NULL if the pin has not been used */
+const GPIOCounters* gpio_get_counters(int pin) {
+	if( pin < 0 || pin >= GPIO_MAX || !gpio_lines[pin] ) { return NULL; }
+	return gpio_counters + pin;
+}
+
+/** Request falling edge events on an input pin (with pull-up)
+ * The pin can still be read with digitalRead.
+ * Returns a pollable fd, or -1 if events are not available */
+int gpio_event_open(int pin) {
+	if( gpio_request(pin, GPIO_MODE_EVENT) ) {
+		gpio_request(pin, INPUT_PULLUP);
+		return -1;
+	}
+	return gpiod_line_event_get_fd(gpio_lines[pin]);
+}
+
+/** Stop edge events on a pin and turn it back into a plain input */
+void gpio_event_close(int pin) {
+	if( pin < 0 || pin >= GPIO_MAX || !gpio_lines[pin] ) { return; }
+	gpio_request(pin, INPUT_PULLUP);
+}
+
+/** Read the pending edge events of a pin (call when its fd is readable)
+ * Returns the number of falling edges, and the time of each
+ * in CLOCK_MONOTONIC microseconds */
+int gpio_event_read(int pin, uint64_t *times, int n) {
+	struct gpiod_line_event events[GPIO_EVENT_MAX];
+	if( n > GPIO_EVENT_MAX ) { n = GPIO_EVENT_MAX; }
+	int count = gpiod_line_event_read_multiple(gpio_lines[pin], events, n);
+	gpio_counters[pin].reads++;
+	if( count <= 0 ) { return 0; }
+
+	// kernels before 5.7 stamp events with the realtime clock
+	struct timespec mono, real;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	int64_t offset = 0;
+	if( events[0].ts.tv_sec > mono.tv_sec + 86400 ) {
+		clock_gettime(CLOCK_REALTIME, &real);
+		offset = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000 + (real.tv_nsec - mono.tv_nsec) / 1000;
+	}
+	int nfalling = 0;
+	for(int i=0; i<count; i++) {
+		if( events[i].event_type != GPIOD_LINE_EVENT_FALLING_EDGE ) { continue; }
+		times[nfalling++] = (uint64_t)events[i].ts.tv_sec * 1000000 + events[i].ts.tv_nsec / 1000 - offset;
+	}
+	return nfalling;
+}
+
+/** Shifts with the clock and data lines requested as a group: each bit
+ * is one write that lowers the clock and sets the data line, and one that
+ * raises the clock, taken from a precomputed waveform */
+class BulkShiftRegister : public ShiftRegister {
+public:
+	BulkShiftRegister(int g) : group(g) {}
+	const char* name() { return "bulk"; }
+protected:
+	void shift_out(const unsigned char *bytes, unsigned char n);
+private:
+	int group; // oe, latch, clock, data
+};
+
+#define SR_GROUP_LATCH 0x02
+#define SR_GROUP_WAVE  0x0C // clock and data
+
+// indexed by the data bit, then the clock phase
+static const unsigned char sr_waveform[2][2][4] = {
+	{{0, 0, LOW, LOW }, {0, 0, HIGH, LOW }},
+	{{0, 0, LOW, HIGH}, {0, 0, HIGH, HIGH}},
+};
+static const unsigned char sr_latch_low[4]  = {0, LOW, 0, 0};
+static const unsigned char sr_latch_high[4] = {0, HIGH, 0, 0};
+
+void BulkShiftRegister::shift_out(const unsigned char *bytes, unsigned char n) {
+	gpio_write_outputs(group, sr_latch_low, SR_GROUP_LATCH);
+	for(unsigned char i=0; i<n; i++) {
+		for(unsigned char s=0; s<8; s++) {
+			const unsigned char (*wave)[4] = sr_waveform[(bytes[i]>>(7-s))&1];
+			gpio_write_outputs(group, wave[0], SR_GROUP_WAVE);
+			gpio_write_outputs(group, wave[1], SR_GROUP_WAVE);
+		}
+	}
+	gpio_write_outputs(group, sr_latch_high, SR_GROUP_LATCH);
+}
+
+#define SPI_DEVICE   "/dev/spidev0.0"
+#define SPI_PIN_MOSI 10
+#define SPI_PIN_SCLK 11
+#define SPI_SPEED_HZ 500000
+
+/** Shifts all bytes with one write to the SPI controller. Only usable
+ * if the shift register clock and data are wired to SCLK and MOSI */
+class SpidevShiftRegister : public ShiftRegister {
+public:
+	SpidevShiftRegister(unsigned char latch) : pin_latch(latch), fd(-1) {}
+	~SpidevShiftRegister() { if( fd >= 0 ) { close(fd); } }
+	const char* name() { return "spidev"; }
+	bool begin();
+protected:
+	void shift_out(const unsigned char *bytes, unsigned char n);
+private:
+	unsigned char pin_latch;
+	int fd;
+};
+
+bool SpidevShiftRegister::begin() {
+	fd = ::open(SPI_DEVICE, O_WRONLY);
+	if( fd < 0 ) { return false; }
+	unsigned char mode = SPI_MODE_0; // clock idles low, data is sampled on the rising edge
+	unsigned char bits = 8;
+	uint32_t speed = SPI_SPEED_HZ;
+	if( ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+			ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+			ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0 ) {
+		DEBUG_PRINTLN("failed to set up " SPI_DEVICE);
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	return true;
+}
+
+void SpidevShiftRegister::shift_out(const unsigned char *bytes, unsigned char n) {
+	digitalWrite(pin_latch, LOW);
+	if( ::write(fd, bytes, n) != n ) {
+		DEBUG_PRINTLN("failed to write " SPI_DEVICE);
+	}
+	digitalWrite(pin_latch, HIGH);
+}
+
+/** Open the fastest backend the wiring allows: SPI, then the clock and
+ * data lines as a group, and bit by bit if the lines cannot be grouped */
+ShiftRegister* ShiftRegister::open(unsigned char pin_oe, unsigned char pin_latch, unsigned char pin_clock, unsigned char pin_data) {
+	if( pin_clock == SPI_PIN_SCLK && pin_data == SPI_PIN_MOSI ) {
+		SpidevShiftRegister *sr = new SpidevShiftRegister(pin_latch);
+		if( sr->begin() ) {
+			const unsigned char pins[] = {pin_oe, pin_latch};
+			const unsigned char values[] = {HIGH, HIGH};
+			gpio_request_outputs(pins, sizeof(pins), values);
+			return sr;
+		}
+		delete sr;
+	}
+	const unsigned char pins[] = {pin_oe, pin_latch, pin_clock, pin_data};
+	const unsigned char values[] = {HIGH, HIGH, LOW, LOW};
+	int group = gpio_request_outputs(pins, sizeof(pins), values);
+	if( group >= 0 ) {
+		return new BulkShiftRegister(group);
+	}
+	return new BitbangShiftRegister(pin_latch, pin_clock, pin_data);
+}
+
 #else
 
 void pinMode(int pin, unsigned char mode) {}
 void digitalWrite(int pin, unsigned char value) {}
 unsigned char digitalRead(int pin) {return 0;}
+int gpio_request_outputs(const unsigned char *pins, unsigned char n, const unsigned char *values) {return -1;}
+void gpio_write_outputs(int group, const unsigned char *values, unsigned char mask) {}
+const GPIOCounters* gpio_get_counters(int pin) {return NULL;}
+
+/** There are no pins to drive: record what would be latched */
+ShiftRegister* ShiftRegister::open(unsigned char pin_oe, unsigned char pin_latch, unsigned char pin_clock, unsigned char pin_data) {
+	return new MockShiftRegister();
+}
+
+/**
+ * Simulated edge events, for builds without gpiod
+ * A timerfd produces falling edges on one pin at a fixed rate
+*/
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+static int sim_event_pin = -1;
+static ulong sim_event_hz = 0;
+static int sim_event_fd = -1;
+static uint64_t sim_event_last = 0; // time of the last edge returned (in us)
+static uint64_t sim_event_pending = 0; // edges that have happened but have not been read yet
+
+/** Produce hz falling edges per second on pin once its events are opened */
+void gpio_event_simulate(int pin, ulong hz) {
+	sim_event_pin = pin;
+	sim_event_hz = hz;
+}
+
+int gpio_event_open(int pin) {
+	if( pin != sim_event_pin || !sim_event_hz ) { return -1; }
+	if( sim_event_fd >= 0 ) { return sim_event_fd; }
+	sim_event_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if( sim_event_fd < 0 ) { return -1; }
+	struct itimerspec its;
+	its.it_interval.tv_sec = 1 / sim_event_hz;
+	its.it_interval.tv_nsec = (1000000000UL / sim_event_hz) % 1000000000UL;
+	its.it_value = its.it_interval;
+	timerfd_settime(sim_event_fd, 0, &its, NULL);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sim_event_last = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	sim_event_pending = 0;
+	return sim_event_fd;
+}
+
+void gpio_event_close(int pin) {
+	if( pin != sim_event_pin || sim_event_fd < 0 ) { return; }
+	close(sim_event_fd);
+	sim_event_fd = -1;
+}
+
+/** Edges are spread evenly over the timer period, like a sensor that
+ * is pulsing at a constant rate */
+int gpio_event_read(int pin, uint64_t *times, int n) {
+	if( pin != sim_event_pin || sim_event_fd < 0 ) { return 0; }
+	uint64_t expirations;
+	if( read(sim_event_fd, &expirations, sizeof(expirations)) == sizeof(expirations) ) {
+		sim_event_pending += expirations;
+	}
+	uint64_t period = 1000000 / sim_event_hz;
+	int count = 0;
+	while( sim_event_pending && count < n ) {
+		sim_event_last += period;
+		times[count++] = sim_event_last;
+		sim_event_pending--;
+	}
+	return count;
+}
+
+#endif
+
+#if !defined(ARDUINO)
+
+#include <string.h>
+
+void ShiftRegister::write(const unsigned char *bytes, unsigned char n) {
+	if( n > sizeof(latched) ) { n = sizeof(latched); }
+	if( n == nlatched && !memcmp(bytes, latched, n) ) { return; }
+	shift_out(bytes, n);
+	memcpy(latched, bytes, n);
+	nlatched = n;
+}
+
+void BitbangShiftRegister::shift_out(const unsigned char *bytes, unsigned char n) {
+	digitalWrite(pin_latch, LOW);
+	for(unsigned char i=0; i<n; i++) {
+		for(unsigned char s=0; s<8; s++) {
+			digitalWrite(pin_clock, LOW);
+			digitalWrite(pin_data, (bytes[i] & ((unsigned char)1<<(7-s))) ? HIGH : LOW );
+			digitalWrite(pin_clock, HIGH);
+		}
+	}
+	digitalWrite(pin_latch, HIGH);
+}
+
+void MockShiftRegister::shift_out(const unsigned char *bytes, unsigned char n) {
+	memcpy(this->bytes, bytes, n);
+	nbytes = n;
+	nlatches++;
+}
 
 #endif
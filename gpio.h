@@ -134,14 +134,72 @@ unsigned char digitalReadExt(unsigned char pin);
 #define HIGH   1
 #define LOW    0
 
+#define GPIO_MAX 64
+
+/** Kernel calls made for a pin */
+struct GPIOCounters {
+	ulong requests; // line requests and releases
+	ulong reads;
+	ulong writes;
+};
+
 void pinMode(int pin, unsigned char mode);
 void digitalWrite(int pin, unsigned char value);
+int gpio_request_outputs(const unsigned char *pins, unsigned char n, const unsigned char *values);
+void gpio_write_outputs(int group, const unsigned char *values, unsigned char mask);
+const GPIOCounters* gpio_get_counters(int pin);
 int gpio_fd_open(int pin, int mode = O_WRONLY);
 void gpio_fd_close(int fd);
 void gpio_write(int fd, unsigned char value);
 unsigned char digitalRead(int pin);
 // mode can be any of 'rising', 'falling', 'both'
 void attachInterrupt(int pin, const char* mode, void (*isr)(void));
+int gpio_event_open(int pin);
+void gpio_event_close(int pin);
+int gpio_event_read(int pin, uint64_t *times, int n);
+#if !defined(OSPI)
+void gpio_event_simulate(int pin, ulong hz);
+#endif
+
+/** Shift register output (Linux)
+ * Shifts out the station bits, first byte first and each byte from the
+ * highest bit, then latches them. Nothing is shifted out if the bytes
+ * are the same as the ones latched last time */
+class ShiftRegister {
+public:
+	ShiftRegister() { nlatched = 0; }
+	virtual ~ShiftRegister() {}
+	void write(const unsigned char *bytes, unsigned char n);
+	virtual const char* name() = 0;
+	static ShiftRegister* open(unsigned char pin_oe, unsigned char pin_latch, unsigned char pin_clock, unsigned char pin_data);
+protected:
+	virtual void shift_out(const unsigned char *bytes, unsigned char n) = 0;
+private:
+	unsigned char latched[MAX_EXT_BOARDS+1];
+	unsigned char nlatched;
+};
+
+/** Shifts each bit with digitalWrite: three writes per bit */
+class BitbangShiftRegister : public ShiftRegister {
+public:
+	BitbangShiftRegister(unsigned char latch, unsigned char clock, unsigned char data) : pin_latch(latch), pin_clock(clock), pin_data(data) {}
+	const char* name() { return "bitbang"; }
+protected:
+	void shift_out(const unsigned char *bytes, unsigned char n);
+	unsigned char pin_latch, pin_clock, pin_data;
+};
+
+/** Records the latched bytes instead of driving any pins, for demo builds and tests */
+class MockShiftRegister : public ShiftRegister {
+public:
+	MockShiftRegister() { nbytes = 0; nlatches = 0; }
+	const char* name() { return "mock"; }
+	unsigned char bytes[MAX_EXT_BOARDS+1]; // last latched bytes
+	unsigned char nbytes;
+	ulong nlatches; // number of times the outputs were latched
+protected:
+	void shift_out(const unsigned char *bytes, unsigned char n);
+};
 
 #endif
 
@@ -0,0 +1,183 @@
+/* OpenSprinkler Unified Firmware
+ * I/O worker functions (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "ioworker.h"
+
+#if !defined(ARDUINO)
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <string.h>
+#include "utils.h"
+
+/** A ring of events and the thread that takes them */
+struct IORing {
+	IOEvent events[IO_RING_EVENTS];
+	size_t head;          // total events posted, only changed by the main thread
+	size_t tail;          // total events taken, only changed by the thread
+	sem_t pending;        // one count per event posted, and one to stop
+	pthread_t thread;
+	bool running;
+};
+
+static IORing notif_ring;
+static IORing block_ring;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t taken = PTHREAD_COND_INITIALIZER; // signals the callers of flush
+static volatile bool stopping = false;
+
+ulong IOWorker::overflows = 0;
+
+static bool start_ring(IORing *r, void* (*run)(void*)) {
+	r->head = r->tail = 0;
+	sem_init(&r->pending, 0, 0);
+	if (pthread_create(&r->thread, NULL, run, r)) {
+		sem_destroy(&r->pending);
+		return false;
+	}
+	r->running = true;
+	return true;
+}
+
+static void stop_ring(IORing *r) {
+	if (!r->running) return;
+	sem_post(&r->pending);
+	pthread_join(r->thread, NULL);
+	sem_destroy(&r->pending);
+	r->running = false;
+}
+
+bool IOWorker::begin() {
+	if (block_ring.running) return true;
+	stopping = false;
+	if (!start_ring(&block_ring, run)) {
+		DEBUG_PRINTLN("failed to start I/O worker, doing I/O directly");
+		return false;
+	}
+	if (!start_ring(&notif_ring, run)) {
+		DEBUG_PRINTLN("failed to start notification worker, sending directly");
+	}
+	return true;
+}
+
+void IOWorker::end() {
+	stopping = true;
+	stop_ring(&notif_ring);
+	stop_ring(&block_ring);
+}
+
+/** Only called by the main thread */
+bool IOWorker::post(IORing *r, const IOEvent *event) {
+	if (!r->running) return false;
+	size_t head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= IO_RING_EVENTS) {
+		DEBUG_PRINTLN("I/O ring full");
+		return false;
+	}
+	r->events[head % IO_RING_EVENTS] = *event;
+	__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+	sem_post(&r->pending);
+	return true;
+}
+
+bool IOWorker::notify(uint16_t type, uint32_t lval, float fval, uint8_t bval, const NotifSnapshot *snap) {
+	if (!notif_ring.running) {
+		push_message(type, lval, fval, bval, snap);
+		return true;
+	}
+	IOEvent event;
+	event.type = IO_EVENT_NOTIFY;
+	event.notif.type = type;
+	event.notif.lval = lval;
+	event.notif.fval = fval;
+	event.notif.bval = bval;
+	event.notif.snap = *snap;
+	if (post(&notif_ring, &event)) return true;
+	overflows++;
+	return false;
+}
+
+/** The block is copied, so the caller may change it right away. If it
+ * cannot be posted, it is written here, after the earlier writes so that
+ * it is not overwritten by an older copy. Inside a transaction the block
+ * is staged with the rest of the request instead, after the writes already
+ * queued; this only waits for the disk, never for notifications */
+void IOWorker::write_block(const char *name, const void *src, ulong pos, ulong len) {
+	if (!file_transaction() && len <= IO_BLOCK_MAX) {
+		IOEvent event;
+		event.type = IO_EVENT_BLOCK;
+		event.block.name = name;
+		event.block.pos = pos;
+		event.block.len = len;
+		memcpy(event.block.data, src, len);
+		if (post(&block_ring, &event)) return;
+	}
+	flush();
+	file_write_block(name, src, pos, len);
+}
+
+void IOWorker::flush() {
+	if (!block_ring.running) return;
+	pthread_mutex_lock(&mutex);
+	while (__atomic_load_n(&block_ring.tail, __ATOMIC_ACQUIRE) != block_ring.head) {
+		pthread_cond_wait(&taken, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void* IOWorker::run(void *arg) {
+	IORing *r = (IORing*)arg;
+	// leave termination signals to the main thread, which stops the worker
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (true) {
+		sem_wait(&r->pending);
+		size_t tail = r->tail;
+		if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+			if (stopping) break;
+			continue;
+		}
+		IOEvent *event = r->events + tail % IO_RING_EVENTS;
+		switch (event->type) {
+		case IO_EVENT_NOTIFY:
+			push_message(event->notif.type, event->notif.lval, event->notif.fval, event->notif.bval, &event->notif.snap);
+			break;
+		case IO_EVENT_BLOCK:
+			file_write_block(event->block.name, event->block.data, event->block.pos, event->block.len);
+			break;
+		}
+		// option saves come in bursts: put them on disk once the burst is written
+		bool sync = event->type == IO_EVENT_BLOCK && tail+1 == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		pthread_mutex_lock(&mutex);
+		__atomic_store_n(&r->tail, tail+1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&taken);
+		pthread_mutex_unlock(&mutex);
+		if (sync) file_sync();
+	}
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/* OpenSprinkler Unified Firmware
+ * I/O worker header file (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IOWORKER_H
+#define _IOWORKER_H
+
+#include "defines.h"
+#include "notifier.h"
+
+#if !defined(ARDUINO)
+
+#define IO_RING_EVENTS 64   // number of events of each kind that can wait for the worker
+#define IO_BLOCK_MAX   MAX_SOPTS_SIZE // largest file block that can be written by the worker
+
+#define IO_EVENT_NOTIFY 1   // send a notification
+#define IO_EVENT_BLOCK  2   // write a block of a file
+
+/** Fixed size event handed to the worker */
+struct IOEvent {
+	unsigned char type;
+	union {
+		struct {
+			uint16_t type;
+			uint32_t lval;
+			float fval;
+			uint8_t bval;
+			NotifSnapshot snap;
+		} notif;
+		struct {
+			const char *name; // file name, a constant
+			ulong pos;
+			uint16_t len;
+			unsigned char data[IO_BLOCK_MAX];
+		} block;
+	};
+};
+
+struct IORing;
+
+/** I/O worker
+ * Sends the notifications and writes the option and status files, so that
+ * do_loop never waits on the network or the disk. Notifications and file
+ * blocks have a ring and a thread each, so that a slow send never holds up
+ * a save, and waiting for the saves never means waiting for the network.
+ * The main thread is the only one that posts events: it puts them in a
+ * lock-free single-producer, single-consumer ring and returns right away.
+ * Notifications carry the station name and flow rate as they were when
+ * queued (NotifSnapshot), so the worker never reads the main thread's state.
+ * Each thread takes its events in order, and takes all of them before it
+ * stops. If the threads cannot be started, and after end(), the caller
+ * does the I/O itself. (Log records have a writer of their own, see LogWriter) */
+class IOWorker {
+public:
+	static bool begin();
+	static void end();   // take all events, then stop the threads
+	static bool notify(uint16_t type, uint32_t lval, float fval, uint8_t bval, const NotifSnapshot *snap); // false if the ring is full
+	static void write_block(const char *name, const void *src, ulong pos, ulong len);
+	static void flush(); // wait until all file blocks are written, before files are read
+	static ulong overflows; // number of notifications not posted because the ring was full
+private:
+	static bool post(IORing *r, const IOEvent *event);
+	static void* run(void *arg);
+};
+
+#endif
+
+#endif	// _IOWORKER_H
@@ -0,0 +1,815 @@
+/* OpenSprinkler Unified Firmware
+ * Log store functions (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "logstore.h"
+
+#if !defined(ARDUINO)
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static char log_dir[PATH_MAX];
+
+static uint32_t log_type_bit(unsigned char type) {
+	return type < 32 ? (1UL << type) : 0;
+}
+
+static void header_init(LogFileHeader *header) {
+	memset(header, 0, sizeof(LogFileHeader));
+	header->magic = LOG_FILE_MAGIC;
+	header->version = LOG_FILE_VERSION;
+	header->record_size = sizeof(LogRecord);
+	header->tmin = UINT32_MAX;
+}
+
+static bool header_valid(const LogFileHeader *header) {
+	return header->magic == LOG_FILE_MAGIC && header->version == LOG_FILE_VERSION && header->record_size == sizeof(LogRecord);
+}
+
+static void header_add(LogFileHeader *header, const LogRecord *recs, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		header->types |= log_type_bit(recs[i].type);
+		if (recs[i].time < header->tmin) header->tmin = recs[i].time;
+		if (recs[i].time > header->tmax) header->tmax = recs[i].time;
+	}
+	header->count += n;
+}
+
+/** Set the log folder (with a trailing slash) */
+void log_set_dir(const char *dir) {
+	strncpy(log_dir, dir, sizeof(log_dir)-1);
+}
+
+void log_path(char *path, size_t size, ulong day, unsigned char format) {
+	static const char *extensions[] = {"txt", "bin", "sum"};
+	snprintf(path, size, "%s%lu.%s", log_dir, day, extensions[format]);
+}
+
+int log_type_of(const char *name) {
+	for (unsigned char t = 0; t < LOG_TYPES; t++) {
+		if (!strncmp(name, log_type_names+t*3, 2)) return t;
+	}
+	return -1;
+}
+
+uint32_t log_type_mask(const char *name) {
+	int t = log_type_of(name);
+	return (t > LOGDATA_STATION) ? log_type_bit(t) : 0;
+}
+
+static char* format_ulong(char *p, ulong v) {
+	char digits[20];
+	unsigned char n = 0;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n) *p++ = digits[--n];
+	return p;
+}
+
+/** Format a record as the text logs store it, e.g. [pid,sid,dur,end]
+ * or [count,"s1",dur,end], with the line ending */
+int log_format_record(const LogRecord *rec, char *line) {
+	char *p = line;
+	*p++ = '[';
+	if (rec->type == LOGDATA_STATION) {
+		p = format_ulong(p, rec->pid);
+		*p++ = ',';
+		p = format_ulong(p, rec->sid);
+		*p++ = ',';
+		p = format_ulong(p, rec->value);
+	} else {
+		const char *name = (rec->type < LOG_TYPES) ? log_type_names+rec->type*3 : "  ";
+		p = format_ulong(p, rec->value);
+		*p++ = ',';
+		*p++ = '"';
+		*p++ = name[0];
+		*p++ = name[1];
+		*p++ = '"';
+		*p++ = ',';
+		p = format_ulong(p, rec->value2);
+	}
+	*p++ = ',';
+	p = format_ulong(p, rec->time);
+	if (rec->flags & LOG_RECORD_GPM) {
+		*p++ = ',';
+		p += snprintf(p, 16, "%5.2f", rec->gpm);
+	}
+	*p++ = ']';
+	*p++ = '\r';
+	*p++ = '\n';
+	*p = 0;
+	return p - line;
+}
+
+bool log_parse_record(const char *line, LogRecord *rec) {
+	char *p;
+	memset(rec, 0, sizeof(LogRecord));
+	if (*line != '[') return false;
+	ulong first = strtoul(line+1, &p, 10);
+	if (*p++ != ',') return false;
+	if (*p == '"') {
+		int t = log_type_of(p+1);
+		if (t <= LOGDATA_STATION || p[3] != '"' || p[4] != ',') return false;
+		rec->type = t;
+		rec->value = first;
+		rec->value2 = strtoul(p+5, &p, 10);
+	} else {
+		rec->type = LOGDATA_STATION;
+		rec->pid = first;
+		rec->sid = strtoul(p, &p, 10);
+		if (*p++ != ',') return false;
+		rec->value = strtoul(p, &p, 10);
+	}
+	if (*p++ != ',') return false;
+	rec->time = strtoul(p, &p, 10);
+	if (*p == ',') {
+		rec->gpm = strtof(p+1, &p);
+		rec->flags |= LOG_RECORD_GPM;
+	}
+	return *p == ']';
+}
+
+// ================================
+// ====== LogFile =================
+// ================================
+
+static bool rollup_save(ulong day, const LogRollup *rollup);
+static void rollup_index_add(LogRollup *rollup, ulong day, const LogRecord *rec, uint32_t offset);
+
+bool LogFile::open(ulong day, unsigned char format) {
+	close(false);
+	char path[PATH_MAX+32];
+	log_path(path, sizeof(path), day, format);
+	// binary files are written at the offset given by their record count, so that a
+	// record that was cut short is overwritten
+	int flags = (format == LOG_FORMAT_BINARY) ? O_RDWR|O_CREAT|O_CLOEXEC : O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC;
+	fd = ::open(path, flags, 0644);
+	if (fd < 0 && errno == ENOENT) {
+		// create the log folder if it doesn't exist yet
+		if (mkdir(log_dir, S_IRWXU|S_IRWXG|S_IRWXO)) return false;
+		fd = ::open(path, flags, 0644);
+	}
+	if (fd < 0) {
+		DEBUG_PRINT("failed to open ");
+		DEBUG_PRINTLN(path);
+		return false;
+	}
+	this->day = day;
+	this->format = format;
+	if (format == LOG_FORMAT_BINARY && !load_header()) {
+		DEBUG_PRINT("bad log file ");
+		DEBUG_PRINTLN(path);
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	if (!log_rollup_load(day, &rollup)) log_rollup_clear(&rollup);
+	unsaved = 0;
+	return true;
+}
+
+/** Read the header of a binary file, or write it if the file is new */
+bool LogFile::load_header() {
+	struct stat st;
+	fstat(fd, &st);
+	if (st.st_size < (off_t)sizeof(header)) {
+		header_init(&header);
+		return pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	}
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || !header_valid(&header)) return false;
+	uint32_t count = (st.st_size - sizeof(header)) / sizeof(LogRecord);
+	if (header.count == count) return true;
+	// the last write did not update the header: rebuild it from the records
+	LogRecord recs[64];
+	header_init(&header);
+	while (header.count < count) {
+		size_t n = count - header.count;
+		if (n > 64) n = 64;
+		if (pread(fd, recs, n*sizeof(LogRecord), sizeof(header)+(off_t)header.count*sizeof(LogRecord)) != (ssize_t)(n*sizeof(LogRecord))) break;
+		header_add(&header, recs, n);
+	}
+	return header.count == count;
+}
+
+/** Text records are formatted here. The day's rollup is updated after the
+ * records, and saved every LOG_ROLLUP_SAVE_APPENDS appends */
+bool LogFile::append(const LogRecord *recs, size_t n) {
+	if (fd < 0) return false;
+	bool ok = true;
+	if (format == LOG_FORMAT_BINARY) {
+		off_t offset = sizeof(header) + (off_t)header.count*sizeof(LogRecord);
+		if (pwrite(fd, recs, n*sizeof(LogRecord), offset) != (ssize_t)(n*sizeof(LogRecord))) {
+			DEBUG_PRINTLN("failed to write log");
+			return false;
+		}
+		header_add(&header, recs, n);
+		ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	} else {
+		char buf[LOG_LINE_MAX*16];
+		off_t offset = lseek(fd, 0, SEEK_END);
+		size_t i = 0;
+		while (ok && i < n) {
+			size_t len = 0;
+			for (; i < n && len + LOG_LINE_MAX <= sizeof(buf); i++) {
+				rollup_index_add(&rollup, day, recs+i, offset+len);
+				len += log_format_record(recs+i, buf+len);
+			}
+			ok = write_all(buf, len);
+			offset += len;
+		}
+	}
+	if (!ok) {
+		// the index may be ahead of the file: let it be computed again from the file
+		if (!log_rollup_load(day, &rollup)) log_rollup_clear(&rollup);
+		unsaved = 0;
+		return false;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	if (format == LOG_FORMAT_BINARY) rollup.binary_size = st.st_size;
+	else rollup.text_size = st.st_size;
+	log_rollup_add(&rollup, recs, n);
+	if (++unsaved >= LOG_ROLLUP_SAVE_APPENDS) save_rollup();
+	LogCatalog::update(day, rollup.text_size + rollup.binary_size + sizeof(LogRollup));
+	return true;
+}
+
+bool LogFile::write_all(const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			DEBUG_PRINTLN("failed to write log");
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+void LogFile::sync() {
+	if (fd >= 0) fdatasync(fd);
+}
+
+void LogFile::save_rollup() {
+	if (fd >= 0 && unsaved && rollup_save(day, &rollup)) unsaved = 0;
+}
+
+void LogFile::close(bool sync) {
+	if (fd < 0) return;
+	save_rollup();
+	if (sync) fdatasync(fd);
+	::close(fd);
+	fd = -1;
+}
+
+// ================================
+// ====== LogReader ===============
+// ================================
+
+/** Where to start reading a text file for the records from start on: taken
+ * from the index kept with the day's rollup if it is up to date, otherwise
+ * the beginning of the file */
+static long text_index_offset(ulong day, time_os_t start, FILE *file) {
+	char path[PATH_MAX+32];
+	struct stat st;
+	LogRollup rollup;
+	size_t len = offsetof(LogRollup, types);
+	log_path(path, sizeof(path), day, LOG_FORMAT_ROLLUP);
+	FILE *index = fopen(path, "rb");
+	if (!index) return 0;
+	bool ok = fread(&rollup, len, 1, index) == 1;
+	fclose(index);
+	if (!ok || rollup.magic != LOG_ROLLUP_MAGIC || rollup.version != LOG_ROLLUP_VERSION ||
+			fstat(fileno(file), &st) || rollup.text_size != (uint32_t)st.st_size) {
+		return 0;
+	}
+	ulong slot = (start - (time_os_t)day*86400) / LOG_INDEX_INTERVAL;
+	if (slot >= rollup.text_indexed) return rollup.text_indexed ? rollup.text_size : 0;
+	return rollup.text_index[slot];
+}
+
+bool LogReader::open(ulong day, uint32_t types, time_os_t start, time_os_t end) {
+	close();
+	this->day = day;
+	this->types = types;
+	this->start = start;
+	this->end = end;
+	// a day may have both: text records written before binary logs were turned on
+	return open_format(LOG_FORMAT_TEXT) || open_format(LOG_FORMAT_BINARY);
+}
+
+bool LogReader::open_format(unsigned char format) {
+	char path[PATH_MAX+32];
+	log_path(path, sizeof(path), day, format);
+	file = fopen(path, "rb");
+	if (!file) return false;
+	this->format = format;
+	if (format != LOG_FORMAT_BINARY) {
+		if (start > (time_os_t)day*86400) fseek(file, text_index_offset(day, start, file), SEEK_SET);
+		return true;
+	}
+
+	LogFileHeader header;
+	struct stat st;
+	if (fread(&header, sizeof(header), 1, file) != 1 || !header_valid(&header) || fstat(fileno(file), &st)) {
+		close();
+		return false;
+	}
+	uint32_t count = (st.st_size - sizeof(header)) / sizeof(LogRecord);
+	if (header.count != count) return true; // header is behind, read everything
+	if (!(header.types & types) || header.tmin > end || header.tmax < start) {
+		close();
+		return false;
+	}
+	if (start <= header.tmin) return true;
+	// find the first record at or after start
+	uint32_t lo = 0, hi = count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		LogRecord rec;
+		fseek(file, sizeof(header) + (long)mid*sizeof(LogRecord), SEEK_SET);
+		if (fread(&rec, sizeof(rec), 1, file) != 1) break;
+		if (rec.time < start) lo = mid + 1;
+		else hi = mid;
+	}
+	fseek(file, sizeof(header) + (long)lo*sizeof(LogRecord), SEEK_SET);
+	return true;
+}
+
+/** Take the next record of the open file, false at its end */
+bool LogReader::next(LogRecord *rec) {
+	if (format == LOG_FORMAT_BINARY) {
+		line_offset = -1;
+		return fread(rec, sizeof(LogRecord), 1, file) == 1 && rec->time <= end;
+	}
+	// records are appended in time order, so both formats stop at end
+	while (line_offset = ftell(file), fgets(line, sizeof(line), file)) {
+		if (log_parse_record(line, rec)) return rec->time <= end;
+	}
+	return false;
+}
+
+bool LogReader::read(LogRecord *rec) {
+	while (file) {
+		if (next(rec)) {
+			if (!(types & log_type_bit(rec->type)) || rec->time < start || rec->time > end) continue;
+			return true;
+		}
+		// the binary records of a day come after its text records
+		bool text = (format == LOG_FORMAT_TEXT);
+		close();
+		if (!text || !open_format(LOG_FORMAT_BINARY)) break;
+	}
+	return false;
+}
+
+/** Text records are returned as they are stored. line must have room
+ * for LOG_LINE_MAX characters */
+int LogReader::read(char *line, LogRecord *rec) {
+	LogRecord record;
+	if (!rec) rec = &record;
+	if (!read(rec)) return 0;
+	if (format == LOG_FORMAT_TEXT) {
+		strcpy(line, this->line);
+		return strlen(line);
+	}
+	return log_format_record(rec, line);
+}
+
+void LogReader::close() {
+	if (file) fclose(file);
+	file = NULL;
+}
+
+// ================================
+// ====== LogRollup ===============
+// ================================
+
+static void rollup_entry_add(LogRollupEntry *e, uint32_t value, float volume) {
+	if (!e->count || value < e->min) e->min = value;
+	if (!e->count || value > e->max) e->max = value;
+	e->count++;
+	e->total += value;
+	e->volume += volume;
+}
+
+void log_rollup_clear(LogRollup *rollup) {
+	memset(rollup, 0, sizeof(LogRollup));
+	rollup->magic = LOG_ROLLUP_MAGIC;
+	rollup->version = LOG_ROLLUP_VERSION;
+}
+
+void log_rollup_add(LogRollup *rollup, const LogRecord *recs, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		const LogRecord *rec = recs+i;
+		if (rec->type == LOGDATA_STATION) {
+			float volume = (rec->flags & LOG_RECORD_GPM) ? rec->gpm * rec->value / 60 : 0;
+			rollup_entry_add(rollup->types+LOGDATA_STATION, rec->value, volume);
+			if (rec->sid < MAX_NUM_STATIONS) rollup_entry_add(rollup->stations+rec->sid, rec->value, volume);
+			rollup_entry_add(rollup->programs+rec->pid, rec->value, volume);
+		} else if (rec->type < LOG_TYPES) {
+			rollup_entry_add(rollup->types+rec->type, rec->value2, rec->value);
+		}
+	}
+}
+
+/** Add a text record that starts at offset to the index */
+static void rollup_index_add(LogRollup *rollup, ulong day, const LogRecord *rec, uint32_t offset) {
+	long t = (long)rec->time - (long)day*86400;
+	unsigned int slot = (t < 0) ? 0 : t / LOG_INDEX_INTERVAL;
+	if (slot >= LOG_INDEX_SLOTS) slot = LOG_INDEX_SLOTS-1;
+	for (; rollup->text_indexed <= slot; rollup->text_indexed++) {
+		rollup->text_index[rollup->text_indexed] = offset;
+	}
+}
+
+void log_rollup_merge(LogRollupEntry *to, const LogRollupEntry *from) {
+	if (!from->count) return;
+	if (!to->count || from->min < to->min) to->min = from->min;
+	if (!to->count || from->max > to->max) to->max = from->max;
+	to->count += from->count;
+	to->total += from->total;
+	to->volume += from->volume;
+}
+
+/** Replace the rollup file of a day in one rename, so that it is never read half written */
+static bool rollup_save(ulong day, const LogRollup *rollup) {
+	char path[PATH_MAX+32], tmp_path[PATH_MAX+48];
+	log_path(path, sizeof(path), day, LOG_FORMAT_ROLLUP);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%lx", path, (ulong)pthread_self());
+	FILE *file = fopen(tmp_path, "wb");
+	if (!file) return false;
+	bool ok = fwrite(rollup, sizeof(LogRollup), 1, file) == 1;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(tmp_path, path)) {
+		remove(tmp_path);
+		return false;
+	}
+	return true;
+}
+
+static uint32_t file_size(ulong day, unsigned char format) {
+	char path[PATH_MAX+32];
+	struct stat st;
+	log_path(path, sizeof(path), day, format);
+	return stat(path, &st) ? 0 : st.st_size;
+}
+
+/** Load the rollup of a day. If it is missing or behind the day files,
+ * compute it from the records and save it */
+bool log_rollup_load(ulong day, LogRollup *rollup) {
+	uint32_t text_size = file_size(day, LOG_FORMAT_TEXT);
+	uint32_t binary_size = file_size(day, LOG_FORMAT_BINARY);
+	if (!text_size && !binary_size) return false;
+
+	char path[PATH_MAX+32];
+	log_path(path, sizeof(path), day, LOG_FORMAT_ROLLUP);
+	FILE *file = fopen(path, "rb");
+	if (file) {
+		bool ok = fread(rollup, sizeof(LogRollup), 1, file) == 1;
+		fclose(file);
+		if (ok && rollup->magic == LOG_ROLLUP_MAGIC && rollup->version == LOG_ROLLUP_VERSION &&
+				rollup->text_size == text_size && rollup->binary_size == binary_size) {
+			return true;
+		}
+	}
+
+	log_rollup_clear(rollup);
+	rollup->text_size = text_size;
+	rollup->binary_size = binary_size;
+	LogReader reader;
+	LogRecord rec;
+	if (reader.open(day, UINT32_MAX, 0, UINT32_MAX)) {
+		while (reader.read(&rec)) {
+			log_rollup_add(rollup, &rec, 1);
+			if (reader.offset() >= 0) rollup_index_add(rollup, day, &rec, reader.offset());
+		}
+	}
+	rollup_save(day, rollup);
+	return true;
+}
+
+// ================================
+// ====== LogCatalog ==============
+// ================================
+
+LogCatalogEntry *LogCatalog::entries = NULL;
+size_t LogCatalog::first = 0;
+size_t LogCatalog::count = 0;
+size_t LogCatalog::size = 0;
+ulong LogCatalog::total_bytes = 0;
+ulong LogCatalog::max_bytes = 0;
+ulong LogCatalog::max_days = 0;
+ulong LogCatalog::evicted = 0;
+
+static pthread_mutex_t catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int catalog_compare(const void *a, const void *b) {
+	uint32_t da = ((const LogCatalogEntry*)a)->day, db = ((const LogCatalogEntry*)b)->day;
+	return (da > db) - (da < db);
+}
+
+/** Day of a day file name, false for other files */
+static bool day_file(const char *name, ulong *day) {
+	char *ext;
+	*day = strtoul(name, &ext, 10);
+	return ext != name && (!strcmp(ext, ".txt") || !strcmp(ext, ".bin") || !strcmp(ext, ".sum"));
+}
+
+bool LogCatalog::begin(ulong max_bytes, ulong max_days) {
+	pthread_mutex_lock(&catalog_mutex);
+	LogCatalog::max_bytes = max_bytes;
+	LogCatalog::max_days = max_days;
+	first = count = 0;
+	total_bytes = 0;
+	DIR *dir = opendir(log_dir);
+	if (dir) {
+		char path[PATH_MAX+NAME_MAX+1]; // log_dir and a file name
+		struct dirent *ent;
+		struct stat st;
+		ulong day;
+		while ((ent = readdir(dir)) != NULL) {
+			if (!day_file(ent->d_name, &day)) continue;
+			snprintf(path, sizeof(path), "%s%s", log_dir, ent->d_name);
+			if (stat(path, &st)) continue;
+			if (!insert(count, day)) break;
+			entries[count-1].bytes = st.st_size;
+			total_bytes += st.st_size;
+		}
+		closedir(dir);
+		// one entry per day
+		qsort(entries, count, sizeof(LogCatalogEntry), catalog_compare);
+		size_t n = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (n && entries[n-1].day == entries[i].day) entries[n-1].bytes += entries[i].bytes;
+			else entries[n++] = entries[i];
+		}
+		count = n;
+	}
+	if (count) evict(entries[count-1].day);
+	pthread_mutex_unlock(&catalog_mutex);
+	return dir != NULL;
+}
+
+size_t LogCatalog::find(ulong day) {
+	// days are usually written in order, so look at the newest first
+	if (!count || entries[first+count-1].day < day) return count;
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (entries[first+mid].day < day) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/** Insert a day with no bytes at index i, growing or compacting the entries as needed */
+bool LogCatalog::insert(size_t i, ulong day) {
+	if (first + count == size) {
+		if (first > size/2) {
+			memmove(entries, entries+first, count*sizeof(LogCatalogEntry));
+			first = 0;
+		} else {
+			size_t new_size = size ? size*2 : 64;
+			LogCatalogEntry *p = (LogCatalogEntry*)realloc(entries, new_size*sizeof(LogCatalogEntry));
+			if (!p) return false;
+			entries = p;
+			size = new_size;
+		}
+	}
+	LogCatalogEntry *e = entries+first+i;
+	memmove(e+1, e, (count-i)*sizeof(LogCatalogEntry));
+	e->day = day;
+	e->bytes = 0;
+	count++;
+	return true;
+}
+
+void LogCatalog::update(ulong day, ulong bytes) {
+	pthread_mutex_lock(&catalog_mutex);
+	size_t i = find(day);
+	if ((i < count && entries[first+i].day == day) || insert(i, day)) {
+		LogCatalogEntry *e = entries+first+i;
+		total_bytes += bytes - e->bytes;
+		e->bytes = bytes;
+		evict(day);
+	}
+	pthread_mutex_unlock(&catalog_mutex);
+}
+
+/** Delete the oldest days while over the limits, keeping the day being written */
+void LogCatalog::evict(ulong newest) {
+	while (count) {
+		LogCatalogEntry *e = entries+first;
+		if (e->day == newest) break;
+		bool too_many_bytes = max_bytes && total_bytes > max_bytes;
+		bool too_old = max_days && e->day + max_days <= newest;
+		if (!too_many_bytes && !too_old) break;
+		DEBUG_PRINT("evicting logs of day ");
+		DEBUG_PRINTLN(e->day);
+		remove_files(e->day);
+		total_bytes -= e->bytes;
+		first++;
+		count--;
+		evicted++;
+	}
+	if (!count) first = 0;
+}
+
+void LogCatalog::remove_files(ulong day) {
+	char path[PATH_MAX+32];
+	for (unsigned char format = LOG_FORMAT_TEXT; format <= LOG_FORMAT_ROLLUP; format++) {
+		log_path(path, sizeof(path), day, format);
+		unlink(path);
+	}
+}
+
+void LogCatalog::remove(ulong day) {
+	pthread_mutex_lock(&catalog_mutex);
+	remove_files(day);
+	size_t i = find(day);
+	if (i < count && entries[first+i].day == day) {
+		total_bytes -= entries[first+i].bytes;
+		LogCatalogEntry *e = entries+first+i;
+		memmove(e, e+1, (count-i-1)*sizeof(LogCatalogEntry));
+		count--;
+	}
+	pthread_mutex_unlock(&catalog_mutex);
+}
+
+/** Files that are not in the catalog, such as those left by an
+ * interrupted conversion, are deleted too */
+void LogCatalog::remove_all() {
+	pthread_mutex_lock(&catalog_mutex);
+	DIR *dir = opendir(log_dir);
+	if (dir) {
+		char path[PATH_MAX+NAME_MAX+1]; // log_dir and a file name
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.') continue;
+			snprintf(path, sizeof(path), "%s%s", log_dir, ent->d_name);
+			unlink(path);
+		}
+		closedir(dir);
+	}
+	first = count = 0;
+	total_bytes = 0;
+	pthread_mutex_unlock(&catalog_mutex);
+}
+
+bool LogCatalog::next(ulong *day) {
+	pthread_mutex_lock(&catalog_mutex);
+	size_t i = find(*day);
+	bool found = i < count;
+	if (found) *day = entries[first+i].day;
+	pthread_mutex_unlock(&catalog_mutex);
+	return found;
+}
+
+void LogCatalog::usage(ulong *days, ulong *bytes, ulong *oldest) {
+	pthread_mutex_lock(&catalog_mutex);
+	*days = count;
+	*bytes = total_bytes;
+	*oldest = count ? entries[first].day : 0;
+	pthread_mutex_unlock(&catalog_mutex);
+}
+
+// ================================
+// ====== Text log converter ======
+// ================================
+
+static LogRecord *convert_recs = NULL;
+static size_t convert_count = 0, convert_size = 0;
+
+static bool convert_add(const LogRecord *rec) {
+	if (convert_count == convert_size) {
+		size_t size = convert_size ? convert_size*2 : 256;
+		LogRecord *recs = (LogRecord*)realloc(convert_recs, size*sizeof(LogRecord));
+		if (!recs) return false;
+		convert_recs = recs;
+		convert_size = size;
+	}
+	convert_recs[convert_count++] = *rec;
+	return true;
+}
+
+/** Convert the text file of a day, merging it with the binary file of the day
+ * if there is one. The binary file is replaced in one rename, and the text
+ * file is removed after that. Returns the number of text records */
+static int convert_day(ulong day) {
+	char path[PATH_MAX+32], tmp_path[PATH_MAX+40];
+	char line[LOG_LINE_MAX];
+	LogRecord rec;
+	LogFileHeader header;
+	convert_count = 0;
+
+	log_path(path, sizeof(path), day, LOG_FORMAT_BINARY);
+	FILE *file = fopen(path, "rb");
+	if (file) {
+		if (fread(&header, sizeof(header), 1, file) != 1 || !header_valid(&header)) {
+			fclose(file);
+			return -1;
+		}
+		while (fread(&rec, sizeof(rec), 1, file) == 1) {
+			if (!convert_add(&rec)) { fclose(file); return -1; }
+		}
+		fclose(file);
+	}
+	size_t nbinary = convert_count;
+
+	log_path(path, sizeof(path), day, LOG_FORMAT_TEXT);
+	file = fopen(path, "rb");
+	if (!file) return -1;
+	while (fgets(line, sizeof(line), file)) {
+		if (!log_parse_record(line, &rec)) continue;
+		if (!convert_add(&rec)) { fclose(file); return -1; }
+	}
+	fclose(file);
+	int ntext = convert_count - nbinary;
+
+	// keep the records in time order, earlier records first if the times are equal
+	for (size_t i = 1; i < convert_count; i++) {
+		rec = convert_recs[i];
+		size_t j = i;
+		while (j > 0 && convert_recs[j-1].time > rec.time) {
+			convert_recs[j] = convert_recs[j-1];
+			j--;
+		}
+		convert_recs[j] = rec;
+	}
+
+	header_init(&header);
+	header_add(&header, convert_recs, convert_count);
+	log_path(path, sizeof(path), day, LOG_FORMAT_BINARY);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	file = fopen(tmp_path, "wb");
+	if (!file) return -1;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(convert_recs, sizeof(LogRecord), convert_count, file) == convert_count &&
+		fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(tmp_path, path)) {
+		remove(tmp_path);
+		return -1;
+	}
+	log_path(path, sizeof(path), day, LOG_FORMAT_TEXT);
+	remove(path);
+	return ntext;
+}
+
+int log_convert() {
+	DIR *dir = opendir(log_dir);
+	if (!dir) return -1;
+	int total = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		// day files are named <day>.txt
+		char *ext;
+		ulong day = strtoul(ent->d_name, &ext, 10);
+		if (ext == ent->d_name || strcmp(ext, ".txt")) continue;
+		int n = convert_day(day);
+		if (n < 0) {
+			DEBUG_PRINT("failed to convert ");
+			DEBUG_PRINTLN(ent->d_name);
+			total = -1;
+			break;
+		}
+		total += n;
+	}
+	closedir(dir);
+	free(convert_recs);
+	convert_recs = NULL;
+	convert_count = convert_size = 0;
+	return total;
+}
+
+#endif
@@ -0,0 +1,205 @@
+/* OpenSprinkler Unified Firmware
+ * Log store header file
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOGSTORE_H
+#define _LOGSTORE_H
+
+#include "defines.h"
+#include "types.h"
+
+/** Log record, as filled by write_log() */
+struct LogRecord {
+	uint32_t time;   // time of the record: end time of a station run, or of an event
+	uint8_t type;    // LOGDATA_*
+	uint8_t flags;   // LOG_RECORD_*
+	uint8_t pid;     // program index (station records)
+	uint8_t sid;     // station index (station records)
+	uint32_t value;  // duration (station records), or flow count (other records)
+	uint32_t value2; // duration of the event, or water level (other records)
+	float gpm;       // flow rate (station records with LOG_RECORD_GPM)
+};
+
+#define LOG_RECORD_GPM  0x01  // record has a flow rate
+
+#define LOG_TYPES 7 // number of record type names
+extern const char log_type_names[];
+
+#if !defined(ARDUINO)
+
+#include <stdio.h>
+
+#define LOG_FORMAT_TEXT    0  // one JSON array per line, in <day>.txt
+#define LOG_FORMAT_BINARY  1  // header followed by fixed size records, in <day>.bin
+#define LOG_FORMAT_ROLLUP  2  // not a record format: the totals of a day, in <day>.sum
+
+#define LOG_FILE_MAGIC     0x424C534F // "OSLB"
+#define LOG_FILE_VERSION   1
+#define LOG_LINE_MAX       64 // longest text record, with the line ending
+
+/** Header at the start of each binary day file
+ * The records that follow are in the order they were written, which is the
+ * order of their time unless the clock was set back. The header is written
+ * after the records, so if the two disagree, the records are right */
+struct LogFileHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t count;     // number of records
+	uint32_t types;     // bit n is set if there are records of type n
+	uint32_t tmin;      // earliest and latest record time
+	uint32_t tmax;
+	uint32_t reserved[2];
+};
+
+#define LOG_ROLLUP_MAGIC    0x524C534F // "OSLR"
+#define LOG_ROLLUP_VERSION  2
+#define LOG_ROLLUP_PROGRAMS 256 // program index as logged, including 99 (test) and 254 (run-once)
+#define LOG_ROLLUP_MAX_DAYS 3660 // longest range of days a rollup query may cover
+#define LOG_ROLLUP_SAVE_APPENDS 16 // appends between saves of the rollup of the day being written
+#define LOG_INDEX_INTERVAL  900  // seconds covered by each entry of the text file index
+#define LOG_INDEX_SLOTS     (86400/LOG_INDEX_INTERVAL)
+
+/** Totals of one kind of records */
+struct LogRollupEntry {
+	uint32_t count;
+	uint32_t total;   // sum of durations (station runs), or of event values
+	uint32_t min;
+	uint32_t max;
+	float volume;     // flow rate x minutes (station runs), or flow count (fl records)
+};
+
+/** Totals of the records of a day, kept next to its day files, with an
+ * index of its text file: text_index[i] is where the first record of
+ * slot i or later starts, for the first text_indexed slots. (Binary files
+ * need no index: their records have a fixed size and can be searched.)
+ * The sizes of the day files it was computed from tell whether it is
+ * up to date: if they do not match, it is computed again. The rollup of
+ * the day being written is saved every LOG_ROLLUP_SAVE_APPENDS appends,
+ * when asked to and when its file is closed */
+struct LogRollup {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t text_indexed;
+	uint32_t text_size;
+	uint32_t binary_size;
+	uint32_t text_index[LOG_INDEX_SLOTS];
+	LogRollupEntry types[LOG_TYPES];              // station runs (type 0) and other records by type
+	LogRollupEntry stations[MAX_NUM_STATIONS];    // station runs by station
+	LogRollupEntry programs[LOG_ROLLUP_PROGRAMS]; // station runs by program
+};
+
+void log_set_dir(const char *dir);
+void log_path(char *path, size_t size, ulong day, unsigned char format);
+int log_type_of(const char *name); // type of a record type name, -1 if unknown
+uint32_t log_type_mask(const char *name); // record types with the given type name, 0 if none
+int log_format_record(const LogRecord *rec, char *line); // returns the length of the text line
+bool log_parse_record(const char *line, LogRecord *rec);
+int log_convert(); // converts the text logs to binary, returns the number of records or -1
+
+void log_rollup_clear(LogRollup *rollup);
+void log_rollup_add(LogRollup *rollup, const LogRecord *recs, size_t n);
+void log_rollup_merge(LogRollupEntry *to, const LogRollupEntry *from);
+bool log_rollup_load(ulong day, LogRollup *rollup); // false if the day has no logs
+
+/** Day file of either format, opened for appending. Keeps the day's rollup up to date */
+class LogFile {
+public:
+	LogFile() : fd(-1), format(LOG_FORMAT_TEXT), unsaved(0) {}
+	~LogFile() { close(false); }
+	bool open(ulong day, unsigned char format);
+	bool is_open(ulong day, unsigned char format) { return fd >= 0 && this->day == day && this->format == format; }
+	bool append(const LogRecord *recs, size_t n);
+	void sync();
+	void save_rollup(); // if it has changed since it was last saved
+	void close(bool sync);
+private:
+	int fd;
+	ulong day;
+	unsigned char format;
+	LogFileHeader header;
+	LogRollup rollup;
+	unsigned char unsaved; // appends since the rollup was last saved
+	bool load_header();
+	bool write_all(const char *data, size_t len);
+};
+
+/** Reads the records of a day, of both formats, that are of the given types
+ * and whose time is within [start, end]. Binary files whose header shows
+ * no such records are not read at all, and the first record to read is
+ * found by binary search on the record times */
+class LogReader {
+public:
+	LogReader() : file(NULL), line_offset(-1) {}
+	~LogReader() { close(); }
+	bool open(ulong day, uint32_t types, time_os_t start, time_os_t end); // false if there is nothing to read
+	bool read(LogRecord *rec); // next record, false at the end
+	int read(char *line, LogRecord *rec = NULL); // next record as a text line, 0 at the end
+	long offset() const { return line_offset; } // where the last record read starts, -1 if not in a text file
+	void close();
+private:
+	bool open_format(unsigned char format);
+	bool next(LogRecord *rec);
+	FILE *file;
+	ulong day;
+	unsigned char format;
+	uint32_t types;
+	time_os_t start, end;
+	char line[LOG_LINE_MAX]; // last line read from a text file
+	long line_offset;
+};
+
+#define LOG_RETAIN_BYTES (64UL<<20) // default most bytes of logs to keep
+#define LOG_RETAIN_DAYS  0          // default most days of logs to keep, 0 for no limit
+
+struct LogCatalogEntry {
+	uint32_t day;
+	uint32_t bytes; // of the day's text, binary and rollup files
+};
+
+/** Retention of the day files
+ * Day files are named by their epoch day, so one scan of the log folder
+ * at start gives the sorted list of the days with logs. It is then kept
+ * up to date as days are written and deleted, with the oldest day first,
+ * so finding what to evict never takes a scan. When the logs go over the
+ * byte budget, or the oldest day is too old, the oldest days are deleted,
+ * but never the day being written */
+class LogCatalog {
+public:
+	static bool begin(ulong max_bytes, ulong max_days); // 0 for no limit
+	static void update(ulong day, ulong bytes); // the files of day now take bytes
+	static void remove(ulong day); // deletes the files of a day
+	static void remove_all(); // deletes all day files
+	static void usage(ulong *days, ulong *bytes, ulong *oldest);
+	static bool next(ulong *day); // moves day to the first day with logs from day on, false if none
+	static ulong evicted; // number of days deleted to stay within the limits
+private:
+	static LogCatalogEntry *entries;
+	static size_t first, count, size; // entries[first] is the oldest of count days
+	static ulong total_bytes;
+	static ulong max_bytes, max_days;
+	static size_t find(ulong day); // index of day, or of where it would be inserted
+	static bool insert(size_t i, ulong day);
+	static void evict(ulong newest);
+	static void remove_files(ulong day);
+};
+
+#endif
+
+#endif	// _LOGSTORE_H
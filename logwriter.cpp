@@ -0,0 +1,197 @@
+/* OpenSprinkler Unified Firmware
+ * Log writer functions (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "logwriter.h"
+
+#if !defined(ARDUINO)
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+static LogRecord ring[LOG_RING_RECORDS];
+static size_t ring_head = 0; // total records appended
+static size_t ring_tail = 0; // total records taken out by the writer
+static LogRecord batch[LOG_RING_RECORDS]; // records of one day, taken out of the ring to be written
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER; // signals the writer
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER; // signals the callers of flush
+static pthread_t thread;
+static bool running = false;
+static bool stopping = false;
+static bool urgent = false;      // write without waiting for the flush interval
+static bool close_pending = false;
+static ulong flush_requested = 0;
+static ulong flush_completed = 0;
+static ulong last_day = 0;       // day of the last appended record
+
+static ulong flush_interval = LOG_FLUSH_INTERVAL;
+static bool sync_writes = false;
+static unsigned char log_format = LOG_FORMAT_TEXT;
+static LogFile log_file;         // day file being appended to, only used by the writer
+
+ulong LogWriter::dropped = 0;
+
+bool LogWriter::begin(ulong interval, bool sync, unsigned char format) {
+	if (running) return true;
+	flush_interval = interval ? interval : 1;
+	sync_writes = sync;
+	log_format = format;
+	stopping = false;
+	if (pthread_create(&thread, NULL, run, NULL)) {
+		DEBUG_PRINTLN("failed to start log writer, writing logs directly");
+		return false;
+	}
+	running = true;
+	return true;
+}
+
+void LogWriter::append(const LogRecord *rec) {
+	ulong day = rec->time / 86400;
+	pthread_mutex_lock(&mutex);
+	if (!running) {
+		pthread_mutex_unlock(&mutex);
+		if (write_day(day, rec, 1) && sync_writes) log_file.sync();
+		return;
+	}
+	if (ring_head - ring_tail >= LOG_RING_RECORDS) {
+		dropped++;
+		pthread_mutex_unlock(&mutex);
+		DEBUG_PRINTLN("log ring full, record dropped");
+		return;
+	}
+	ring[ring_head++ % LOG_RING_RECORDS] = *rec;
+	// close the previous day's file right away, and keep room for more records
+	if (day != last_day || ring_head - ring_tail > LOG_RING_RECORDS/2) {
+		urgent = true;
+		pthread_cond_signal(&wake);
+	}
+	last_day = day;
+	pthread_mutex_unlock(&mutex);
+}
+
+void LogWriter::request(bool close_file) {
+	pthread_mutex_lock(&mutex);
+	if (!running) {
+		pthread_mutex_unlock(&mutex);
+		if (close_file) log_file.close(sync_writes);
+		else log_file.save_rollup();
+		return;
+	}
+	ulong generation = ++flush_requested;
+	if (close_file) close_pending = true;
+	urgent = true;
+	pthread_cond_signal(&wake);
+	while ((long)(flush_completed - generation) < 0) pthread_cond_wait(&done, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
+
+void LogWriter::flush() {
+	request(false);
+}
+
+void LogWriter::close() {
+	request(true);
+}
+
+void LogWriter::end() {
+	pthread_mutex_lock(&mutex);
+	if (!running) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	stopping = true;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&mutex);
+	pthread_join(thread, NULL);
+	running = false;
+}
+
+void* LogWriter::run(void *arg) {
+	// leave termination signals to the main thread, which stops the writer
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&mutex);
+	while (true) {
+		if (!urgent && !stopping) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += flush_interval;
+			while (!urgent && !stopping && pthread_cond_timedwait(&wake, &mutex, &deadline) != ETIMEDOUT);
+		}
+		urgent = false;
+		ulong generation = flush_requested;
+		drain();
+		if (close_pending || stopping) {
+			close_pending = false;
+			pthread_mutex_unlock(&mutex);
+			log_file.close(sync_writes);
+			pthread_mutex_lock(&mutex);
+		} else if (generation != flush_completed) {
+			// someone is about to read the logs: let them find the rollup up to date
+			pthread_mutex_unlock(&mutex);
+			log_file.save_rollup();
+			pthread_mutex_lock(&mutex);
+		}
+		flush_completed = generation;
+		pthread_cond_broadcast(&done);
+		if (stopping && ring_head == ring_tail) break;
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/** Write out the ring, one day at a time, with the lock released while
+ * writing. Called by the writer with the lock held */
+void LogWriter::drain() {
+	bool written = false;
+	while (ring_head != ring_tail) {
+		// take as many records of the same day as there are
+		ulong day = ring[ring_tail % LOG_RING_RECORDS].time / 86400;
+		size_t n = 0;
+		while (ring_head != ring_tail && ring[ring_tail % LOG_RING_RECORDS].time / 86400 == day) {
+			batch[n++] = ring[ring_tail++ % LOG_RING_RECORDS];
+		}
+		pthread_mutex_unlock(&mutex);
+		written |= write_day(day, batch, n);
+		pthread_mutex_lock(&mutex);
+	}
+	if (written && sync_writes) {
+		// one sync for the whole batch
+		pthread_mutex_unlock(&mutex);
+		log_file.sync();
+		pthread_mutex_lock(&mutex);
+	}
+}
+
+/** Append to the file of a day, opening it (and closing the previous day's) if needed */
+bool LogWriter::write_day(ulong day, const LogRecord *recs, size_t n) {
+	if (!log_file.is_open(day, log_format) && !log_file.open(day, log_format)) return false;
+	return log_file.append(recs, n);
+}
+
+#endif
@@ -0,0 +1,58 @@
+/* OpenSprinkler Unified Firmware
+ * Log writer header file (Linux)
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOGWRITER_H
+#define _LOGWRITER_H
+
+#include "defines.h"
+#include "logstore.h"
+
+#if !defined(ARDUINO)
+
+#define LOG_RING_RECORDS    1024  // number of log records that can wait to be written
+#define LOG_FLUSH_INTERVAL  5     // default number of seconds between flushes
+
+/** Write-behind log writer
+ * write_log() appends each record to a ring in memory and returns without
+ * touching the disk. A thread formats the records and writes them to their
+ * day file, updating the day's rollup as it goes. The day file
+ * stays open until the day changes. Records are written every flush interval,
+ * right away when the day rolls over or the ring is half full, and when
+ * the writer is stopped. With sync on, each batch of writes is followed by
+ * one fdatasync. If the thread cannot be started, and after end(),
+ * records are written directly */
+class LogWriter {
+public:
+	static bool begin(ulong interval, bool sync, unsigned char format); // interval in seconds
+	static void append(const LogRecord *rec); // drops the record if the ring is full
+	static void flush(); // write all pending records and the rollup of the day, and wait for it
+	static void close(); // flush and close the day file, before log files are removed
+	static void end();   // flush, close and stop the thread
+	static ulong dropped; // number of records dropped because the ring was full
+private:
+	static void request(bool close_file);
+	static void* run(void *arg);
+	static void drain();
+	static bool write_day(ulong day, const LogRecord *recs, size_t n);
+};
+
+#endif
+
+#endif	// _LOGWRITER_H
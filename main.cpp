@@ -31,9 +31,18 @@
 #include "mqtt.h"
 #include "main.h"
 #include "notifier.h"
+#include "eventloop.h"
+#include "logstore.h"
+#include "logwriter.h"
+#include "ioworker.h"
+#include "eventstream.h"
 
 #if defined(ARDUINO)
 #include <Arduino.h>
+#else
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #endif
 
 #if defined(ARDUINO)
@@ -107,34 +116,64 @@ float flow_last_gpm = 0;
 int32_t flow_rt_period = -1;
 uint32_t reboot_timer = 0;
 
-void flow_poll() {
-	ulong curr = millis();
+/* The real-time flow rate (last_flow_rt, flow_rt_period, flow_rt_reset) is
+ * tracked in FLOW_RT_TICKS per second: microseconds on Linux, so it stays
+ * accurate at the pulse rates edge capture delivers, and milliseconds on
+ * Arduino as before. On Linux, flow_millis/flow_ticks read the monotonic
+ * clock, which is also the clock gpiod stamps edge events with */
+#if defined(ARDUINO)
+	#define FLOW_RT_TICKS 1000L
+	#define flow_millis() millis()
+	#define flow_ticks()  millis()
+	#define flow_lock()
+	#define flow_unlock()
+#else
+	#define FLOW_RT_TICKS 1000000L
+	static uint64_t flow_clock() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+	#define flow_millis() ((ulong)(flow_clock() / 1000))
+	#define flow_ticks()  ((ulong)flow_clock())
+	// the flow variables are shared with flow_capture_thread
+	static pthread_mutex_t flow_mutex = PTHREAD_MUTEX_INITIALIZER;
+	#define flow_lock()   pthread_mutex_lock(&flow_mutex)
+	#define flow_unlock() pthread_mutex_unlock(&flow_mutex)
+#endif
+#define FLOW_RT_MAX_TIMEOUT (1800UL*FLOW_RT_TICKS) // 30 minutes, well within the wrap-around of a 32-bit tick count
+
+/** Flow sensor pulse count, read under the capture lock */
+ulong get_flow_count() {
+	flow_lock();
+	ulong count = flow_count;
+	flow_unlock();
+	return count;
+}
 
+/** Real-time flow rate (see OpenSprinkler::flowcount_rt), read under the capture lock */
+ulong get_flowcount_rt() {
+	flow_lock();
+	ulong rt = os.flowcount_rt;
+	flow_unlock();
+	return rt;
+}
+
+static void flow_check_timeout(ulong curr_tick) {
 	// Resets counter if timeout occurs
-	if (flow_rt_reset && curr > flow_rt_reset) {
+	if (flow_rt_reset && (long)(curr_tick - flow_rt_reset) > 0) {
 		os.flowcount_rt = 0;
 		flow_rt_period = -1;
 		flow_rt_reset = 0;
 	}
 
 	if (flow_rt_period < 0) {
-		last_flow_rt = curr;
-	}
-
-	#if defined(ESP8266)
-	if(os.hw_rev>=2) {
-		pinMode(PIN_SENSOR1, INPUT); // Work-around for PIN_SENSOR1 on OS3.2 and above
-		pinMode(PIN_SENSOR1, INPUT_PULLUP);
+		last_flow_rt = curr_tick;
 	}
-	#endif
-
+}
 
-	unsigned char curr_flow_state = digitalReadExt(PIN_SENSOR1);
-	if((!prev_flow_state) || curr_flow_state) { // only record on falling edge
-		prev_flow_state = curr_flow_state;
-		return;
-	}
-	prev_flow_state = curr_flow_state;
+/** Record a falling edge of the flow sensor at time curr (in ms) and curr_tick (in FLOW_RT_TICKS) */
+static void flow_pulse(ulong curr, ulong curr_tick) {
 	flow_count++;
 
 	/* RAH implementation of flow sensor */
@@ -153,30 +192,114 @@ void flow_poll() {
 	}
 
 	// Use exponential moving average (alpha=0.2) if flow has been previosuly calculated, otherwise just set the value
-	ulong curr_period = curr - last_flow_rt;
+	ulong curr_period = curr_tick - last_flow_rt;
 	if (flow_rt_period > 0) {
-		flow_rt_period = (curr_period  / 5 + flow_rt_period * 4 / 5);
+		flow_rt_period = (curr_period / 5 + flow_rt_period - flow_rt_period / 5);
 	} else {
 		flow_rt_period = curr_period;
 	}
 
 	// calculates the flow rate scaled by the window size to simulated a fixed point number
 	if (flow_rt_period > 0) {
-		os.flowcount_rt = (ulong) (FLOWCOUNT_RT_WINDOW * 1000L / flow_rt_period);
+		os.flowcount_rt = (ulong) (FLOWCOUNT_RT_WINDOW * FLOW_RT_TICKS / flow_rt_period);
 		// Sets the timeout to be 10x the last period
-		flow_rt_reset = curr + (curr - last_flow_rt) * 10;
+		flow_rt_reset = curr_tick + ((curr_period < FLOW_RT_MAX_TIMEOUT / 10) ? curr_period * 10 : FLOW_RT_MAX_TIMEOUT);
 	} else {
 		os.flowcount_rt = 0;
 		flow_rt_reset = 0;
 	}
 
-	last_flow_rt = curr;
+	last_flow_rt = curr_tick;
 
 	flow_stop = curr; // get time in ms for stop
 	flow_gallons++;  // increment gallon count for each poll
 	/* End of RAH implementation of flow sensor */
 }
 
+void flow_poll() {
+	ulong curr = flow_millis();
+	ulong curr_tick = flow_ticks();
+
+	flow_check_timeout(curr_tick);
+
+	#if defined(ESP8266)
+	if(os.hw_rev>=2) {
+		pinMode(PIN_SENSOR1, INPUT); // Work-around for PIN_SENSOR1 on OS3.2 and above
+		pinMode(PIN_SENSOR1, INPUT_PULLUP);
+	}
+	#endif
+
+
+	unsigned char curr_flow_state = digitalReadExt(PIN_SENSOR1);
+	if((!prev_flow_state) || curr_flow_state) { // only record on falling edge
+		prev_flow_state = curr_flow_state;
+		return;
+	}
+	prev_flow_state = curr_flow_state;
+	flow_pulse(curr, curr_tick);
+}
+
+#if !defined(ARDUINO)
+/** Flow sensor capture (Linux)
+ * A thread drains the falling edges of PIN_SENSOR1 in batches, each with
+ * its kernel timestamp, so pulses are counted exactly at any rate the
+ * gpio driver can deliver, no matter how long do_loop is busy */
+#define FLOW_CAPTURE_BATCH 16
+
+static pthread_t flow_thread;
+static volatile bool flow_capture = false; // the capture thread is running
+static int flow_capture_fd = -1;
+
+static void *flow_capture_thread(void *) {
+	struct pollfd pfd;
+	pfd.fd = flow_capture_fd;
+	pfd.events = POLLIN;
+	uint64_t times[FLOW_CAPTURE_BATCH];
+	while (flow_capture) {
+		// wake up now and then to see if capture has been stopped
+		if (poll(&pfd, 1, 100) <= 0) continue;
+		int n = gpio_event_read(PIN_SENSOR1, times, FLOW_CAPTURE_BATCH);
+		flow_lock();
+		for (int i=0; i<n; i++) {
+			flow_check_timeout((ulong)times[i]);
+			flow_pulse((ulong)(times[i] / 1000), (ulong)times[i]);
+		}
+		flow_unlock();
+	}
+	return NULL;
+}
+
+/** Start capturing flow sensor edges
+ * Returns false if edge events are not available, then the sensor is polled */
+static bool flow_capture_begin() {
+	static bool failed = false;
+	if (flow_capture) return true;
+	if (failed) return false;
+	flow_capture_fd = gpio_event_open(PIN_SENSOR1);
+	if (flow_capture_fd < 0) {
+		failed = true;
+		return false;
+	}
+	flow_capture = true;
+	if (pthread_create(&flow_thread, NULL, flow_capture_thread, NULL)) {
+		flow_capture = false;
+		gpio_event_close(PIN_SENSOR1);
+		failed = true;
+		return false;
+	}
+	DEBUG_PRINTLN("flow sensor: capturing edge events");
+	return true;
+}
+
+static void flow_capture_end() {
+	if (!flow_capture) return;
+	flow_capture = false;
+	pthread_join(flow_thread, NULL);
+	gpio_event_close(PIN_SENSOR1);
+}
+#endif
+
+
 #if defined(USE_DISPLAY)
 // ====== UI defines ======
 static char ui_anim_chars[3] = {'.', 'o', 'O'};
@@ -523,6 +646,8 @@ static void check_network();
 void check_weather();
 static bool process_special_program_command(const char*, uint32_t curr_time);
 static void perform_ntp_sync();
+static unsigned char enqueue_program_stations(ProgramStruct *prog, unsigned char pid, unsigned char runcount, unsigned char wl,
+                                              RuntimeQueueStruct *queue, unsigned char *nqueue);
 
 #if defined(ESP8266)
 bool delete_log_oldest();
@@ -547,19 +672,34 @@ void do_loop()
 {
 	static ulong flowpoll_timeout=0;
 	if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
-	// handle flow sensor using polling every 1ms (maximum freq 1/(2*1ms)=500Hz)
-		ulong curr = millis();
-		if(curr!=flowpoll_timeout) {
-			flowpoll_timeout = curr;
-			flow_poll();
+#if !defined(ARDUINO)
+		if(flow_capture_begin()) {
+			// falling edges are counted by flow_capture_thread
+			flow_lock();
+			flow_check_timeout(flow_ticks());
+			flow_unlock();
+		} else
+#endif
+		{
+			// handle flow sensor using polling every 1ms (maximum freq 1/(2*1ms)=500Hz)
+			ulong curr = millis();
+			if(curr!=flowpoll_timeout) {
+				flowpoll_timeout = curr;
+				flow_poll();
+			}
 		}
 	}
+#if !defined(ARDUINO)
+	else {
+		flow_capture_end();
+	}
+#endif
 
 
 	static time_os_t last_time = 0;
 	static ulong last_minute = 0;
 
-	unsigned char bid, sid, s, pid, qid, gid, bitvalue;
+	unsigned char bid, sid, s, pid, qid, bitvalue;
 	ProgramStruct prog;
 
 	os.status.mas = os.iopts[IOPT_MASTER_STATION];
@@ -711,6 +851,7 @@ void do_loop()
 
 #else // Process Ethernet packets for RPI/LINUX
 	if(otf) otf->loop();
+	EventStream::loop();
 #if defined(USE_DISPLAY)
 	ui_state_machine();
 #endif
@@ -815,13 +956,24 @@ void do_loop()
 		// since the granularity of start time is minute
 		// we only need to check once every minute
 		if (curr_minute != last_minute) {
+			// if the clock has jumped (time sync, timezone change), start times need to be recomputed
+			if (curr_minute != last_minute+1) pd.sched_invalidate();
 			last_minute = curr_minute;
 
 			apply_monthly_adjustment(curr_time); // check and apply monthly adjustment here, if it's selected
 
+#if !defined(ARDUINO)
+			// check only the programs whose next start time is due
+			unsigned char due_pids[MAX_NUM_PROGRAMS];
+			unsigned char ndue = pd.sched_pop_due(curr_time, due_pids);
+			unsigned char ndeleted = 0;
+			for(unsigned char di=0; di<ndue; di++) {
+				pid = due_pids[di] - ndeleted; // account for run-once programs deleted earlier in this pass
+#else
 			// check through all programs
 			for(pid=0; pid<pd.nprograms; pid++) {
-				pd.read(pid, &prog);	// todo future: reduce load time
+#endif
+				pd.read(pid, &prog);
 				bool will_delete = false;
 				unsigned char runcount = prog.check_match(curr_time, &will_delete);
 				if(runcount>0) {
@@ -829,53 +981,19 @@ void do_loop()
 					// check and process special program command
 					if(process_special_program_command(prog.name, curr_time))	continue;
 
-					// get station ordering
-					unsigned char order[os.nstations];
-					prog.gen_station_runorder(runcount, order);
-					// process all selected stations
-					for(unsigned char oi=0;oi<os.nstations;oi++) {
-						sid=order[oi];
-						bid=sid>>3;
-						s=sid&0x07;
-						// skip if the station is a master station (because master cannot be scheduled independently
-						if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
-							continue;
-
-						// if station has non-zero water time and the station is not disabled
-						if (prog.durations[sid] && !(os.attrib_dis[bid]&(1<<s))) {
-							// water time is scaled by watering percentage
-							ulong water_time = water_time_resolve(prog.durations[sid]);
-							// if the program is set to use weather scaling
-							if (prog.use_weather) {
-								unsigned char wl = os.iopts[IOPT_WATER_PERCENTAGE];
-								water_time = water_time * wl / 100;
-								if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
-																								// do not water
-									water_time = 0;
-							}
-
-							if (water_time) {
-								// check if water time is still valid
-								// because it may end up being zero after scaling
-								q = pd.enqueue();
-								if (q) {
-									q->st = 0;
-									q->dur = water_time;
-									q->sid = sid;
-									q->pid = pid+1;
-									match_found = true;
-								} else {
-									// queue is full
-								}
-							}// if water_time
-						}// if prog.durations[sid]
-					}// for sid
+					// queue the selected stations in run order
+					if(enqueue_program_stations(&prog, pid, runcount, os.iopts[IOPT_WATER_PERCENTAGE], NULL, NULL)) {
+						match_found = true;
+					}
 					if(match_found) {
 						notif.add(NOTIFY_PROGRAM_SCHED, pid, prog.use_weather?os.iopts[IOPT_WATER_PERCENTAGE]:100);
 					}
 					//delete run-once if on final runtime (stations have already been queued)
 					if(will_delete){
 						pd.del(pid);
+#if !defined(ARDUINO)
+						ndeleted++;
+#endif
 					}
 				}// if check_match
 			}// for pid
@@ -886,7 +1004,8 @@ void do_loop()
 
 				// For debugging: print out queued elements
 				/*DEBUG_PRINT("en:");
-				for(q=pd.queue;q<pd.queue+pd.nqueue;q++) {
+				for(qid=pd.qhead;qid!=0xFF;qid=q->next) {
+					q=pd.queue+qid;
 					DEBUG_PRINT("[");
 					DEBUG_PRINT(q->sid);
 					DEBUG_PRINT(",");
@@ -903,28 +1022,19 @@ void do_loop()
 		// Check if a program is running currently
 		// If so, do station run-time keeping
 		if (os.status.program_busy){
-			// first, go through run time queue to assign queue elements to stations
-			q = pd.queue;
-			qid=0;
-			for(;q<pd.queue+pd.nqueue;q++,qid++) {
-				sid=q->sid;
-				unsigned char sqi=pd.station_qid[sid];
-				// skip if station is already assigned a queue element
-				// and that queue element has an earlier start time
-				if(sqi<255 && pd.queue[sqi].st<q->st) continue;
-				// otherwise assign the queue element to station
-				pd.station_qid[sid]=qid;
-			}
-			// next, go through the stations and perform time keeping
+			// go through the stations whose first queue element has started and perform time keeping
+			unsigned char started[MAX_NUM_BOARDS];
+			pd.get_started_stations(curr_time, started);
 			for(bid=0;bid<os.nboards; bid++) {
+				if (!started[bid]) continue;
 				bitvalue = os.station_bits[bid];
 				for(s=0;s<8;s++) {
 					unsigned char sid = bid*8+s;
 
-					// skip master stations and any station that's not in the queue
+					// skip master stations and any station that has not started
+					if (!((started[bid] >> s) & 1)) continue;
 					if (os.status.mas == sid+1) continue;
 					if (os.status.mas2== sid+1) continue;
-					if (pd.station_qid[sid]==255) continue;
 
 					q = pd.queue + pd.station_qid[sid];
 
@@ -945,11 +1055,14 @@ void do_loop()
 			}//end_bid
 
 			// finally, go through the queue again and clear up elements marked for removal
-			int qi;
-			for(qi=pd.nqueue-1;qi>=0;qi--) {
-				q=pd.queue+qi;
-				if(!q->dur || curr_time >= q->deque_time) {
-					pd.dequeue(qi);
+			// elements that have not started yet cannot be due
+			unsigned char qnext;
+			for(qid=pd.qhead;qid!=0xFF;qid=qnext) {
+				q=pd.queue+qid;
+				qnext=q->next;
+				if(q->st>curr_time) break;
+				if(!q->dur || (q->st && curr_time >= q->deque_time)) {
+					pd.dequeue(qid);
 				}
 			}
 
@@ -959,26 +1072,8 @@ void do_loop()
 			// activate / deactivate valves
 			os.apply_all_station_bits();
 
-			// check through runtime queue, calculate the last stop time of sequential stations
-			memset(pd.last_seq_stop_times, 0, sizeof(ulong)*NUM_SEQ_GROUPS);
-			time_os_t sst;
-			unsigned char re=os.iopts[IOPT_REMOTE_EXT_MODE];
-			q = pd.queue;
-			for(;q<pd.queue+pd.nqueue;q++) {
-				sid = q->sid;
-				bid = sid>>3;
-				s = sid&0x07;
-				gid = os.get_station_gid(sid);
-				// check if any sequential station has a valid stop time
-				// and the stop time must be larger than curr_time
-				sst = q->st + q->dur;
-				if (sst>curr_time) {
-					// only need to update last_seq_stop_time for sequential stations
-					if (os.is_sequential_station(sid) && !re) {
-						pd.last_seq_stop_times[gid] = (sst > pd.last_seq_stop_times[gid]) ? sst : pd.last_seq_stop_times[gid];
-					}
-				}
-			}
+			// calculate the last stop time of sequential stations
+			pd.update_seq_stop_times(curr_time);
 
 			// if the runtime queue is empty
 			// reset all stations
@@ -993,7 +1088,8 @@ void do_loop()
 				// log flow sensor reading if flow sensor is used
 				if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
 					write_log(LOGDATA_FLOWSENSE, curr_time);
-					notif.add(NOTIFY_FLOWSENSOR, (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0);
+					ulong count = get_flow_count();
+					notif.add(NOTIFY_FLOWSENSOR, (count>os.flowcount_log_start)?(count-os.flowcount_log_start):0);
 				}
 
 				// in case some options have changed while executing the program
@@ -1013,18 +1109,20 @@ void do_loop()
 
 				unsigned char masbit = 0;
 
-				for(sid = 0; sid < os.nstations; sid++) {
+				// only stations that have started (allowing for the on adjustment) can turn on the master
+				for(qid = pd.qhead; qid != 0xFF; qid = q->next) {
+					q = pd.queue + qid;
+					if (!q->st) continue;
+					if (curr_time < q->st + mas_on_adj) break;
+					sid = q->sid;
 					// skip if this is the master station
 					if (mas_id == sid + 1) continue;
+					// only the first queue element of a station counts
+					if (pd.station_qid[sid] != qid) continue;
 
-					if(pd.station_qid[sid]==255) continue; // skip if station is not in the queue
-
-					q = pd.queue + pd.station_qid[sid];
-
-					if (os.bound_to_master(q->sid, mas)) {
+					if (os.bound_to_master(sid, mas)) {
 						// check if timing is within the acceptable range
-						if (curr_time >= q->st + mas_on_adj &&
-							curr_time <= q->st + q->dur + mas_off_adj) {
+						if (curr_time <= q->st + q->dur + mas_off_adj) {
 							masbit = 1;
 							break;
 						}
@@ -1078,6 +1176,10 @@ void do_loop()
 			if (!os.status.program_busy) {
 				// and if no program is scheduled to run in the next minute
 				bool willrun = false;
+#if !defined(ARDUINO)
+				time_os_t next_start = pd.sched_peek(curr_time);
+				if (next_start && next_start <= curr_time+60) willrun = true;
+#else
 				bool will_delete = false;
 				for(pid=0; pid<pd.nprograms; pid++) {
 					pd.read(pid, &prog);
@@ -1086,6 +1188,7 @@ void do_loop()
 						break;
 					}
 				}
+#endif
 				if (!willrun) {
 					os.reboot_dev(os.nvdata.reboot_cause);
 				}
@@ -1125,10 +1228,6 @@ void do_loop()
 			notif.add(NOTIFY_REBOOT);
 		}
 	}
-
-	#if !defined(ARDUINO)
-		delay(1); // For OSPI/LINUX, sleep 1 ms to minimize CPU usage
-	#endif
 }
 
 /** Check and process special program command */
@@ -1188,9 +1287,11 @@ void check_weather() {
  */
 void turn_on_station(unsigned char sid, ulong duration) {
 	// RAH implementation of flow sensor
+	flow_lock();
 	flow_start=0;
 	//Added flow_gallons reset to station turn on.
 	flow_gallons=0;  
+	flow_unlock();
 
 	if (os.set_station_bit(sid, 1, duration)) {
 		notif.add(NOTIFY_STATION_ON, sid, duration);
@@ -1199,16 +1300,19 @@ void turn_on_station(unsigned char sid, ulong duration) {
 
 // after removing element q, update remaining stations in its group
 void handle_shift_remaining_stations(RuntimeQueueStruct* q, unsigned char gid, time_os_t curr_time) {
-	RuntimeQueueStruct *s = pd.queue;
+	RuntimeQueueStruct *s;
 	time_os_t q_end_time = q->st + q->dur;
 	ulong remainder = 0;
 
 	if (q_end_time > curr_time) { // remainder is non-zero
 		remainder = (q->st < curr_time) ? q_end_time - curr_time : q->dur;
-		for ( ; s < pd.queue + pd.nqueue; s++) {
+		// only stations in the same sequential group are affected
+		unsigned char sqid = (gid < NUM_SEQ_GROUPS) ? pd.group_qid[gid] : 0xFF;
+		for ( ; sqid != 0xFF; sqid = s->gnext) {
+			s = pd.queue + sqid;
 
-			// ignore station to be removed and stations in other groups
-			if (s == q || os.get_station_gid(s->sid) != gid || !os.is_sequential_station(s->sid)) {
+			// ignore station to be removed
+			if (s == q) {
 				continue;
 			}
 
@@ -1216,6 +1320,7 @@ void handle_shift_remaining_stations(RuntimeQueueStruct* q, unsigned char gid, t
 			if (s->st >= q_end_time) {
 				s->st -= remainder;
 				s->deque_time -= remainder;
+				pd.requeue(sqid);
 			}
 		}
 	}
@@ -1232,7 +1337,7 @@ void turn_off_station(unsigned char sid, time_os_t curr_time, unsigned char shif
 
 	unsigned char qid = pd.station_qid[sid];
 	// ignore request if trying to turn off a zone that's not even in the queue
-	if (qid >= pd.nqueue)  {
+	if (qid == 0xFF)  {
 		return;
 	}
 	RuntimeQueueStruct *q = pd.queue + qid;
@@ -1249,7 +1354,6 @@ void turn_off_station(unsigned char sid, time_os_t curr_time, unsigned char shif
 			force_dequeue = 1;
 		} else { // if already off just remove from the queue
 			pd.dequeue(qid);
-			pd.station_qid[sid] = 0xFF;
 			return;
 		}
 	} else if (curr_time >= q->st + q->dur) { // end time and dequeue time are not equal due to master handling
@@ -1259,11 +1363,13 @@ void turn_off_station(unsigned char sid, time_os_t curr_time, unsigned char shif
 	os.set_station_bit(sid, 0);
 
 	// RAH implementation of flow sensor
+	flow_lock();
 	if (flow_gallons > 1) {
 		if(flow_stop <= flow_begin) flow_last_gpm = 0;
-		else flow_last_gpm = (float) 60000 / (float)((flow_stop-flow_begin) / (flow_gallons - 1));
+		else flow_last_gpm = (float) 60000 * (float)(flow_gallons - 1) / (float)(flow_stop-flow_begin);
 	}// RAH calculate GPM, 1 pulse per gallon
 	else {flow_last_gpm = 0;}  // RAH if not one gallon (two pulses) measured then record 0 gpm
+	flow_unlock();
 
 	// check if the current time is past the scheduled start time,
 	// because we may be turning off a station that hasn't started yet
@@ -1290,7 +1396,6 @@ void turn_off_station(unsigned char sid, time_os_t curr_time, unsigned char shif
 
 	if (force_dequeue) {
 		pd.dequeue(qid);
-		pd.station_qid[sid] = 0xFF;
 	}
 }
 
@@ -1375,31 +1480,90 @@ void handle_master_adjustments(time_os_t curr_time, RuntimeQueueStruct *q, unsig
 	q->deque_time = q->st + q->dur + dequeue_adj;
 }
 
-/** Scheduler
- * This function loops through the queue
- * and schedules the start time of each station
+/** Queue the stations of a matched program
+ * Stations are added in the program's run order, with water time
+ * scaled by wl if the program uses weather adjustment.
+ * If queue is NULL, the stations are added to the runtime queue.
+ * Returns the number of stations queued.
  */
-void schedule_all_stations(time_os_t curr_time) {
+static unsigned char enqueue_program_stations(ProgramStruct *prog, unsigned char pid, unsigned char runcount, unsigned char wl,
+                                              RuntimeQueueStruct *queue, unsigned char *nqueue) {
+	unsigned char sid, bid, s, n = 0;
+	// get station ordering
+	unsigned char order[os.nstations];
+	prog->gen_station_runorder(runcount, order);
+	// process all selected stations
+	for(unsigned char oi=0;oi<os.nstations;oi++) {
+		sid=order[oi];
+		bid=sid>>3;
+		s=sid&0x07;
+		// skip if the station is a master station (because master cannot be scheduled independently
+		if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
+			continue;
+
+		// if station has non-zero water time and the station is not disabled
+		if (prog->durations[sid] && !(os.attrib_dis[bid]&(1<<s))) {
+			// water time is scaled by watering percentage
+			ulong water_time = water_time_resolve(prog->durations[sid]);
+			// if the program is set to use weather scaling
+			if (prog->use_weather) {
+				water_time = water_time * wl / 100;
+				if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
+																				// do not water
+					water_time = 0;
+			}
+
+			if (water_time) {
+				// check if water time is still valid
+				// because it may end up being zero after scaling
+				RuntimeQueueStruct *q = NULL;
+				if (!queue) {
+					q = pd.enqueue();
+				} else if (*nqueue < RUNTIME_QUEUE_SIZE) {
+					q = queue + (*nqueue)++;
+				}
+				if (q) {
+					q->st = 0;
+					q->dur = water_time;
+					q->sid = sid;
+					q->pid = pid+1;
+					n++;
+				} else {
+					// queue is full
+				}
+			}// if water_time
+		}// if prog->durations[sid]
+	}// for sid
+	return n;
+}
+
+/** Calculate the start and dequeue time of the given queue elements that have not been scheduled yet
+ * This only updates the given queue, so it can also be used on a copy of the queue.
+ * pause_delay is the remaining pause time, if any.
+ * Returns true if any element was scheduled.
+ */
+static bool schedule_queue(RuntimeQueueStruct *queue, const unsigned char *qids, unsigned char n, const time_os_t *last_seq_stop_times,
+                           time_os_t curr_time, ulong pause_delay) {
 	ulong con_start_time = curr_time + 1;   // concurrent start time
 	// if the queue is paused, make sure the start time is after the scheduled pause ends
-	if (os.status.pause_state) {
-		con_start_time += os.pause_timer;
-	}
+	con_start_time += pause_delay;
 	int16_t station_delay = water_time_decode_signed(os.iopts[IOPT_STATION_DELAY_TIME]);
 	ulong seq_start_times[NUM_SEQ_GROUPS];  // sequential start times
 	for(unsigned char i=0;i<NUM_SEQ_GROUPS;i++) {
 		seq_start_times[i] = con_start_time;
 		// if the sequential queue already has stations running
-		if (pd.last_seq_stop_times[i] > curr_time) {
-			seq_start_times[i] = pd.last_seq_stop_times[i] + station_delay;
+		if (last_seq_stop_times[i] > curr_time) {
+			seq_start_times[i] = last_seq_stop_times[i] + station_delay;
 		}
 	}
-	RuntimeQueueStruct *q = pd.queue;
+	RuntimeQueueStruct *q;
 	unsigned char re = os.iopts[IOPT_REMOTE_EXT_MODE];
 	unsigned char gid;
+	bool scheduled = false;
 
-	// go through runtime queue and calculate start time of each station
-	for(;q<pd.queue+pd.nqueue;q++) {
+	// go through the elements and calculate start time of each station
+	for(unsigned char i=0;i<n;i++) {
+		q = queue + qids[i];
 		if(q->st) continue; // if this queue element has already been scheduled, skip
 		if(!q->dur) continue; // if the element has been marked to reset, skip
 		gid = os.get_station_gid(q->sid);
@@ -1418,17 +1582,197 @@ void schedule_all_stations(time_os_t curr_time) {
 		}
 
 		handle_master_adjustments(curr_time, q, gid, seq_start_times);
+		scheduled = true;
+	}
+	return scheduled;
+}
 
-		if (!os.status.program_busy) {
-			os.status.program_busy = 1;  // set program busy bit
-			// start flow count
-			if(os.iopts[IOPT_SENSOR1_TYPE] == SENSOR_TYPE_FLOW) {  // if flow sensor is connected
-				os.flowcount_log_start = flow_count;
-				os.sensor1_active_lasttime = curr_time;
+/** Scheduler
+ * This function loops through the queue
+ * and schedules the start time of each station
+ */
+void schedule_all_stations(time_os_t curr_time) {
+	unsigned char qids[RUNTIME_QUEUE_SIZE];
+	unsigned char n = pd.get_pending(qids);
+	if (!schedule_queue(pd.queue, qids, n, pd.last_seq_stop_times, curr_time, os.status.pause_state ? os.pause_timer : 0))
+		return;
+	pd.reindex(); // link the newly scheduled elements by their start time
+
+	if (!os.status.program_busy) {
+		os.status.program_busy = 1;  // set program busy bit
+		// start flow count
+		if(os.iopts[IOPT_SENSOR1_TYPE] == SENSOR_TYPE_FLOW) {  // if flow sensor is connected
+			os.flowcount_log_start = get_flow_count();
+			os.sensor1_active_lasttime = curr_time;
+		}
+	}
+}
+
+#if !defined(ARDUINO)
+/** Master station on window, tracked by the forecast engine */
+struct ForecastMasterWindow {
+	time_os_t on;
+	time_os_t off;
+};
+
+static void forecast_emit_station(const RuntimeQueueStruct *q, ForecastMasterWindow *win, ForecastCallback cb, void *arg) {
+	ForecastEvent e;
+	e.type = FORECAST_EVENT_STATION;
+	e.pid = q->pid;
+	e.sid = q->sid;
+	e.gid = os.get_station_gid(q->sid);
+	e.wl = 0;
+	e.st = q->st;
+	e.et = q->st + q->dur;
+	cb(&e, arg);
+
+	// extend or start the on window of each master this station is bound to
+	e.type = FORECAST_EVENT_MASTER;
+	e.pid = 0;
+	for (unsigned char mas = MASTER_1; mas < NUM_MASTER_ZONES; mas++) {
+		unsigned char mas_id = os.masters[mas][MASOPT_SID];
+		if (!mas_id || mas_id == q->sid+1 || !os.bound_to_master(q->sid, mas)) continue;
+		time_os_t on = q->st + os.get_on_adj(mas);
+		time_os_t off = q->st + q->dur + os.get_off_adj(mas);
+		ForecastMasterWindow *w = win + mas;
+		if (w->off && on <= w->off+1 && off+1 >= w->on) { // overlaps or touches the current window
+			if (on < w->on) w->on = on;
+			if (off > w->off) w->off = off;
+			continue;
+		}
+		if (w->off) {
+			e.sid = mas_id - 1;
+			e.gid = mas;
+			e.st = w->on;
+			e.et = w->off;
+			cb(&e, arg);
+		}
+		w->on = on;
+		w->off = off;
+	}
+}
+
+/** Forecast engine
+ * Runs the scheduler forward over a virtual clock from start_time for ndays days,
+ * reporting program starts, station runs and master on windows through cb.
+ * It works on a copy of the runtime queue and never touches station bits,
+ * logs or notifications. Sensor states are not predicted; a rain delay in
+ * effect is applied until it expires. Stations it removes do not shift the
+ * stations after them, as process_dynamic_events() does not shift them either.
+ */
+void forecast(time_os_t start_time, uint16_t ndays, ForecastCallback cb, void *arg) {
+	RuntimeQueueStruct queue[RUNTIME_QUEUE_SIZE];
+	unsigned char qids[RUNTIME_QUEUE_SIZE];
+	unsigned char nqueue = 0;
+	for(unsigned char qid=pd.qhead;qid!=0xFF;qid=pd.queue[qid].next) {
+		queue[nqueue++] = pd.queue[qid];
+	}
+	time_os_t seq_stop_times[NUM_SEQ_GROUPS];
+	memcpy(seq_stop_times, pd.last_seq_stop_times, sizeof(seq_stop_times));
+	ForecastMasterWindow win[NUM_MASTER_ZONES];
+	memset(win, 0, sizeof(win));
+	time_os_t next[MAX_NUM_PROGRAMS];
+	time_os_t end_time = start_time + (time_os_t)ndays*86400L;
+	time_os_t pause_end = os.status.pause_state ? start_time + os.pause_timer : 0;
+	unsigned char re = os.iopts[IOPT_REMOTE_EXT_MODE];
+	unsigned char en = os.status.enabled;
+	unsigned char pid, qi, gid;
+	RuntimeQueueStruct *q;
+	ForecastEvent e;
+
+	// stations already in the queue
+	for(q=queue;q<queue+nqueue;q++) {
+		if (!q->st || !q->dur) continue;
+		if (!en && q->pid<99) continue;
+		forecast_emit_station(q, win, cb, arg);
+	}
+
+	// the current minute has already been handled by the scheduler
+	time_os_t t = (start_time/60+1)*60;
+	for(pid=0;pid<pd.nprograms;pid++) {
+		next[pid] = en ? pd.get(pid)->next_match(t, ndays) : 0;
+	}
+
+	while(true) {
+		// advance the virtual clock to the next program start
+		t = 0;
+		for(pid=0;pid<pd.nprograms;pid++) {
+			if (next[pid] && (!t || next[pid] < t)) t = next[pid];
+		}
+		if (!t || t >= end_time) break;
+
+		// remove elements that are done by now, then recalculate the last stop time of sequential stations
+		for(int i=nqueue-1;i>=0;i--) {
+			if (t >= queue[i].deque_time) queue[i] = queue[--nqueue];
+		}
+		memset(seq_stop_times, 0, sizeof(seq_stop_times));
+		for(q=queue;q<queue+nqueue;q++) {
+			gid = os.get_station_gid(q->sid);
+			time_os_t sst = q->st + q->dur;
+			if (sst>t && os.is_sequential_station(q->sid) && !re && sst>seq_stop_times[gid]) {
+				seq_stop_times[gid] = sst;
 			}
 		}
+
+		unsigned char wl = os.iopts[IOPT_WATER_PERCENTAGE];
+		if (os.iopts[IOPT_USE_WEATHER]==WEATHER_METHOD_MONTHLY) {
+			time_os_t ct = t;
+			struct tm *ti = gmtime(&ct);
+			wl = wt_monthly[ti->tm_mon];
+		}
+
+		unsigned char n0 = nqueue;
+		for(pid=0;pid<pd.nprograms;pid++) {
+			if (next[pid] != t) continue;
+			ProgramStruct prog = *pd.get(pid);
+			bool will_delete = false;
+			unsigned char runcount = prog.check_match(t, &will_delete);
+			next[pid] = will_delete ? 0 : prog.next_match(t+60, (end_time-t)/86400L+1);
+			if (!runcount) continue;
+			if (strncmp(prog.name, ":>reboot", 8) == 0) continue; // special program commands do not run stations
+			if (!enqueue_program_stations(&prog, pid, runcount, wl, queue, &nqueue)) continue;
+			e.type = FORECAST_EVENT_PROGRAM;
+			e.pid = pid+1;
+			e.sid = 0;
+			e.gid = 0;
+			e.wl = prog.use_weather ? wl : 100;
+			e.st = t;
+			e.et = 0;
+			cb(&e, arg);
+		}
+		if (nqueue == n0) continue;
+
+		for(qi=n0;qi<nqueue;qi++) qids[qi-n0] = qi;
+		schedule_queue(queue, qids, nqueue-n0, seq_stop_times, t, (pause_end > t) ? pause_end - t : 0);
+
+		// stations that do not ignore rain delay are removed right after being queued
+		bool rd = os.status.rain_delayed && t < os.nvdata.rd_stop_time;
+		qi = n0;
+		while(qi < nqueue) {
+			q = queue + qi;
+			if (rd && !(os.attrib_igrd[q->sid>>3]&(1<<(q->sid&0x07)))) {
+				*q = queue[--nqueue];
+				continue;
+			}
+			forecast_emit_station(q, win, cb, arg);
+			qi++;
+		}
+	}
+
+	// close open master windows
+	e.type = FORECAST_EVENT_MASTER;
+	e.pid = 0;
+	e.wl = 0;
+	for (unsigned char mas = MASTER_1; mas < NUM_MASTER_ZONES; mas++) {
+		if (!win[mas].off) continue;
+		e.sid = os.masters[mas][MASOPT_SID] - 1;
+		e.gid = mas;
+		e.st = win[mas].on;
+		e.et = win[mas].off;
+		cb(&e, arg);
 	}
 }
+#endif
 
 /** Immediately reset all stations
  * No log records will be written
@@ -1447,10 +1791,20 @@ void reset_all_stations_immediate() {
  * Stations will be logged
  */
 void reset_all_stations() {
-	RuntimeQueueStruct *q = pd.queue;
+	RuntimeQueueStruct *q;
+	unsigned char qid, qnext;
+	time_os_t curr_time = os.now_tz();
 	// go through runtime queue and assign water time to 0
-	for(;q<pd.queue+pd.nqueue;q++) {
-		q->dur = 0;
+	// elements that have not started yet are removed right away
+	for(qid=pd.qhead;qid!=0xFF;qid=qnext) {
+		q = pd.queue+qid;
+		qnext = q->next;
+		if (q->st > curr_time) {
+			pd.dequeue(qid);
+		} else {
+			q->dur = 0;
+			pd.requeue(qid);
+		}
 	}
 }
 
@@ -1529,7 +1883,7 @@ void make_logfile_name(char *name) {
  * must be strictly two characters with an ending 0
  * so each name is 3 characters total
  */
-static const char log_type_names[] PROGMEM =
+const char log_type_names[] PROGMEM =
 	"  \0"
 	"s1\0"
 	"rd\0"
@@ -1543,13 +1897,51 @@ void write_log(unsigned char type, time_os_t curr_time) {
 
 	if (!os.iopts[IOPT_ENABLE_LOGGING]) return;
 
+	// Step 1: fill the record
+	LogRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.time = curr_time;
+	rec.type = type;
+	if(type == LOGDATA_STATION) {
+		rec.pid = pd.lastrun.program;
+		rec.sid = pd.lastrun.station;
+		rec.value = pd.lastrun.duration;
+		if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
+			// RAH implementation of flow sensor
+			rec.flags |= LOG_RECORD_GPM;
+			rec.gpm = flow_last_gpm;
+		}
+	} else {
+		if(type==LOGDATA_FLOWSENSE) {
+			ulong count = get_flow_count();
+			rec.value = (count>os.flowcount_log_start)?(count-os.flowcount_log_start):0;
+		}
+		switch(type) {
+			case LOGDATA_FLOWSENSE:
+				rec.value2 = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
+				break;
+			case LOGDATA_SENSOR1:
+				rec.value2 = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
+				break;
+			case LOGDATA_SENSOR2:
+				rec.value2 = (curr_time>os.sensor2_active_lasttime)?(curr_time-os.sensor2_active_lasttime):0;
+				break;
+			case LOGDATA_RAINDELAY:
+				rec.value2 = (curr_time>os.raindelay_on_lasttime)?(curr_time-os.raindelay_on_lasttime):0;
+				break;
+			case LOGDATA_WATERLEVEL:
+				rec.value2 = os.iopts[IOPT_WATER_PERCENTAGE];
+				break;
+		}
+	}
+
+#if defined(ARDUINO)
 	// file name will be logs/xxxxx.tx where xxxxx is the day in epoch time
 	snprintf (tmp_buffer, TMP_BUFFER_SIZE, "%lu", curr_time / 86400);
 	make_logfile_name(tmp_buffer);
 
-	// Step 1: open file if exists, or create new otherwise,
+	// Step 2: open file if exists, or create new otherwise,
 	// and move file pointer to the end
-#if defined(ARDUINO) // prepare log folder for Arduino
 
 	#if defined(ESP8266)
 	File file = LittleFS.open(tmp_buffer, "r+");
@@ -1581,83 +1973,38 @@ void write_log(unsigned char type, time_os_t curr_time) {
 	}
 	#endif
 
-#else // prepare log folder for RPI/LINUX
-	struct stat st;
-	if(stat(get_filename_fullpath(LOG_PREFIX), &st)) {
-		if(mkdir(get_filename_fullpath(LOG_PREFIX), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH)) {
-			return;
-		}
-	}
-	FILE *file;
-	file = fopen(get_filename_fullpath(tmp_buffer), "rb+");
-	if(!file) {
-		file = fopen(get_filename_fullpath(tmp_buffer), "wb");
-		if (!file)	return;
-	}
-	fseek(file, 0, SEEK_END);
-#endif	// prepare log folder
-
-	// Step 2: prepare data buffer
+	// Step 3: prepare data buffer
 	strcpy_P(tmp_buffer, PSTR("["));
 
+	size_t size;
 	if(type == LOGDATA_STATION) {
-		size_t size = strlen(tmp_buffer);
-		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%d", pd.lastrun.program);
+		size = strlen(tmp_buffer);
+		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%d", rec.pid);
 		strcat_P(tmp_buffer, PSTR(","));
 		size = strlen(tmp_buffer);
-		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%d", pd.lastrun.station);
+		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%d", rec.sid);
 		strcat_P(tmp_buffer, PSTR(","));
 		// duration is unsigned integer
 		size = strlen(tmp_buffer);
-		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%lu", (ulong)pd.lastrun.duration);
-
+		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%lu", (ulong)rec.value);
 	} else {
-		ulong lvalue=0;
-		if(type==LOGDATA_FLOWSENSE) {
-			lvalue = (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0;
-		}
-
-		size_t size = strlen(tmp_buffer);
-		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%lu", lvalue);
+		size = strlen(tmp_buffer);
+		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%lu", (ulong)rec.value);
 		strcat_P(tmp_buffer, PSTR(",\""));
 		strcat_P(tmp_buffer, log_type_names+type*3);
 		strcat_P(tmp_buffer, PSTR("\","));
-
-		switch(type) {
-			case LOGDATA_FLOWSENSE:
-				lvalue = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
-				break;
-			case LOGDATA_SENSOR1:
-				lvalue = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
-				break;
-			case LOGDATA_SENSOR2:
-				lvalue = (curr_time>os.sensor2_active_lasttime)?(curr_time-os.sensor2_active_lasttime):0;
-				break;
-			case LOGDATA_RAINDELAY:
-				lvalue = (curr_time>os.raindelay_on_lasttime)?(curr_time-os.raindelay_on_lasttime):0;
-				break;
-			case LOGDATA_WATERLEVEL:
-				lvalue = os.iopts[IOPT_WATER_PERCENTAGE];
-				break;
-		}
 		size = strlen(tmp_buffer);
-		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%lu", lvalue);
+		snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%lu", (ulong)rec.value2);
 	}
 	strcat_P(tmp_buffer, PSTR(","));
-	size_t size = strlen(tmp_buffer);
+	size = strlen(tmp_buffer);
 	snprintf(tmp_buffer + size, TMP_BUFFER_SIZE - size , "%lu", curr_time);
-	if((os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) && (type==LOGDATA_STATION)) {
-		// RAH implementation of flow sensor
+	if(rec.flags & LOG_RECORD_GPM) {
 		strcat_P(tmp_buffer, PSTR(","));
-		#if defined(ARDUINO)
-		dtostrf(flow_last_gpm,5,2,tmp_buffer+strlen(tmp_buffer));
-		#else
-		snprintf(tmp_buffer+strlen(tmp_buffer), TMP_BUFFER_SIZE, "%5.2f", flow_last_gpm);
-		#endif
+		dtostrf(rec.gpm,5,2,tmp_buffer+strlen(tmp_buffer));
 	}
 	strcat_P(tmp_buffer, PSTR("]\r\n"));
 
-#if defined(ARDUINO)
 	#if defined(ESP8266)
 	file.write((const uint8_t*)tmp_buffer, strlen(tmp_buffer));
 	#else
@@ -1665,8 +2012,8 @@ void write_log(unsigned char type, time_os_t curr_time) {
 	#endif
 	file.close();
 #else
-	fwrite(tmp_buffer, 1, strlen(tmp_buffer), file);
-	fclose(file);
+	// RPI/LINUX: the log writer stores the record as text or binary
+	LogWriter::append(&rec);
 #endif
 }
 
@@ -1731,13 +2078,15 @@ void delete_log(char *name) {
 	#endif
 
 #else // delete_log implementation for RPI/LINUX
+	LogWriter::close();
 	if (strncmp(name, "all", 3) == 0) {
-		// delete the log folder
+		// empty the log folder, then delete it
+		LogCatalog::remove_all();
 		rmdir(get_filename_fullpath(LOG_PREFIX));
 		return;
 	} else {
-		make_logfile_name(name);
-		remove(get_filename_fullpath(tmp_buffer));
+		// a day may have a text file, a binary file, or both, and its rollup
+		LogCatalog::remove(strtoul(name, NULL, 10));
 	}
 #endif
 }
@@ -1830,29 +2179,162 @@ static void perform_ntp_sync() {
 #endif
 }
 
+#if defined(USE_EVENT_LOOP)
+#define EVENT_LOOP_BUSY_INTERVAL 10  // loop interval after network or button activity (in ms)
+#define EVENT_LOOP_LINGER        250 // how long to keep that interval after the last activity (in ms)
+
+static ulong event_linger_timeout = 0;
+
+#if defined(OSPI)
+static bool button_events = false;
+
+/** Button line event handler: keep the loop running so ui_state_machine sees the press */
+static void button_event(int pin) {
+	uint64_t times[16];
+	gpio_event_read(pin, times, 16);
+	event_linger_timeout = millis() + EVENT_LOOP_LINGER;
+}
+#endif
+
+static void event_loop_begin() {
+#if defined(OSPI)
+	const unsigned char buttons[] = {PIN_BUTTON_1, PIN_BUTTON_2, PIN_BUTTON_3};
+	button_events = true;
+	for(unsigned char i=0; i<sizeof(buttons); i++) {
+		int fd = gpio_event_open(buttons[i]);
+		if(fd<0 || !EventLoop::watch(fd, button_event, buttons[i])) button_events = false;
+	}
+#endif
+}
+
+/** How long the event loop may sleep (in ms), -1 for the next second tick */
+static int event_loop_timeout() {
+	if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW && !flow_capture) return 1; // poll flow sensor every 1ms
+#if defined(USE_DISPLAY)
+	if(!button_events) return UI_STATE_MACHINE_INTERVAL; // poll buttons
+#endif
+#if defined(USE_SSD1306)
+	if(led_blink_ms) return UI_STATE_MACHINE_INTERVAL;
+#endif
+	if((long)(event_linger_timeout-millis()) > 0 || os.mqtt.want_write()) return EVENT_LOOP_BUSY_INTERVAL;
+	// the cloud connection is opened inside the OTF library and is not registered, poll it while it is up
+	if(otf && otf->getCloudStatus()==OTF::CONNECTED) return EVENT_LOOP_BUSY_INTERVAL;
+	return -1;
+}
+#endif
+
 #if !defined(ARDUINO) // main function for RPI/LINUX
+static volatile sig_atomic_t quit_signal = 0;
+
+static void handle_quit_signal(int sig) {
+	quit_signal = sig;
+}
+
 int main(int argc, char *argv[]) {
 	// Disable buffering to work with systemctl journal
 	setvbuf(stdout, NULL, _IOLBF, 0);
 	printf("Starting OpenSprinkler\n");
 
 	int opt;
-	while(-1 != (opt = getopt(argc, argv, "d:"))) {
+	ulong log_flush_interval = LOG_FLUSH_INTERVAL;
+	bool log_sync = false;
+	unsigned char log_format = LOG_FORMAT_TEXT;
+	bool log_conversion = false;
+	ulong log_retain_bytes = LOG_RETAIN_BYTES;
+	ulong log_retain_days = LOG_RETAIN_DAYS;
+	long event_port = 0;
+	while(-1 != (opt = getopt(argc, argv, "d:f:l:sbcm:k:e:"))) {
 		switch(opt) {
 		case 'd':
 			set_data_dir(optarg);
 			break;
+		case 'l':
+			// seconds between writes of pending log records
+			log_flush_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			// fdatasync log files after each write
+			log_sync = true;
+			break;
+		case 'b':
+			// write logs in the binary format
+			log_format = LOG_FORMAT_BINARY;
+			break;
+		case 'c':
+			// convert text logs to binary, then exit
+			log_conversion = true;
+			break;
+		case 'm':
+			// most megabytes of logs to keep, 0 for no limit
+			log_retain_bytes = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'k':
+			// most days of logs to keep, 0 for no limit
+			log_retain_days = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			// serve the event stream on this port, off unless given
+			event_port = strtol(optarg, NULL, 10);
+			break;
+#if !defined(OSPI)
+		case 'f':
+			// simulate a flow sensor pulsing at the given rate (pulses per second)
+			gpio_event_simulate(PIN_SENSOR1, strtoul(optarg, NULL, 10));
+			break;
+#endif
 		default:
 			// ignore options we don't understand
 			break;
 		}
 	}
 
+	log_set_dir(get_filename_fullpath(LOG_PREFIX));
+	if(log_conversion) {
+		int n = log_convert();
+		if(n < 0) {
+			printf("Log conversion failed\n");
+			return 1;
+		}
+		printf("Converted %d log records\n", n);
+		return 0;
+	}
+	LogCatalog::begin(log_retain_bytes, log_retain_days);
+	LogWriter::begin(log_flush_interval, log_sync, log_format);
+	IOWorker::begin();
+	// stop cleanly, so that pending log records, notifications and saves are written
+	signal(SIGINT, handle_quit_signal);
+	signal(SIGTERM, handle_quit_signal);
+
+#if defined(USE_EVENT_LOOP)
+	// started before the web server and the event stream, whose sockets are registered with it
+	bool event_loop = EventLoop::begin();
+#endif
 	do_setup();
-
-	while(true) {
+	if(event_port > 0 && event_port < 65536) EventStream::begin((uint16_t)event_port);
+
+#if defined(USE_EVENT_LOOP)
+	if(event_loop) {
+		event_loop_begin();
+		while(!quit_signal) {
+			do_loop();
+			if(EventLoop::wait(event_loop_timeout()) & EVENT_SOCKET) {
+				event_linger_timeout = millis() + EVENT_LOOP_LINGER;
+			}
+		}
+	} else {
+		DEBUG_PRINTLN("event loop not available, polling instead");
+	}
+#endif
+	while(!quit_signal) {
 		do_loop();
+		delay(1); // sleep 1 ms to minimize CPU usage
 	}
+
+	printf("Stopping OpenSprinkler\n");
+	EventStream::end();
+	IOWorker::end();
+	LogWriter::end();
+	file_sync();
 	return 0;
 }
 #endif
@@ -35,5 +35,30 @@ void reset_all_stations_immediate();
 void delete_log(char *name);
 void write_log(unsigned char type, time_os_t curr_time);
 void make_logfile_name(char *name);
+ulong get_flow_count();   // flow sensor pulse count
+ulong get_flowcount_rt(); // real-time flow rate
+
+#if !defined(ARDUINO)
+#define FORECAST_MAX_DAYS      31 // maximum number of days the forecast engine looks ahead
+#define FORECAST_MAX_EVENTS    16384 // most events /jf outputs, the rest are cut off
+
+#define FORECAST_EVENT_PROGRAM 0  // a program starts
+#define FORECAST_EVENT_STATION 1  // a station runs
+#define FORECAST_EVENT_MASTER  2  // a master station is on
+
+/** Forecast event, produced by the forecast engine */
+struct ForecastEvent {
+	unsigned char type; // forecast event type
+	unsigned char pid;  // program index as stored in the runtime queue (program index + 1, 99 for test, 254 for run-once)
+	unsigned char sid;  // station index (master station index for master events)
+	unsigned char gid;  // sequential group id of the station
+	unsigned char wl;   // water percentage applied to the program
+	time_os_t st;       // start time (or master on time)
+	time_os_t et;       // end time (or master off time)
+};
+
+typedef void (*ForecastCallback)(const ForecastEvent *e, void *arg);
+void forecast(time_os_t start_time, uint16_t ndays, ForecastCallback cb, void *arg);
+#endif
 
 #endif // _MAIN_H
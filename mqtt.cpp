@@ -37,6 +37,7 @@
 	#include <time.h>
 	#include <stdio.h>
 	#include <mosquitto.h>
+	#include <pthread.h>
 
 	struct mosquitto *mqtt_client = NULL;
 #endif
@@ -47,6 +48,7 @@
 #include "program.h"
 #include "types.h"
 #include "mqtt.h"
+#include "eventloop.h"
 #include "ArduinoJson.hpp"
 
 // Debug routines to help identify any blocking of the event loop for an extended period
@@ -207,6 +209,7 @@ void manualRun(char *message){
 				q->dur = timer;
 				q->sid = sid;
 				q->pid = 99;
+				if(sqi!=0xFF) pd.requeue(sqi);
 				schedule_all_stations(curr_time);
 			}else{
 				DEBUG_LOGF("Queue is full.\r\n");
@@ -221,9 +224,11 @@ void manualRun(char *message){
 		if(findKeyVal(message, tmp_buffer, TMP_BUFFER_SIZE, PSTR("ssta"), true)){
 			ssta = atoi(tmp_buffer);
 		}
-		RuntimeQueueStruct *q = pd.queue + pd.station_qid[sid];
-		q->deque_time = curr_time;
-		turn_off_station(sid, curr_time, ssta);
+		if(pd.station_qid[sid]!=0xFF){
+			RuntimeQueueStruct *q = pd.queue + pd.station_qid[sid];
+			q->deque_time = curr_time;
+			turn_off_station(sid, curr_time, ssta);
+		}
 	}
 	return;
 }
@@ -459,6 +464,11 @@ void OSMqtt::loop(void) {
 #endif
 }
 
+bool OSMqtt::want_write(void) {
+	if (mqtt_client == NULL || !_enabled) return false;
+	return _want_write();
+}
+
 /**************************** ARDUINO ********************************************/
 #if defined(ARDUINO)
 
@@ -540,6 +550,7 @@ void subscribe_callback(const char *topic, unsigned char *payload, unsigned int
 	DEBUG_LOGF("Subscribe Callback\r\n");
 	payload[length] = 0; // properly end the message
 	char* message = (char*)payload;
+	KeyValIndex kv(message);
 	if(!checkPassword(message)){
 		return;
 	}
@@ -574,6 +585,8 @@ int OSMqtt::_loop(void) {
 	return mqtt_client->state();
 }
 
+bool OSMqtt::_want_write(void) { return false; }
+
 const char * OSMqtt::_state_string(int rc) {
 	switch (rc) {
 		case MQTT_CONNECTION_TIMEOUT:  return "The server didn't respond within the keepalive time";
@@ -595,6 +608,14 @@ const char * OSMqtt::_state_string(int rc) {
 
 static bool _connected = false;
 
+/** Notifications are published by the I/O worker while the main thread
+ * runs the client, so the calls into the library take turns */
+static pthread_mutex_t mqtt_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct MqttLock {
+	MqttLock() { pthread_mutex_lock(&mqtt_mutex); }
+	~MqttLock() { pthread_mutex_unlock(&mqtt_mutex); }
+};
+
 static void _mqtt_connection_cb(struct mosquitto *mqtt_client, void *obj, int reason) {
 	DEBUG_LOGF("MQTT Connnection Callback: %s (%d)\r\n", mosquitto_strerror(reason), reason);
 
@@ -624,6 +645,7 @@ static void _mqtt_log_cb(struct mosquitto *mqtt_client, void *obj, int level, co
 }
 
 int OSMqtt::_init(void) {
+	MqttLock lock;
 	int major, minor, revision;
 
 	mosquitto_lib_init();
@@ -651,6 +673,7 @@ int OSMqtt::_init(void) {
 }
 
 int OSMqtt::_connect(void) {
+	MqttLock lock;
 	int rc;
 	if (_username[0]) {
 		rc = mosquitto_username_pw_set(mqtt_client, _username, _password);
@@ -664,6 +687,10 @@ int OSMqtt::_connect(void) {
 		DEBUG_LOGF("MQTT Connect: Connection Failed (%s)\r\n", mosquitto_strerror(rc));
 		return MQTT_ERROR;
 	}
+#if defined(USE_EVENT_LOOP)
+	// each connect opens a new socket, the old one left the event loop when it was closed
+	EventLoop::add_socket(mosquitto_socket(mqtt_client));
+#endif
 
 	// Allow 10ms for the Broker's ack to be received. We need this on start-up so that the
 	// connection is registered before we attempt to send our first NOTIFY_REBOOT notification.
@@ -673,6 +700,7 @@ int OSMqtt::_connect(void) {
 }
 
 int OSMqtt::_disconnect(void) {
+	MqttLock lock;
 	int rc = mosquitto_disconnect(mqtt_client);
 	return rc == MOSQ_ERR_SUCCESS ? MQTT_SUCCESS : MQTT_ERROR;
 }
@@ -680,6 +708,7 @@ int OSMqtt::_disconnect(void) {
 bool OSMqtt::_connected(void) { return ::_connected; }
 
 int OSMqtt::_publish(const char *topic, const char *payload) {
+	MqttLock lock;
 	String total_topic(_pub_topic); // concatenate root topic with specific topic
 	total_topic += "/";
 	total_topic += topic;
@@ -695,6 +724,7 @@ void subscribe_callback(struct mosquitto *mosq, void *obj, const struct mosquitt
 	DEBUG_LOGF("Callback\r\n");
 	char *topic = message->topic;
 	char *msg = (char*)(message->payload);
+	KeyValIndex kv(msg);
 
 	if(!checkPassword(msg)){
 		return;
@@ -717,6 +747,7 @@ void subscribe_callback(struct mosquitto *mosq, void *obj, const struct mosquitt
 }
 
 int OSMqtt::_subscribe(void) {
+	MqttLock lock;
 	mosquitto_message_callback_set(mqtt_client, subscribe_callback);
 	int rc = mosquitto_subscribe(mqtt_client, NULL, _sub_topic, 0);
 	if (rc != MOSQ_ERR_SUCCESS) {
@@ -727,9 +758,12 @@ int OSMqtt::_subscribe(void) {
 }
 
 int OSMqtt::_loop(void) {
+	MqttLock lock;
 	return mosquitto_loop(mqtt_client, 0 , 1);
 }
 
+bool OSMqtt::_want_write(void) { MqttLock lock; return mosquitto_want_write(mqtt_client); }
+
 const char * OSMqtt::_state_string(int error) {
 	return mosquitto_strerror(error);
 }
@@ -44,6 +44,7 @@ private:
     static int _publish(const char *topic, const char *payload);
     static int _subscribe(void);
     static int _loop(void);
+    static bool _want_write(void);
     static const char * _state_string(int state);
     public:
     static void init(void);
@@ -53,6 +54,7 @@ private:
     static void publish(const char *topic, const char *payload);
     static void subscribe();
     static void loop(void);
+    static bool want_write(void); // outgoing data is waiting for the socket, loop() needs to be called again soon
     static char* get_pub_topic() { return _pub_topic; }
     static char* get_sub_topic() { return _sub_topic; }
 };
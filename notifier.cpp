@@ -25,6 +25,10 @@
 #include "program.h"
 #include "ArduinoJson.hpp"
 #include "opensprinkler_server.h"
+#if !defined(ARDUINO)
+	#include "eventstream.h"
+	#include "ioworker.h"
+#endif
 
 NotifNodeStruct* NotifQueue::head = NULL;
 NotifNodeStruct* NotifQueue::tail = NULL;
@@ -59,11 +63,21 @@ void ip2string(char* str, size_t str_len, unsigned char ip[4]) {
 }
 
 bool NotifQueue::add(uint16_t t, uint32_t l, float f, uint8_t b) {
+#if !defined(ARDUINO)
+	NotifSnapshot snap;
+	notif_snapshot(t, l, &snap);
+	// a flow alert is only an event if it fires
+	if (t == NOTIFY_FLOW_ALERT && !notif_flow_alert(&snap)) return false;
+	EventStream::push(t, l, f, b); // stream clients get every event
+#endif
 		if (!is_notif_enabled(t)) { // if not subscribed to this type, return
 		return false;
 	}
 	if(nqueue<NOTIF_QUEUE_MAXSIZE) {
 		NotifNodeStruct* node = new NotifNodeStruct(t, l, f, b);
+#if !defined(ARDUINO)
+		node->snap = snap;
+#endif
 		if(tail==NULL) {
 			head = node;
 		} else {
@@ -90,18 +104,26 @@ void NotifQueue::clear() {
 	}
 }
 
-void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval);
-
 bool NotifQueue::run(int n) {
 	if(nqueue == 0) return false; // queue is empty
 	if(n<=0 || n>nqueue) n=nqueue;
 	while(nqueue!=0 && n!=0) {
 		NotifNodeStruct* node = head;
+#if defined(ARDUINO)
+		{
+			// sent right away, so nothing has changed since the notification was queued
+			NotifSnapshot snap;
+			notif_snapshot(node->type, node->lval, &snap);
+			push_message(node->type, node->lval, node->fval, node->bval, &snap);
+		}
+#else
+		// sent by the I/O worker. If its ring is full, the rest wait for the next run
+		if(!IOWorker::notify(node->type, node->lval, node->fval, node->bval, &node->snap)) break;
+#endif
 		head = head->next;
 		if(head==NULL) {
 			tail = NULL;
 		}
-		push_message(node->type, node->lval, node->fval, node->bval);
 		DEBUG_PRINTF("NotifQueue::run (type %d) [%d]\n", node->type, nqueue);
 		delete node;
 		nqueue--;
@@ -110,10 +132,59 @@ bool NotifQueue::run(int n) {
 	return true;
 }
 
+void notif_snapshot(uint16_t type, uint32_t lval, NotifSnapshot *snap) {
+	uint32_t flowrate100 = (((uint32_t)os.iopts[IOPT_PULSE_RATE_1])<<8) + os.iopts[IOPT_PULSE_RATE_0];
+	snap->pulse_rate = flowrate100 / 100.f;
+	//flow_last_gpm is actually collected and stored as pulses per minute, not gallons per minute
+	snap->gpm = flow_last_gpm * snap->pulse_rate;
+	snap->flow_sensor = (os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW);
+	snap->name[0] = 0;
+	switch(type) {
+		case NOTIFY_STATION_ON:
+		case NOTIFY_STATION_OFF:
+		case NOTIFY_FLOW_ALERT:
+			if(lval<MAX_NUM_STATIONS) os.get_station_name(lval, snap->name);
+			break;
+		case NOTIFY_PROGRAM_SCHED:
+			if(lval<pd.nprograms) {
+				ProgramStruct prog;
+				pd.read(lval, &prog);
+				strncpy(snap->name, prog.name, PROGRAM_NAME_SIZE);
+				snap->name[PROGRAM_NAME_SIZE] = 0;
+			}
+			break;
+	}
+}
+
+/** A flow alert fires if the station name ends with a setpoint (its last 5
+ * characters, as a number) and the flow rate is above it */
+bool notif_flow_alert(const NotifSnapshot *snap, float *setpoint) {
+	size_t len = strlen(snap->name);
+	// only proceed if flow rate is positive, and the station name has at least 5 characters
+	if (snap->gpm <= 0 || len <= 5) return false;
+	const char *station_name_last_five_chars = snap->name + len - 5;
+	// Had to switch to use strtod because sscanf in AVR doesn't work with float :(
+	char *endptr;
+	float flow_gpm_alert_setpoint = strtod(station_name_last_five_chars, &endptr);
+	//If a number is not detected as a station name suffix, never send an alert
+	if (endptr == station_name_last_five_chars) return false;
+	if (setpoint) *setpoint = flow_gpm_alert_setpoint;
+	return snap->gpm > flow_gpm_alert_setpoint;
+}
+
 #define PUSH_TOPIC_LEN	120
 #define PUSH_PAYLOAD_LEN TMP_BUFFER_SIZE
 
-void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
+#if !defined(ARDUINO)
+// messages are pushed by the I/O worker while the main thread uses the
+// shared buffers, so they have buffers of their own
+static char push_tmp_buffer[TMP_BUFFER_SIZE*2];
+static char push_ether_buffer[ETHER_BUFFER_SIZE*2];
+#define tmp_buffer push_tmp_buffer
+#define ether_buffer push_ether_buffer
+#endif
+
+void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval, const NotifSnapshot *snap) {
 	if (!is_notif_enabled(type)) {
 		return;
 	}
@@ -124,8 +195,6 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 	// check if ifttt key exists and also if the enable bit is set
 	os.sopt_load(SOPT_IFTTT_KEY, tmp_buffer);
 	bool ifttt_enabled = (strlen(tmp_buffer)!=0);
-	// flow rate
-	uint32_t flowrate100 = (((uint32_t)os.iopts[IOPT_PULSE_RATE_1])<<8) + os.iopts[IOPT_PULSE_RATE_0];
 
 #define DEFAULT_EMAIL_PORT	465
 
@@ -217,7 +286,7 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 			}
 			if (ifttt_enabled || email_enabled) {
 				strcat_P(postval, PSTR("Station ["));
-				os.get_station_name(lval, postval+strlen(postval));
+				strcat(postval, snap->name);
 				strcat_P(postval, PSTR("] just turned on."));
 				if((int)fval > 0){
 					strcat_P(postval, PSTR(" It's scheduled to run for "));
@@ -233,8 +302,8 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 				strcat_P(payload, PSTR("{\"state\":0"));
 				if((int)fval > 0) {
 					snprintf_P(payload+strlen(payload), PUSH_PAYLOAD_LEN, PSTR(",\"duration\":%d"), (int)fval);
-					if (os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
-						float gpm = flow_last_gpm * flowrate100 / 100.f;
+					if (snap->flow_sensor) {
+						float gpm = snap->gpm;
 						#if defined(OS_AVR)
 						snprintf_P(payload+strlen(payload), PUSH_PAYLOAD_LEN, PSTR(",\"flow\":%d.%02d"), (int)gpm, (int)(gpm*100)%100);
 						#else
@@ -246,15 +315,15 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 			}
 			if (ifttt_enabled || email_enabled) {
 				strcat_P(postval, PSTR("Station ["));
-				os.get_station_name(lval, postval+strlen(postval));
+				strcat(postval, snap->name);
 				strcat_P(postval, PSTR("] closed."));
 				if((int)fval > 0) {
 					strcat_P(postval, PSTR(" It ran for "));
 					snprintf_P(postval+strlen(postval), TMP_BUFFER_SIZE, PSTR(" %d minutes %d seconds."), (int)fval/60, (int)fval%60);
 				}
 
-				if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
-					float gpm = flow_last_gpm * flowrate100 / 100.f;
+				if(snap->flow_sensor) {
+					float gpm = snap->gpm;
 					#if defined(OS_AVR)
 					snprintf_P(postval+strlen(postval), TMP_BUFFER_SIZE, PSTR(" Flow rate: %d.%02d"), (int)gpm, (int)(gpm*100)%100);
 					#else
@@ -267,43 +336,9 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 
 		case NOTIFY_FLOW_ALERT:{
 			//First determine if a Flow Alert should be sent based on flow amount and setpoint
-
-			//Added variable to track flow alert status
-			bool flow_alert_flag = false;
-
 			//Added variable for flow_gpm_alert_setpoint and set default value to max
 			float flow_gpm_alert_setpoint = 999.9f;
-
-			//Added variable for tmp station name
-			char tmp_station_name[STATION_NAME_SIZE];
-
-			//Get satation name
-			os.get_station_name(lval, tmp_station_name);
-
-			// only proceed if flow rate is positive, and the station name has at least 5 characters
-			if (flow_last_gpm > 0 && strlen(tmp_station_name) > 5) {
-				const char *station_name_last_five_chars = tmp_station_name;
-				// extract the last 5 characters
-				station_name_last_five_chars = tmp_station_name + strlen(tmp_station_name) - 5;
-				// Convert last five characters to number and check if valid
-				// Had to switch to use strtod because sscanf in AVR doesn't work with float :(
-				char *endptr;
-				flow_gpm_alert_setpoint = strtod(station_name_last_five_chars, &endptr);
-				if (endptr != station_name_last_five_chars) {
-					//station_name_last_five_chars was successfully converted to a number 
-					//flow_last_gpm is actually collected and stored as pulses per minute, not gallons per minute
-					// Alert Check - Compare flow_gpm_alert_setpoint with flow_last_gpm and enable flow_alert_flag if flow is above setpoint
-					if ((flow_last_gpm*flowrate100/100.f) > flow_gpm_alert_setpoint) {
-						flow_alert_flag = true;
-					}
-				} else {
-					//Could not convert to a valid number. If a number is not detected as a station name suffix, never send an alert
-					flow_alert_flag = false;
-				}
-			} else {
- 				//Station name was not long enough to include 5 character flow setpoint.
-				flow_alert_flag = false;
-			}
+			bool flow_alert_flag = notif_flow_alert(snap, &flow_gpm_alert_setpoint);
 
 			// If flow_alert_flag is true, format the appropriate messages, else don't send alert
 			if (flow_alert_flag == true) {
@@ -311,7 +346,7 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 				if (os.mqtt.enabled()) {
 					//Format mqtt message
 					snprintf_P(topic, PUSH_TOPIC_LEN, PSTR("station/%d/alert/flow"), lval);
-					float gpm = flow_last_gpm * flowrate100 / 100.f;
+					float gpm = snap->gpm;
 					#if defined(OS_AVR)
 					snprintf_P(payload, PUSH_PAYLOAD_LEN, PSTR("{\"flow_rate\":%d.%02d,\"duration\":%d,\"alert_setpoint\":%d.%02d}"), (int)gpm, (int)(gpm*100)%100,
 					(int)fval, (int)flow_gpm_alert_setpoint, (int)(flow_gpm_alert_setpoint*100)%100);
@@ -340,8 +375,7 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 
 					strcat_P(postval, PSTR(", Station ["));
 					//Truncate flow setpoint value off station name to shorten ifttt\email message
-					tmp_station_name[(strlen(tmp_station_name) - 5)] = '\0';
-					strcat_P(postval, tmp_station_name);
+					strncat(postval, snap->name, strlen(snap->name) - 5);
 					strcat_P(postval, PSTR("]"));
 					if(fval > 0){ // if there is a valid duration
 						strcat_P(postval, PSTR(" ran for "));
@@ -349,7 +383,7 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 					}
 
 					strcat_P(postval, PSTR(" FLOW ALERT!"));
-					float gpm = flow_last_gpm * flowrate100 / 100.f;
+					float gpm = snap->gpm;
 					#if defined(OS_AVR)
 					snprintf_P(postval+strlen(postval), TMP_BUFFER_SIZE, PSTR(" | Flow rate: %d.%02d > Flow alert setpoint: %d.%02d"),
 						(int)gpm, (int)(gpm*100)%100, (int)flow_gpm_alert_setpoint, (int)(flow_gpm_alert_setpoint*100)%100);
@@ -377,11 +411,7 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 				if (bval) strcat_P(postval, PSTR("manually"));
 				else strcat_P(postval, PSTR("automatically"));
 				strcat_P(postval, PSTR(" scheduled Program "));
-				{
-					ProgramStruct prog;
-					pd.read(lval, &prog);
-					if(lval<pd.nprograms) strcat(postval, prog.name);
-				}
+				strcat(postval, snap->name);
 				snprintf_P(postval+strlen(postval), TMP_BUFFER_SIZE, PSTR(" with %d%% water level."), (int)fval);
 				if(email_enabled) { email_message.subject += PSTR("program event"); }
 			}
@@ -428,7 +458,7 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 
 		case NOTIFY_FLOWSENSOR:
 			{
-				float vol = lval*flowrate100/100.f;
+				float vol = lval*snap->pulse_rate;
 				if (os.mqtt.enabled()) {
 					strcpy_P(topic, PSTR("sensor/flow"));
 					#if defined(OS_AVR)
@@ -516,7 +546,13 @@ void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval) {
 						"Content-Type: application/json\r\n\r\n$S"),
 						SOPT_IFTTT_KEY, DEFAULT_IFTTT_URL, user_agent_string, strlen(postval), postval);
 
+	#if !defined(ARDUINO)
+		http_response_buffer = ether_buffer;
+		os.send_http_request(DEFAULT_IFTTT_URL, 80, ether_buffer, remote_http_callback);
+		http_response_buffer = NULL;
+	#else
 		os.send_http_request(DEFAULT_IFTTT_URL, 80, ether_buffer, remote_http_callback);
+	#endif
 	}
 
 	if(email_enabled){
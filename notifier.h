@@ -30,12 +30,29 @@
 #include "OpenSprinkler.h"
 #include "types.h"
 
+/** What a notification says about its station, program and flow, taken
+ * when it is queued: it may be sent later (by the I/O worker on Linux),
+ * after these have changed */
+struct NotifSnapshot {
+	float pulse_rate;   // volume per flow sensor pulse
+	float gpm;          // flow rate of the last station that stopped, in volume per minute
+	uint8_t flow_sensor; // whether sensor 1 is a flow sensor
+	char name[STATION_NAME_SIZE+1]; // station or program name, PROGRAM_NAME_SIZE is the same
+};
+
+void notif_snapshot(uint16_t type, uint32_t lval, NotifSnapshot *snap);
+bool notif_flow_alert(const NotifSnapshot *snap, float *setpoint = NULL); // whether a flow alert fires
+void push_message(uint16_t type, uint32_t lval, float fval, uint8_t bval, const NotifSnapshot *snap);
+
 /** Notifier Node data structure */
 struct NotifNodeStruct {
 	uint16_t type;
 	uint32_t lval;
 	float fval;
 	uint8_t bval;
+#if !defined(ARDUINO)
+	NotifSnapshot snap;
+#endif
 	NotifNodeStruct *next;
 	NotifNodeStruct(uint16_t t, uint32_t l=0, float f=0.f, uint8_t b=0) : type(t), lval(l), fval(f), bval(b), next(NULL)
 	{ }
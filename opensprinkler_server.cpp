@@ -61,6 +61,10 @@
 	#include <stdarg.h>
 	#include <stdlib.h>
 	#include "etherport.h"
+	#include "logstore.h"
+	#include "logwriter.h"
+	#include "ioworker.h"
+	#include <zlib.h>
 #endif
 
 extern char ether_buffer[];
@@ -145,11 +149,116 @@ unsigned char findKeyVal (const OTF::Request &req,char *strbuf, uint16_t maxlen,
 	return 0;
 }
 #endif
+
+/** Query string index
+ * The keys of the indexed string are hashed into a table of their offsets,
+ * in one pass over the string. Keys that do not fit in the table are left
+ * to the scan in findKeyVal.
+ */
+#if defined(OS_AVR)
+#define KV_INDEX_SLOTS 128
+#else
+#define KV_INDEX_SLOTS 256
+#endif
+#define KV_INDEX_EMPTY 0xFFFF
+
+uint16_t KeyValIndex::request = 0;
+
+static const char *kv_str = NULL;
+static size_t kv_len = 0;      // length of kv_str when it was indexed
+static uint16_t kv_request = 0; // request kv_str was indexed in
+static bool kv_full = false; // some keys are not in the table
+static uint16_t kv_keys[KV_INDEX_SLOTS]; // offset of each key in kv_str
+
+static bool kv_end(char c) {
+	return !c || c==' ' || c=='\n';
+}
+
+static uint16_t kv_hash_step(uint16_t h, char c) {
+	return h*31 + (unsigned char)c;
+}
+
+/** If s holds key followed by '=', return the value after it, otherwise NULL */
+static const char* kv_match(const char *s, const char *key, bool key_in_pgm) {
+	char c;
+	while((c = key_in_pgm ? pgm_read_byte(key) : *key) != 0) {
+		if(*s!=c) return NULL;
+		s++;
+		key++;
+	}
+	return (*s=='=') ? s+1 : NULL;
+}
+
+void KeyValIndex::build(const char *str) {
+	kv_str = str;
+	if(!str) return;
+	memset(kv_keys, 0xFF, sizeof(kv_keys));
+	kv_full = false;
+	const char *s = str;
+	while(!kv_end(*s)) {
+		const char *key = s;
+		uint16_t h = 0;
+		while(!kv_end(*s) && *s!='&' && *s!='=') h = kv_hash_step(h, *s++);
+		if(*s=='=' && s>key) {
+			if(key-str >= KV_INDEX_EMPTY) {
+				kv_full = true;
+				break;
+			}
+			uint16_t slot = h, n;
+			for(n=0;n<KV_INDEX_SLOTS;n++,slot++) {
+				slot &= (KV_INDEX_SLOTS-1);
+				uint16_t off = kv_keys[slot];
+				if(off==KV_INDEX_EMPTY) {
+					kv_keys[slot] = key-str;
+					break;
+				}
+				if(!strncmp(str+off, key, s-key+1)) break; // a repeated key, the first one is kept
+			}
+			if(n==KV_INDEX_SLOTS) kv_full = true;
+		}
+		while(!kv_end(*s) && *s!='&') s++;
+		if(*s=='&') s++;
+	}
+	kv_len = s-str;
+	kv_request = request;
+}
+
+/** True if str is the string that was indexed for the current request */
+static bool kv_indexed(const char *str) {
+	return str==kv_str && kv_request==KeyValIndex::request && kv_end(str[kv_len]);
+}
+
+/** Find the value of a key in the indexed string, NULL if it is not in the table */
+static const char* kv_find(const char *key, bool key_in_pgm) {
+	uint16_t h = 0;
+	char c;
+	for(const char *k=key; (c = key_in_pgm ? pgm_read_byte(k) : *k) != 0; k++) h = kv_hash_step(h, c);
+	uint16_t slot = h;
+	for(uint16_t n=0;n<KV_INDEX_SLOTS;n++,slot++) {
+		slot &= (KV_INDEX_SLOTS-1);
+		uint16_t off = kv_keys[slot];
+		if(off==KV_INDEX_EMPTY) break;
+		const char *val = kv_match(kv_str+off, key, key_in_pgm);
+		if(val) return val;
+	}
+	return NULL;
+}
+
 unsigned char findKeyVal (const char *str,char *strbuf, uint16_t maxlen,const char *key,bool key_in_pgm=false,uint8_t *keyfound=NULL) {
 	uint8_t found=0;
 	uint16_t i=0;
 	const char *kp;
 	if(str==NULL||strbuf==NULL||key==NULL) {return 0;}
+	if(kv_indexed(str)) {
+		// look the key up instead of scanning for it
+		const char *val = kv_find(key, key_in_pgm);
+		if(val) {
+			str = val;
+			found = 1;
+		} else if(!kv_full) {
+			str = "";
+		}
+	}
 	kp=key;
 	if (key_in_pgm) {
 		// key is in program memory space
@@ -225,14 +334,60 @@ char dec2hexchar(unsigned char dec) {
 }
 
 #if defined(USE_OTF)
-void print_header(OTF_PARAMS_DEF, bool isJson=true, int len=0) {
+void print_header(OTF_PARAMS_DEF, bool isJson=true, int len=0, const char *etag=NULL) {
 	res.writeStatus(200, F("OK"));
 	res.writeHeader(F("Content-Type"), isJson?F("application/json"):F("text/html"));
 	if(len>0)
 		res.writeHeader(F("Content-Length"), len);
 	res.writeHeader(F("Access-Control-Allow-Origin"), F("*"));
-	res.writeHeader(F("Cache-Control"), F("max-age=0, no-cache, no-store, must-revalidate"));
+	if(etag) {
+		// a tagged document may be kept, as long as it is checked again before use
+		res.writeHeader(F("ETag"), etag);
+		res.writeHeader(F("Cache-Control"), F("max-age=0, no-cache, must-revalidate"));
+	} else {
+		res.writeHeader(F("Cache-Control"), F("max-age=0, no-cache, no-store, must-revalidate"));
+	}
+	res.writeHeader(F("Connection"), F("close"));
+}
+
+/** Entity tags
+ * A JSON document is tagged with the versions of the state it shows. When
+ * a client sends the tag back in If-None-Match and the state has not
+ * changed, it gets 304 Not Modified before anything is rendered. The first
+ * part of the tag tells runs apart, as the versions start over at boot.
+ * /jc and /ja are not tagged: they carry the controller time and live
+ * sensor, weather and queue values, so they change every second.
+ */
+#define ETAG_SIZE 48
+
+static uint32_t etag_run = 0;
+static unsigned char iopts_seen[NUM_IOPTS];
+
+/** Version of the options
+ * Some options are set in place without a save (e.g. the watering level by
+ * the weather callback), so the integer options are also compared with the
+ * copy seen last time.
+ */
+static uint32_t options_version() {
+	if(memcmp(iopts_seen, os.iopts, NUM_IOPTS)) {
+		memcpy(iopts_seen, os.iopts, NUM_IOPTS);
+		os.state_changed(STATE_OPTIONS);
+	}
+	return os.state_versions[STATE_OPTIONS];
+}
+
+/** Make the tag from up to three versions, and answer 304 if the client has it */
+static bool etag_match(OTF_PARAMS_DEF, char *etag, uint32_t v1, uint32_t v2, uint32_t v3=0) {
+	if(!etag_run) etag_run = ((uint32_t)os.now_tz() ^ (uint32_t)millis()) | 1;
+	snprintf(etag, ETAG_SIZE, "\"%lx-%lx-%lx-%lx\"", (ulong)etag_run, (ulong)v1, (ulong)v2, (ulong)v3);
+	const char *inm = req.getHeader("If-None-Match");
+	if(!inm || !strstr(inm, etag)) return false; // the header may list several tags
+	res.writeStatus(304, F("Not Modified"));
+	res.writeHeader(F("ETag"), etag);
+	res.writeHeader(F("Access-Control-Allow-Origin"), F("*"));
+	res.writeHeader(F("Cache-Control"), F("max-age=0, no-cache, must-revalidate"));
 	res.writeHeader(F("Connection"), F("close"));
+	return true;
 }
 #else
 void print_header(bool isJson=true)  {
@@ -415,9 +570,8 @@ void server_json_board_attrib(const char* name, unsigned char *attrib)
 {
 	bfill.emit_p(PSTR("\"$F\":["), name);
 	for(unsigned char i=0;i<os.nboards;i++) {
-		bfill.emit_p(PSTR("$D"), attrib[i]);
-		if(i!=os.nboards-1)
-			bfill.emit_p(PSTR(","));
+		if(i) bfill.emit_char(',');
+		bfill.emit_uint(attrib[i]);
 	}
 	bfill.emit_p(PSTR("],"));
 }
@@ -427,10 +581,8 @@ void server_json_stations_attrib(const char* name, unsigned char *attrib)
 	bfill.emit_p(PSTR("\"$F\":["), name);
 	for(unsigned char bid=0;bid<os.nboards;bid++) {
 		for (unsigned char s = 0; s < 8; s++) {
-			bfill.emit_p(PSTR("$D"), attrib[bid * 8 + s]);
-			if(bid != os.nboards-1 || s < 7) {
-				bfill.emit_p(PSTR(","));
-			}
+			if(bid || s) bfill.emit_char(',');
+			bfill.emit_uint(attrib[bid * 8 + s]);
 		}
 	}
 	bfill.emit_p(PSTR("],"));
@@ -464,8 +616,10 @@ void server_json_stations_main(OTF_PARAMS_DEF) {
 void server_json_stations(OTF_PARAMS_DEF) {
 #if defined(USE_OTF)
 	if(!process_password(OTF_PARAMS)) return;
+	char etag[ETAG_SIZE];
+	if(etag_match(OTF_PARAMS, etag, os.state_versions[STATE_STATIONS], options_version())) return;
 	rewind_ether_buffer();
-	print_header(OTF_PARAMS);
+	print_header(OTF_PARAMS, true, 0, etag);
 #else
 	print_header();
 #endif
@@ -543,6 +697,11 @@ void server_change_stations_attrib(char *p, char header, unsigned char *attrib)
 	}
 }
 
+/** Bring the stations back from the files, after a failed /cs */
+static void reload_stations() {
+	os.attribs_load();
+}
+
 /**Change Station Name and Attributes
  * Command: /cs?pw=xxx&s?=x&m?=x&i?=x&n?=x&d?=x
  *
@@ -562,6 +721,7 @@ void server_change_stations(OTF_PARAMS_DEF) {
 #else
 	char* p = get_buffer;
 #endif
+	FileTransaction txn(reload_stations); // save the changes of this request together
 
 	unsigned char sid;
 	char tbuf2[5] = {'s', 0, 0, 0, 0};
@@ -613,8 +773,7 @@ void server_change_stations(OTF_PARAMS_DEF) {
 				}
 			}
 			// write spe data
-			file_write_block(STATIONS_FILENAME, tmp_buffer,
-				(uint32_t)sid*sizeof(StationData)+offsetof(StationData,type), STATION_SPECIAL_DATA_SIZE+1);
+			os.set_station_special(sid, tmp_buffer);
 
 		} else {
 
@@ -626,6 +785,8 @@ void server_change_stations(OTF_PARAMS_DEF) {
 	server_change_board_attrib(FKV_SOURCE, 'p', os.attrib_spe);
 
 	os.attribs_save();
+	pd.reindex(); // sequential groups may have changed
+	txn.commit();
 	handle_return(HTML_SUCCESS);
 }
 
@@ -703,6 +864,7 @@ void server_change_runonce(OTF_PARAMS_DEF) {
 	// decode url first
 	#if !defined(USE_OTF)
 	if(p) urlDecode(p);
+	KeyValIndex::build(p);
 	#endif
 	// search for the start of t=[
 	char *pv;
@@ -883,6 +1045,7 @@ void server_change_program(OTF_PARAMS_DEF) {
 #else
 	char *p = get_buffer;
 #endif
+	FileTransaction txn; // save the changes of this request together
 
 	unsigned char i;
 
@@ -898,6 +1061,7 @@ void server_change_program(OTF_PARAMS_DEF) {
 	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("en"), true)) {
 		if(pid<0) handle_return(HTML_DATA_OUTOFBOUND);
 		pd.set_flagbit(pid, PROGRAMSTRUCT_EN_BIT, (tmp_buffer[0]=='0')?0:1);
+		txn.commit();
 		handle_return(HTML_SUCCESS);
 	}
 
@@ -905,6 +1069,7 @@ void server_change_program(OTF_PARAMS_DEF) {
 	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("uwt"), true)) {
 		if(pid<0) handle_return(HTML_DATA_OUTOFBOUND);
 		pd.set_flagbit(pid, PROGRAMSTRUCT_UWT_BIT, (tmp_buffer[0]=='0')?0:1);
+		txn.commit();
 		handle_return(HTML_SUCCESS);
 	}
 
@@ -937,6 +1102,7 @@ void server_change_program(OTF_PARAMS_DEF) {
 
 #if !defined(USE_OTF)
 	if(p) urlDecode(p);
+	KeyValIndex::build(p);
 #endif
 
 
@@ -998,6 +1164,7 @@ void server_change_program(OTF_PARAMS_DEF) {
 	} else {
 		if(!pd.modify(pid, &prog)) handle_return(HTML_DATA_OUTOFBOUND);
 	}
+	txn.commit();
 	handle_return(HTML_SUCCESS);
 }
 
@@ -1085,8 +1252,11 @@ void server_json_options_main() {
 void server_json_options(OTF_PARAMS_DEF) {
 #if defined(USE_OTF)
 	if(!process_password(OTF_PARAMS,true)) return;
+	char etag[ETAG_SIZE];
+	// expansion boards are detected at the time of the request
+	if(etag_match(OTF_PARAMS, etag, options_version(), (uint32_t)os.detect_exp())) return;
 	rewind_ether_buffer();
-	print_header(OTF_PARAMS);
+	print_header(OTF_PARAMS, true, 0, etag);
 #else
 	print_header();
 #endif
@@ -1110,15 +1280,17 @@ void server_json_programs_main(OTF_PARAMS_DEF) {
 		unsigned char bytedata = *(char*)(&prog);
 		bfill.emit_p(PSTR("[$D,$D,$D,["), bytedata, prog.days[0], prog.days[1]);
 		// start times data
-		for (i=0;i<(MAX_NUM_STARTTIMES-1);i++) {
-			bfill.emit_p(PSTR("$D,"), prog.starttimes[i]);
+		for (i=0;i<MAX_NUM_STARTTIMES;i++) {
+			if(i) bfill.emit_char(',');
+			bfill.emit_int(prog.starttimes[i]);
 		}
-		bfill.emit_p(PSTR("$D],["), prog.starttimes[i]);	// this is the last element
+		bfill.emit_p(PSTR("],["));
 		// station water time
-		for (i=0; i<os.nstations-1; i++) {
-			bfill.emit_p(PSTR("$L,"),(unsigned long)prog.durations[i]);
+		for (i=0; i<os.nstations; i++) {
+			if(i) bfill.emit_char(',');
+			bfill.emit_uint(prog.durations[i]);
 		}
-		bfill.emit_p(PSTR("$L],\""),(unsigned long)prog.durations[i]); // this is the last element
+		bfill.emit_p(PSTR("],\""));
 		// program name
 		strncpy(tmp_buffer, prog.name, PROGRAM_NAME_SIZE);
 		tmp_buffer[PROGRAM_NAME_SIZE] = 0;	// make sure the string ends
@@ -1139,8 +1311,11 @@ void server_json_programs_main(OTF_PARAMS_DEF) {
 void server_json_programs(OTF_PARAMS_DEF) {
 #if defined(USE_OTF)
 	if(!process_password(OTF_PARAMS)) return;
+	char etag[ETAG_SIZE];
+	// interval programs show the days until their next run, which changes with the day
+	if(etag_match(OTF_PARAMS, etag, os.state_versions[STATE_PROGRAMS], options_version(), (uint32_t)(os.now_tz()/86400))) return;
 	rewind_ether_buffer();
-	print_header(OTF_PARAMS);
+	print_header(OTF_PARAMS, true, 0, etag);
 #else
 	print_header();
 #endif
@@ -1149,6 +1324,103 @@ void server_json_programs(OTF_PARAMS_DEF) {
 	handle_return(HTML_OK);
 }
 
+#if !defined(ARDUINO)
+/** Events collected from one run of the forecast engine */
+struct ForecastEvents {
+	ForecastEvent *events;
+	size_t n;
+	size_t size;
+	bool truncated; // events were left out, at the cap or out of memory
+};
+
+static void server_json_forecast_collect(const ForecastEvent *e, void *arg) {
+	ForecastEvents *out = (ForecastEvents*)arg;
+	if (out->truncated) return;
+	if (out->n == out->size) {
+		size_t size = out->size ? out->size*2 : 64;
+		if (size > FORECAST_MAX_EVENTS) size = FORECAST_MAX_EVENTS;
+		ForecastEvent *events = (out->n < size) ? (ForecastEvent*)realloc(out->events, size*sizeof(ForecastEvent)) : NULL;
+		if (!events) {
+			out->truncated = true;
+			return;
+		}
+		out->events = events;
+		out->size = size;
+	}
+	out->events[out->n++] = *e;
+}
+
+static void server_json_forecast_array(OTF_PARAMS_DEF, const ForecastEvents *out, unsigned char type) {
+	bool comma = false;
+	for (size_t i = 0; i < out->n; i++) {
+		const ForecastEvent *e = out->events + i;
+		if (e->type != type) continue;
+		if (comma) bfill.emit_p(PSTR(","));
+		else comma = true;
+		switch(e->type) {
+		case FORECAST_EVENT_PROGRAM:
+			bfill.emit_p(PSTR("[$D,$L,$D]"), e->pid, (ulong)e->st, e->wl);
+			break;
+		case FORECAST_EVENT_STATION:
+			bfill.emit_p(PSTR("[$D,$D,$L,$L,$D]"), e->pid, e->sid, (ulong)e->st, (ulong)e->et, e->gid);
+			break;
+		case FORECAST_EVENT_MASTER:
+			bfill.emit_p(PSTR("[$D,$L,$L]"), e->sid, (ulong)e->st, (ulong)e->et);
+			break;
+		}
+		if (available_ether_buffer() <= 0) {
+			send_packet(OTF_PARAMS);
+		}
+	}
+}
+
+/**
+ * Output schedule forecast
+ * Command: /jf?pw=xxx&days=x
+ *
+ * pw:   password
+ * days: number of days to look ahead (1 to FORECAST_MAX_DAYS, default 1)
+ *
+ * progs:    program starts [pid,start,water percentage]
+ * stations: station runs [pid,sid,start,end,group]
+ * masters:  master station on windows [sid,on,off]
+ * truncated: 1 if events were left out, past FORECAST_MAX_EVENTS or when out of memory
+ *
+ * Stations that do not ignore the rain delay are left out while it is in
+ * effect. Like the controller, which turns them off without shifting the
+ * stations after them, the forecast keeps the start times of the stations
+ * that follow.
+ */
+void server_json_forecast(OTF_PARAMS_DEF) {
+	if(!process_password(OTF_PARAMS)) return;
+
+	uint16_t days = 1;
+	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("days"), true)) {
+		int v = atoi(tmp_buffer);
+		if (v < 1 || v > FORECAST_MAX_DAYS) handle_return(HTML_DATA_OUTOFBOUND);
+		days = v;
+	}
+
+	// run the engine once, then output its events by type
+	time_os_t curr_time = os.now_tz();
+	ForecastEvents out = {NULL, 0, 0, false};
+	forecast(curr_time, days, server_json_forecast_collect, &out);
+
+	rewind_ether_buffer();
+	print_header(OTF_PARAMS);
+
+	bfill.emit_p(PSTR("{\"start\":$L,\"end\":$L,\"progs\":["), (ulong)curr_time, (ulong)(curr_time+(time_os_t)days*86400L));
+	server_json_forecast_array(OTF_PARAMS, &out, FORECAST_EVENT_PROGRAM);
+	bfill.emit_p(PSTR("],\"stations\":["));
+	server_json_forecast_array(OTF_PARAMS, &out, FORECAST_EVENT_STATION);
+	bfill.emit_p(PSTR("],\"masters\":["));
+	server_json_forecast_array(OTF_PARAMS, &out, FORECAST_EVENT_MASTER);
+	bfill.emit_p(out.truncated ? PSTR("],\"truncated\":1}") : PSTR("]}"));
+	free(out.events);
+	handle_return(HTML_OK);
+}
+#endif
+
 /** Output script url form */
 void server_view_scripturl(OTF_PARAMS_DEF) {
 	rewind_ether_buffer();
@@ -1172,40 +1444,137 @@ function rst_wsp() {document.getElementById('wsp').value='$S';}</script>)"),
 	handle_return(HTML_OK);
 }
 
+/** Change journal of the controller variables
+ * Each field of /jc is hashed as it is rendered. A field whose hash differs
+ * from the last rendering is stamped with the next sequence number, and
+ * /jc?since=N leaves out the fields not stamped after N. The journal keeps
+ * the last change of each field, so it never runs out; a since value from
+ * before this run, or one not given out yet, gets the full document.
+ */
+enum {
+	JC_DEVT = 0,
+	JC_STATUS,
+	JC_SUN,
+	JC_WEATHER,
+	JC_BOOT,
+	JC_LRUN,
+	JC_PAUSE,
+	JC_NQ,
+	JC_RSSI,
+	JC_OTC,
+	JC_MAC,
+	JC_SOPTS,
+	JC_WTDATA,
+	JC_DNAME,
+	JC_EMAIL,
+	JC_CURR,
+	JC_FLOW,
+	JC_SBITS,
+	JC_GPIO,
+	JC_PS, // one field per station from here
+	JC_NUM_FIELDS = JC_PS+MAX_NUM_STATIONS
+};
+
+#if defined(USE_OTF)
+struct ControllerField {
+	uint32_t hash; // of the field as last rendered
+	uint32_t seq;  // sequence number of its last change
+};
+
+static ControllerField jc_fields[JC_NUM_FIELDS];
+static uint32_t jc_seq = 0;   // sequence number of the last change
+static uint32_t jc_first = 0; // sequence number this run started with
+static uint32_t jc_since = 0; // leave out the fields not changed after this, 0 to output all
+static bool jc_changed = false;
+static unsigned int jc_pos;   // where the field being rendered starts
+static unsigned int jc_value; // where its value starts, after any separator
+
+static void jc_begin() {
+	jc_pos = jc_value = bfill.position();
+}
+
+static void jc_value_begin() {
+	jc_value = bfill.position();
+}
+
+/** Stamp the field just rendered if it has changed, and drop it if the client has it.
+ * Returns true if the field is kept */
+static bool jc_end(uint16_t field) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for(const char *p = ether_buffer+jc_value; p < ether_buffer+bfill.position(); p++) h = (h ^ (unsigned char)*p) * 16777619u;
+	ControllerField &f = jc_fields[field];
+	if(f.hash != h || !f.seq) {
+		f.hash = h;
+		f.seq = jc_seq+1;
+		jc_changed = true;
+	}
+	if(jc_since && f.seq <= jc_since) {
+		bfill.rewind(jc_pos);
+		return false;
+	}
+	return true;
+}
+#else
+static const uint32_t jc_since = 0; // no deltas, the whole document is always sent
+static void jc_begin() {}
+static void jc_value_begin() {}
+static bool jc_end(uint16_t) { return true; }
+#endif
+
 void server_json_controller_main(OTF_PARAMS_DEF) {
 	unsigned char bid, sid;
 	time_os_t curr_time = os.now_tz();
-	bfill.emit_p(PSTR("\"devt\":$L,\"nbrd\":$D,\"en\":$D,\"sn1\":$D,\"sn2\":$D,\"rd\":$D,\"rdst\":$L,"
-										"\"sunrise\":$D,\"sunset\":$D,\"eip\":$L,\"lwc\":$L,\"lswc\":$L,"
-										"\"lupt\":$L,\"lrbtc\":$D,\"lrun\":[$D,$D,$D,$L],\"pq\":$D,\"pt\":$L,\"nq\":$D,"),
-							curr_time,
+#if defined(USE_OTF)
+	if(!jc_seq) jc_seq = jc_first = (uint32_t)curr_time; // tell runs apart
+#endif
+	jc_begin();
+	bfill.emit_p(PSTR("\"devt\":$L,"), curr_time);
+	jc_end(JC_DEVT);
+	jc_begin();
+	bfill.emit_p(PSTR("\"nbrd\":$D,\"en\":$D,\"sn1\":$D,\"sn2\":$D,\"rd\":$D,\"rdst\":$L,"),
 							os.nboards,
 							os.status.enabled,
 							os.status.sensor1_active,
 							os.status.sensor2_active,
 							os.status.rain_delayed,
-							os.nvdata.rd_stop_time,
-							os.nvdata.sunrise_time,
-							os.nvdata.sunset_time,
+							os.nvdata.rd_stop_time);
+	jc_end(JC_STATUS);
+	jc_begin();
+	bfill.emit_p(PSTR("\"sunrise\":$D,\"sunset\":$D,"), os.nvdata.sunrise_time, os.nvdata.sunset_time);
+	jc_end(JC_SUN);
+	jc_begin();
+	bfill.emit_p(PSTR("\"eip\":$L,\"lwc\":$L,\"lswc\":$L,"),
 							os.nvdata.external_ip,
 							os.checkwt_lasttime,
-							os.checkwt_success_lasttime,
-							os.powerup_lasttime,
-							os.last_reboot_cause,
+							os.checkwt_success_lasttime);
+	jc_end(JC_WEATHER);
+	jc_begin();
+	bfill.emit_p(PSTR("\"lupt\":$L,\"lrbtc\":$D,"), os.powerup_lasttime, os.last_reboot_cause);
+	jc_end(JC_BOOT);
+	jc_begin();
+	bfill.emit_p(PSTR("\"lrun\":[$D,$D,$D,$L],"),
 							pd.lastrun.station,
 							pd.lastrun.program,
 							pd.lastrun.duration,
-							pd.lastrun.endtime,
-							os.status.pause_state,
-							os.pause_timer,
-							pd.nqueue);
+							pd.lastrun.endtime);
+	jc_end(JC_LRUN);
+	jc_begin();
+	bfill.emit_p(PSTR("\"pq\":$D,\"pt\":$L,"), os.status.pause_state, os.pause_timer);
+	jc_end(JC_PAUSE);
+	jc_begin();
+	bfill.emit_p(PSTR("\"nq\":$D,"), pd.nqueue);
+	jc_end(JC_NQ);
 
 #if defined(ESP8266)
+	jc_begin();
 	bfill.emit_p(PSTR("\"RSSI\":$D,"), (int16_t)WiFi.RSSI());
+	jc_end(JC_RSSI);
 #endif
 
 #if defined(USE_OTF)
+	jc_begin();
 	bfill.emit_p(PSTR("\"otc\":{$O},\"otcs\":$D,"), SOPT_OTC_OPTS, otf->getCloudStatus());
+	jc_end(JC_OTC);
 #endif
 
 	unsigned char mac[6] = {0};
@@ -1215,40 +1584,57 @@ void server_json_controller_main(OTF_PARAMS_DEF) {
 	os.load_hardware_mac(mac, true);
 #endif
 
+	jc_begin();
 	bfill.emit_p(PSTR("\"mac\":\"$X:$X:$X:$X:$X:$X\","), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	jc_end(JC_MAC);
 
-	bfill.emit_p(PSTR("\"loc\":\"$O\",\"jsp\":\"$O\",\"wsp\":\"$O\",\"wto\":{$O},\"ifkey\":\"$O\",\"mqtt\":{$O},\"wtdata\":$S,\"wterr\":$D,\"dname\":\"$O\","),
+	jc_begin();
+	bfill.emit_p(PSTR("\"loc\":\"$O\",\"jsp\":\"$O\",\"wsp\":\"$O\",\"wto\":{$O},\"ifkey\":\"$O\",\"mqtt\":{$O},"),
 							 SOPT_LOCATION,
 							 SOPT_JAVASCRIPTURL,
 							 SOPT_WEATHERURL,
 							 SOPT_WEATHER_OPTS,
 							 SOPT_IFTTT_KEY,
-							 SOPT_MQTT_OPTS,
-							 strlen(wt_rawData)==0?"{}":wt_rawData,
-							 wt_errCode,
-							 SOPT_DEVICE_NAME);
+							 SOPT_MQTT_OPTS);
+	jc_end(JC_SOPTS);
+	jc_begin();
+	bfill.emit_p(PSTR("\"wtdata\":$S,\"wterr\":$D,"), strlen(wt_rawData)==0?"{}":wt_rawData, wt_errCode);
+	jc_end(JC_WTDATA);
+	jc_begin();
+	bfill.emit_p(PSTR("\"dname\":\"$O\","), SOPT_DEVICE_NAME);
+	jc_end(JC_DNAME);
 
 #if defined(SUPPORT_EMAIL)
+	jc_begin();
 	bfill.emit_p(PSTR("\"email\":{$O},"), SOPT_EMAIL_OPTS);
+	jc_end(JC_EMAIL);
 #endif
 
 #if defined(ARDUINO)
 	if(os.status.has_curr_sense) {
 		uint16_t current = os.read_current();
 		if((!os.status.program_busy) && (current<os.baseline_current)) current=0;
+		jc_begin();
 		bfill.emit_p(PSTR("\"curr\":$D,"), current);
+		jc_end(JC_CURR);
 	}
 #endif
 	if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
-		bfill.emit_p(PSTR("\"flcrt\":$L,\"flwrt\":$D,"), os.flowcount_rt, FLOWCOUNT_RT_WINDOW);
+		jc_begin();
+		bfill.emit_p(PSTR("\"flcrt\":$L,\"flwrt\":$D,"), get_flowcount_rt(), FLOWCOUNT_RT_WINDOW);
+		jc_end(JC_FLOW);
 	}
 
+	jc_begin();
 	bfill.emit_p(PSTR("\"sbits\":["));
 	// print sbits
 	for(bid=0;bid<os.nboards;bid++)
 		bfill.emit_p(PSTR("$D,"), os.station_bits[bid]);
-	bfill.emit_p(PSTR("0],\"ps\":["));
-	// print ps
+	bfill.emit_p(PSTR("0],"));
+	jc_end(JC_SBITS);
+	// print ps, an object of the changed stations if this is a delta
+	bfill.emit_p(jc_since ? PSTR("\"ps\":{") : PSTR("\"ps\":["));
+	bool comma = false;
 	for(sid=0;sid<os.nstations;sid++) {
 		// if available ether buffer is getting small
 		// send out a packet
@@ -1262,13 +1648,19 @@ void server_json_controller_main(OTF_PARAMS_DEF) {
 			rem = (curr_time >= q->st) ? (q->st+q->dur-curr_time) : q->dur;
 			if(rem>65535) rem = 0;
 		}
+		jc_begin();
+		if(comma) bfill.emit_p(PSTR(","));
+		if(jc_since) bfill.emit_p(PSTR("\"$D\":"), sid);
+		jc_value_begin();
 		bfill.emit_p(PSTR("[$D,$L,$L,$D]"),
 		(qid<255)?q->pid:0, rem, (qid<255)?q->st:0, os.attrib_grp[sid]);
-		bfill.emit_p((sid<os.nstations-1)?PSTR(","):PSTR("]"));
+		if(jc_end(JC_PS+sid)) comma = true;
 	}
+	bfill.emit_p(jc_since ? PSTR("},") : PSTR("],"));
 
 	unsigned char gpioList[] = PIN_FREE_LIST;
-	bfill.emit_p(PSTR(",\"gpio\":["));
+	jc_begin();
+	bfill.emit_p(PSTR("\"gpio\":["));
 	for (unsigned char i = 0; i < sizeof(gpioList); ++i)
 	{
 		if(i != sizeof(gpioList) - 1) {
@@ -1277,23 +1669,50 @@ void server_json_controller_main(OTF_PARAMS_DEF) {
 			bfill.emit_p(PSTR("$D"), gpioList[i]);
 		}
 	}
-	bfill.emit_p(PSTR("]"));
+	bfill.emit_p(PSTR("],"));
+	jc_end(JC_GPIO);
 
+#if defined(USE_OTF)
+	if(jc_changed) {
+		jc_seq++;
+		jc_changed = false;
+	}
+	bfill.emit_p(jc_since ? PSTR("\"seq\":$L,\"delta\":1}") : PSTR("\"seq\":$L}"), jc_seq);
+#else
+	bfill.rewind(bfill.position()-1); // drop the last comma
 	bfill.emit_p(PSTR("}"));
+#endif
 }
 
-/** Output controller variables in json */
+/**
+ * Output controller variables in json
+ * Command: /jc?pw=xxx&since=x
+ *
+ * pw:    password
+ * since: only output the variables changed after this sequence number (optional)
+ *
+ * seq:   sequence number of the last change, to pass as since next time
+ * delta: 1 if only the changed variables are included, ps is then an object of the changed stations
+ */
 void server_json_controller(OTF_PARAMS_DEF) {
 #if defined(USE_OTF)
 	if(!process_password(OTF_PARAMS)) return;
 	rewind_ether_buffer();
 	print_header(OTF_PARAMS);
+	jc_since = 0;
+	if(findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("since"), true)) {
+		uint32_t since = strtoul(tmp_buffer, NULL, 10);
+		if(since >= jc_first && since <= jc_seq) jc_since = since;
+	}
 #else
 	print_header();
 #endif
 
 	bfill.emit_p(PSTR("{"));
 	server_json_controller_main(OTF_PARAMS);
+#if defined(USE_OTF)
+	jc_since = 0;
+#endif
 	handle_return(HTML_OK);
 }
 
@@ -1450,6 +1869,14 @@ void server_change_scripturl(OTF_PARAMS_DEF) {
 #endif
 }
 
+/** Bring the options back from the files, after a failed /co */
+static void reload_options() {
+#if !defined(ARDUINO)
+	os.sopts_load(); // iopts_load reads the weather options
+#endif
+	os.iopts_load();
+}
+
 /**
  * Change options
  * Command: /co?pw=xxx&o?=x&loc=x&ttt=x
@@ -1466,6 +1893,7 @@ void server_change_options(OTF_PARAMS_DEF)
 #else
 	char *p = get_buffer;
 #endif
+	FileTransaction txn(reload_options); // save the changes of this request together
 
 	// temporarily save some old options values
 	bool time_change = false;
@@ -1615,6 +2043,7 @@ void server_change_options(OTF_PARAMS_DEF)
 
 	if(time_change) {
 		os.status.req_ntpsync = 1;
+		pd.sched_invalidate(); // start times need to be recomputed
 	}
 
 	if(weather_change) {
@@ -1628,6 +2057,7 @@ void server_change_options(OTF_PARAMS_DEF)
 		os.sensor_resetall();
 	}
 
+	txn.commit();
 	handle_return(HTML_SUCCESS);
 }
 
@@ -1679,8 +2109,10 @@ void server_json_status(OTF_PARAMS_DEF)
 {
 #if defined(USE_OTF)
 	if(!process_password(OTF_PARAMS)) return;
+	char etag[ETAG_SIZE];
+	if(etag_match(OTF_PARAMS, etag, os.state_versions[STATE_STATUS], options_version())) return;
 	rewind_ether_buffer();
-	print_header(OTF_PARAMS);
+	print_header(OTF_PARAMS, true, 0, etag);
 #else
 	print_header();
 #endif
@@ -1763,9 +2195,11 @@ void server_change_manual(OTF_PARAMS_DEF) {
 			ssta = atoi(tmp_buffer);
 		}
 		// mark station for removal
-		RuntimeQueueStruct *q = pd.queue + pd.station_qid[sid];
-		q->deque_time = curr_time;
-		turn_off_station(sid, curr_time, ssta);
+		if (pd.station_qid[sid] != 0xFF) {
+			RuntimeQueueStruct *q = pd.queue + pd.station_qid[sid];
+			q->deque_time = curr_time;
+			turn_off_station(sid, curr_time, ssta);
+		}
 	}
 	handle_return(HTML_SUCCESS);
 }
@@ -1787,7 +2221,7 @@ int file_fgets(File file, char* buf, int maxsize) {
 
 /**
  * Get log data
- * Command: /jl?start=x&end=x&hist=x&type=x
+ * Command: /jl?start=x&end=x&hist=x&type=x&limit=x&cursor=x
  *
  * hist:  history (past n days)
  *        when hist is speceified, the start
@@ -1797,6 +2231,10 @@ int file_fgets(File file, char* buf, int maxsize) {
  * type:  type of log records (optional)
  *        rs, rd, wl
  *        if unspecified, output all records
+ * limit: most records to return (optional, Linux)
+ *        the records then come as {"records":[...],"cursor":c}
+ *        where c is null on the last page
+ * cursor: cursor of the page to return (optional, Linux)
  */
 void server_json_log(OTF_PARAMS_DEF) {
 
@@ -1807,6 +2245,7 @@ void server_json_log(OTF_PARAMS_DEF) {
 #endif
 
 	unsigned int start, end;
+	ulong start_time, end_time;
 
 	// past n day history
 	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("hist"), true)) {
@@ -1814,16 +2253,20 @@ void server_json_log(OTF_PARAMS_DEF) {
 		if (hist< 0 || hist > 365) handle_return(HTML_DATA_OUTOFBOUND);
 		end = os.now_tz() / 86400L;
 		start = end - hist;
+		start_time = start * 86400L;
+		end_time = end * 86400L + 86399L;
 	}
 	else
 	{
 		if (!findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true)) handle_return(HTML_DATA_MISSING);
 
-		start = strtoul(tmp_buffer, NULL, 0) / 86400L;
+		start_time = strtoul(tmp_buffer, NULL, 0);
+		start = start_time / 86400L;
 
 		if (!findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true)) handle_return(HTML_DATA_MISSING);
 
-		end = strtoul(tmp_buffer, NULL, 0) / 86400L;
+		end_time = strtoul(tmp_buffer, NULL, 0);
+		end = end_time / 86400L;
 
 		// start must be prior to end, and can't retrieve more than 365 days of data
 		if ((start>end) || (end-start)>365)  handle_return(HTML_DATA_OUTOFBOUND);
@@ -1835,6 +2278,23 @@ void server_json_log(OTF_PARAMS_DEF) {
 	if (findKeyVal(FKV_SOURCE, type, 4, PSTR("type"), true))
 		type_specified = true;
 
+#if !defined(ARDUINO)
+	// with a limit, records come in pages: the cursor of the next page is
+	// the time of its first record, and how many records of that time to skip
+	ulong limit = 0, skip = 0;
+	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("limit"), true)) {
+		limit = strtoul(tmp_buffer, NULL, 10);
+	}
+	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("cursor"), true)) {
+		char *p;
+		ulong t = strtoul(tmp_buffer, &p, 10);
+		if (*p == '.') skip = strtoul(p+1, NULL, 10);
+		if (t < start_time || t > end_time) handle_return(HTML_DATA_OUTOFBOUND);
+		start_time = t;
+		start = t / 86400L;
+	}
+#endif
+
 #if defined(USE_OTF)
 	// as the log data can be large, we will use ESP8266's sendContent function to
 	// send multiple packets of data, instead of the standard way of using send().
@@ -1844,24 +2304,25 @@ void server_json_log(OTF_PARAMS_DEF) {
 	print_header();
 #endif
 
+#if !defined(ARDUINO)
+	if (limit) bfill.emit_p(PSTR("{\"records\":"));
+#endif
 	bfill.emit_p(PSTR("["));
 
 	bool comma = 0;
+#if defined(ARDUINO)
 	for(unsigned int i=start;i<=end;i++) {
 		snprintf(tmp_buffer, TMP_BUFFER_SIZE*2 , "%d", i);
 		make_logfile_name(tmp_buffer);
 
-#if defined(ESP8266)
+	#if defined(ESP8266)
 		File file = LittleFS.open(tmp_buffer, "r");
 		if(!file) continue;
-#elif defined(ARDUINO)
+	#else
 		if (!sd.exists(tmp_buffer)) continue;
 		SdFile file;
 		file.open(tmp_buffer, O_READ);
-#else // prepare to open log file for Linux
-		FILE *file = fopen(get_filename_fullpath(tmp_buffer), "rb");
-		if(!file) continue;
-#endif // prepare to open log file
+	#endif
 		int result;
 		while(true) {
 		#if defined(ESP8266)
@@ -1872,22 +2333,12 @@ void server_json_log(OTF_PARAMS_DEF) {
 				break;
 			}
 			tmp_buffer[result]=0;
-		#elif defined(ARDUINO)
+		#else
 			result = file.fgets(tmp_buffer, TMP_BUFFER_SIZE);
 			if (result <= 0) {
 				file.close();
 				break;
 			}
-		#else
-			if(fgets(tmp_buffer, TMP_BUFFER_SIZE, file)) {
-				result = strlen(tmp_buffer);
-			} else {
-				result = 0;
-			}
-			if (result <= 0) {
-				fclose(file);
-				break;
-			}
 		#endif
 			// check record type
 			// records are all in the form of [x,"xx",...]
@@ -1917,6 +2368,51 @@ void server_json_log(OTF_PARAMS_DEF) {
 			}
 		}
 	}
+#else
+	LogWriter::flush(); // include the records that are still pending
+
+	// if type is not specified, output everything except "wl" and "fl" records
+	uint32_t types = type_specified ? log_type_mask(type) : ~((1UL<<LOGDATA_WATERLEVEL)|(1UL<<LOGDATA_FLOWSENSE));
+	LogReader reader;
+	LogRecord rec;
+	ulong count = 0, last_time = start_time, same_time = skip;
+	bool more = false;
+	// each day is read from the first record at or after start_time, up to end_time
+	for(unsigned int i=start;i<=end && !more;i++) {
+		time_os_t day_start = (time_os_t)i*86400;
+		if(!reader.open(i, types, day_start > (time_os_t)start_time ? day_start : (time_os_t)start_time,
+				day_start+86399 < (time_os_t)end_time ? day_start+86399 : (time_os_t)end_time)) continue;
+		while(reader.read(tmp_buffer, &rec)) {
+			if (skip && rec.time == start_time) {
+				skip--;
+				continue;
+			}
+			if (limit && count == limit) {
+				more = true;
+				break;
+			}
+			// if this is the first record, do not print comma
+			if (comma)	bfill.emit_p(PSTR(","));
+			else {comma=1;}
+			bfill.emit_p(PSTR("$S"), tmp_buffer);
+			count++;
+			if (rec.time == last_time) same_time++;
+			else {last_time = rec.time; same_time = 1;}
+			// if the available ether buffer size is getting small
+			// push out a packet
+			if (available_ether_buffer() <= 0) {
+				send_packet(OTF_PARAMS);
+			}
+		}
+	}
+	reader.close();
+	if (limit) {
+		bfill.emit_p(PSTR("],\"cursor\":"));
+		if (more) bfill.emit_p(PSTR("\"$L.$L\"}"), (ulong)rec.time, rec.time == last_time ? same_time : 0UL);
+		else bfill.emit_p(PSTR("null}"));
+		handle_return(HTML_OK);
+	}
+#endif
 
 	bfill.emit_p(PSTR("]"));
 	handle_return(HTML_OK);
@@ -2066,6 +2562,28 @@ void server_json_debug(OTF_PARAMS_DEF) {
 */
 #else
 	(unsigned long)freeHeap());
+#if defined(OSPI)
+	// kernel calls made for each gpio pin: [pin, requests, reads, writes]
+	bfill.emit_p(PSTR(",\"gpio\":["));
+	bool first = true;
+	for(int pin=0; pin<GPIO_MAX; pin++) {
+		const GPIOCounters *c = gpio_get_counters(pin);
+		if(!c) continue;
+		if(!first) bfill.emit_p(PSTR(","));
+		bfill.emit_p(PSTR("[$D,$L,$L,$L]"), pin, c->requests, c->reads, c->writes);
+		first = false;
+	}
+	bfill.emit_p(PSTR("]"));
+#endif
+#if !defined(ARDUINO)
+	// log folder usage: days, bytes, oldest day, days evicted to stay within the limits
+	ulong log_days, log_bytes, log_oldest;
+	LogCatalog::usage(&log_days, &log_bytes, &log_oldest);
+	bfill.emit_p(PSTR(",\"logs\":{\"days\":$L,\"bytes\":$L,\"oldest\":$L,\"evicted\":$L}"),
+		log_days, log_bytes, log_oldest, LogCatalog::evicted);
+	// events the I/O worker could not take because its ring was full
+	bfill.emit_p(PSTR(",\"iofull\":$L"), IOWorker::overflows);
+#endif
 	bfill.emit_p(PSTR("}"));
 #endif
 	handle_return(HTML_OK);
@@ -2125,6 +2643,9 @@ const char _url_keys[] PROGMEM =
 	"ja"
 	"pq"
 	"db"
+#if !defined(ARDUINO)
+	"jf"
+#endif
 #if defined(ARDUINO)
 	//"ff"
 #endif
@@ -2155,6 +2676,9 @@ URLHandler urls[] = {
 	server_json_all,        // ja
 	server_pause_queue,     // pq
 	server_json_debug,      // db
+#if !defined(ARDUINO)
+	server_json_forecast,   // jf
+#endif
 #if defined(ARDUINO)
 	//server_fill_files,
 #endif
@@ -2287,6 +2811,275 @@ void start_server_ap() {
 
 #endif
 
+#if !defined(ARDUINO)
+#define ROLLUP_GROUP_STATION 0
+#define ROLLUP_GROUP_PROGRAM 1
+#define ROLLUP_GROUP_DAY     2
+#define ROLLUP_GROUP_WEEK    3
+
+static const char rollup_group_names[] PROGMEM =
+	"station\0"
+	"program\0"
+	"day\0\0\0\0\0"
+	"week\0\0\0\0";
+
+static void server_json_log_rollup_row(OTF_PARAMS_DEF, ulong key, const LogRollupEntry *e, bool *comma) {
+	if (!e->count) return;
+	char volume[16];
+	snprintf(volume, sizeof(volume), "%.2f", e->volume);
+	if (*comma) bfill.emit_p(PSTR(","));
+	else *comma = true;
+	bfill.emit_p(PSTR("{\"key\":$L,\"count\":$L,\"total\":$L,\"min\":$L,\"max\":$L,\"avg\":$L,\"volume\":$S}"),
+		key, (ulong)e->count, (ulong)e->total, (ulong)e->min, (ulong)e->max, (ulong)(e->total/e->count), volume);
+	if (available_ether_buffer() <= 0) {
+		send_packet(OTF_PARAMS);
+	}
+}
+
+/**
+ * Log rollups
+ * Totals of the station runs, by station (default), program, day or week,
+ * or of the records of an event type, by day or week. They are taken from
+ * the rollup kept next to the logs of each day, not from the records
+ * Command: /jla?pw=xxx&start=xxx&end=xxx&group=xxx&type=xxx
+ * or /jla?pw=xxx&hist=n&group=xxx&type=xxx
+ *
+ * pw:    password
+ * start: start time (epoch time)
+ * end:   end time (epoch time)
+ * hist:  past n days
+ * group: station, program, day or week (starting on Monday)
+ * type:  event type (e.g. rd, s1, fl), station runs if not specified
+ */
+void server_json_log_rollup(OTF_PARAMS_DEF) {
+	if(!process_password(OTF_PARAMS)) return;
+
+	ulong start, end;
+	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("hist"), true)) {
+		int hist = atoi(tmp_buffer);
+		if (hist < 0 || hist > LOG_ROLLUP_MAX_DAYS) handle_return(HTML_DATA_OUTOFBOUND);
+		end = os.now_tz() / 86400L;
+		start = end - hist;
+	} else {
+		if (!findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true)) handle_return(HTML_DATA_MISSING);
+		start = strtoul(tmp_buffer, NULL, 0) / 86400L;
+		if (!findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true)) handle_return(HTML_DATA_MISSING);
+		end = strtoul(tmp_buffer, NULL, 0) / 86400L;
+		if ((start>end) || (end-start)>LOG_ROLLUP_MAX_DAYS) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+
+	unsigned char group = ROLLUP_GROUP_STATION;
+	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("group"), true)) {
+		for (group = 0; group <= ROLLUP_GROUP_WEEK; group++) {
+			if (!strcmp(tmp_buffer, rollup_group_names+group*8)) break;
+		}
+		if (group > ROLLUP_GROUP_WEEK) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+
+	int type = LOGDATA_STATION;
+	char name[4] = {0};
+	if (findKeyVal(FKV_SOURCE, name, 4, PSTR("type"), true)) {
+		type = log_type_of(name);
+		if (type < 0) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+	// only station runs have a station and a program
+	if (type != LOGDATA_STATION && group <= ROLLUP_GROUP_PROGRAM) handle_return(HTML_DATA_OUTOFBOUND);
+
+	LogWriter::flush(); // include the records that are still pending
+
+	rewind_ether_buffer();
+	print_header(OTF_PARAMS);
+	bfill.emit_p(PSTR("{\"start\":$L,\"end\":$L,\"group\":\"$S\",\"rows\":["), start, end, rollup_group_names+group*8);
+
+	static LogRollup rollup;
+	static LogRollupEntry totals[LOG_ROLLUP_PROGRAMS];
+	LogRollupEntry week;
+	ulong week_start = 0;
+	bool comma = false;
+	memset(totals, 0, sizeof(totals));
+	memset(&week, 0, sizeof(week));
+	for (ulong day = start; day <= end; day++) {
+		if (!log_rollup_load(day, &rollup)) continue;
+		unsigned int i;
+		switch (group) {
+		case ROLLUP_GROUP_STATION:
+			for (i = 0; i < MAX_NUM_STATIONS; i++) log_rollup_merge(totals+i, rollup.stations+i);
+			break;
+		case ROLLUP_GROUP_PROGRAM:
+			for (i = 0; i < LOG_ROLLUP_PROGRAMS; i++) log_rollup_merge(totals+i, rollup.programs+i);
+			break;
+		case ROLLUP_GROUP_DAY:
+			server_json_log_rollup_row(OTF_PARAMS, day, rollup.types+type, &comma);
+			break;
+		case ROLLUP_GROUP_WEEK:
+			if (week.count && day-(day+3)%7 != week_start) {
+				server_json_log_rollup_row(OTF_PARAMS, week_start, &week, &comma);
+				memset(&week, 0, sizeof(week));
+			}
+			week_start = day-(day+3)%7; // epoch day 0 is a Thursday
+			log_rollup_merge(&week, rollup.types+type);
+			break;
+		}
+	}
+	if (group == ROLLUP_GROUP_WEEK) {
+		server_json_log_rollup_row(OTF_PARAMS, week_start, &week, &comma);
+	} else if (group <= ROLLUP_GROUP_PROGRAM) {
+		unsigned int n = (group == ROLLUP_GROUP_STATION) ? MAX_NUM_STATIONS : LOG_ROLLUP_PROGRAMS;
+		for (unsigned int i = 0; i < n; i++) server_json_log_rollup_row(OTF_PARAMS, i, totals+i, &comma);
+	}
+
+	bfill.emit_p(PSTR("]}"));
+	handle_return(HTML_OK);
+}
+
+#define EXPORT_CHUNK_SIZE 4096 // most bytes of records compressed or sent at a time
+
+/** Body of a streamed response, sent in chunks (chunked transfer encoding),
+ * and compressed with gzip if asked for. Records are collected in a buffer
+ * of a fixed size, so the memory used does not depend on the number of days */
+class ExportStream {
+public:
+	ExportStream(OTF::Response &res, bool gzip);
+	~ExportStream();
+	char *tail() { return in + len; } // where the next line goes, room for two LOG_LINE_MAX lines
+	void put(int n);
+	void finish();
+private:
+	OTF::Response &res;
+	bool gzip;
+	z_stream zs;
+	size_t len;
+	char in[EXPORT_CHUNK_SIZE];
+	char out[EXPORT_CHUNK_SIZE];
+	void flush(bool last);
+	void send(const char *data, size_t n);
+};
+
+ExportStream::ExportStream(OTF::Response &res, bool gzip) : res(res), gzip(gzip), len(0) {
+	if (gzip) {
+		memset(&zs, 0, sizeof(zs));
+		// 16 added to the window bits for a gzip header and trailer
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) this->gzip = false;
+	}
+}
+
+ExportStream::~ExportStream() {
+	if (gzip) deflateEnd(&zs);
+}
+
+void ExportStream::put(int n) {
+	len += n;
+	if (len + 2*LOG_LINE_MAX > EXPORT_CHUNK_SIZE) flush(false);
+}
+
+void ExportStream::send(const char *data, size_t n) {
+	char size[12];
+	res.writeBodyData(size, snprintf(size, sizeof(size), "%x\r\n", (unsigned int)n));
+	if (n) res.writeBodyData(data, n);
+	res.writeBodyData("\r\n", 2);
+}
+
+void ExportStream::flush(bool last) {
+	if (!gzip) {
+		if (len) send(in, len);
+	} else {
+		zs.next_in = (Bytef*)in;
+		zs.avail_in = len;
+		int rc;
+		do {
+			zs.next_out = (Bytef*)out;
+			zs.avail_out = sizeof(out);
+			rc = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+			if (zs.avail_out < sizeof(out)) send(out, sizeof(out)-zs.avail_out);
+		} while (zs.avail_out == 0 || (last && rc == Z_OK));
+	}
+	len = 0;
+}
+
+/** Send what is left, and the last (empty) chunk */
+void ExportStream::finish() {
+	flush(true);
+	send(NULL, 0);
+}
+
+/**
+ * Log export
+ * Streams the records of up to a year of days, one record per line
+ * Command: /jlx?pw=xxx&start=xxx&end=xxx&fmt=xxx&type=xxx&gzip=1
+ *
+ * pw:    password
+ * start: start time (epoch time)
+ * end:   end time (epoch time), at most 365 days after start as with /jl
+ * fmt:   ndjson (default), each record as in /jl
+ *        or csv: time,type,program,station,value,value2,gpm
+ *        (type is empty for station runs)
+ * type:  type of log records (optional), all records if unspecified
+ * gzip:  compress the response with gzip (optional)
+ */
+void server_json_log_export(OTF_PARAMS_DEF) {
+	if(!process_password(OTF_PARAMS)) return;
+
+	if (!findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true)) handle_return(HTML_DATA_MISSING);
+	ulong start_time = strtoul(tmp_buffer, NULL, 0);
+	if (!findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true)) handle_return(HTML_DATA_MISSING);
+	ulong end_time = strtoul(tmp_buffer, NULL, 0);
+	// the response is sent before the handler returns, so the range is capped to bound the time it takes
+	if (start_time > end_time || end_time/86400 - start_time/86400 > 365) handle_return(HTML_DATA_OUTOFBOUND);
+
+	bool csv = false;
+	if (findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("fmt"), true)) {
+		if (!strcmp(tmp_buffer, "csv")) csv = true;
+		else if (strcmp(tmp_buffer, "ndjson")) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+	uint32_t types = 0xFFFFFFFF;
+	char type[4] = {0};
+	if (findKeyVal(FKV_SOURCE, type, 4, PSTR("type"), true)) types = log_type_mask(type);
+	bool gzip = findKeyVal(FKV_SOURCE, tmp_buffer, TMP_BUFFER_SIZE, PSTR("gzip"), true) && tmp_buffer[0] == '1';
+
+	LogWriter::flush(); // include the records that are still pending
+
+	res.writeStatus(200, F("OK"));
+	res.writeHeader(F("Content-Type"), csv ? F("text/csv") : F("application/x-ndjson"));
+	res.writeHeader(F("Transfer-Encoding"), F("chunked"));
+	if (gzip) res.writeHeader(F("Content-Encoding"), F("gzip"));
+	res.writeHeader(F("Access-Control-Allow-Origin"), F("*"));
+	res.writeHeader(F("Cache-Control"), F("max-age=0, no-cache, no-store, must-revalidate"));
+	res.writeHeader(F("Connection"), F("close"));
+
+	ExportStream stream(res, gzip);
+	if (csv) stream.put(sprintf(stream.tail(), "time,type,program,station,value,value2,gpm\n"));
+
+	LogReader reader;
+	LogRecord rec;
+	// days without logs are skipped without opening any file
+	for (ulong day = start_time/86400; day <= end_time/86400 && LogCatalog::next(&day); day++) {
+		time_os_t day_start = (time_os_t)day*86400;
+		if (!reader.open(day, types, day_start > (time_os_t)start_time ? day_start : (time_os_t)start_time,
+				day_start+86399 < (time_os_t)end_time ? day_start+86399 : (time_os_t)end_time)) continue;
+		int n;
+		char *p;
+		while ((n = reader.read(p = stream.tail(), &rec)) > 0) {
+			if (!csv) {
+				p[n-2] = '\n'; // lines end with a newline only
+				stream.put(n-1);
+				continue;
+			}
+			if (rec.type == LOGDATA_STATION) {
+				n = sprintf(p, "%lu,,%u,%u,%lu,,", (ulong)rec.time, rec.pid, rec.sid, (ulong)rec.value);
+			} else {
+				n = sprintf(p, "%lu,%.2s,,,%lu,%lu,", (ulong)rec.time, rec.type < LOG_TYPES ? log_type_names+rec.type*3 : "",
+					(ulong)rec.value, (ulong)rec.value2);
+			}
+			if (rec.flags & LOG_RECORD_GPM) n += sprintf(p+n, "%.2f", rec.gpm);
+			p[n++] = '\n';
+			stream.put(n);
+		}
+	}
+	reader.close();
+	stream.finish();
+}
+#endif
+
 #if defined(USE_OTF) && !defined(ARDUINO)
 void initialize_otf() {
 	if(!otf) return;
@@ -2295,6 +3088,8 @@ void initialize_otf() {
 	if(!callback_initialized) {
 		otf->on("/", server_home);  // handle home page
 		otf->on("/index.html", server_home);
+		otf->on("/jla", server_json_log_rollup); // longer than the two-letter keys below
+		otf->on("/jlx", server_json_log_export);
 
 		// set up all other handlers
 		char uri[4];
@@ -2319,6 +3114,7 @@ void handle_web_request(char *p) {
 	// GET /xx?xxxx
 	char *com = p+5;
 	char *dat = com+3;
+	KeyValIndex kv(dat);
 
 	if(com[0]==' ') {
 		server_home();  // home page handler
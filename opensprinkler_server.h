@@ -30,7 +30,35 @@
 #endif
 
 char dec2hexchar(unsigned char dec);
+#if !defined(ARDUINO)
+uint16_t emit_sopt(unsigned char oid, char *buf, uint16_t maxlen); // copy a string option out of the cache
+#endif
 
+/** Indexes a query string for findKeyVal while in scope
+ * Handlers look up many keys in one query string (dozens in /co, hundreds
+ * in /cs), and a scan of the string for each key costs keys x length. With
+ * the string indexed, each lookup is a probe of a hash table instead. A
+ * handler that decodes the string in place has to build the index again.
+ * The index is kept for the string's address, its length and the request
+ * it was built in; a string that does not match all three is scanned.
+ * HTTP requests on ESP8266 and Linux are parsed by the OpenThings
+ * Framework and do not go through the index.
+ */
+class KeyValIndex {
+public:
+	KeyValIndex(const char *str) { request++; build(str); }
+	~KeyValIndex() { build(NULL); }
+	static void build(const char *str); // NULL drops the index
+	static uint16_t request; // counts the requests and messages indexed
+};
+
+/** Fills a buffer from format strings in program memory
+ * $D int, $L uint32_t, $S string, $F string in program memory, $X byte in
+ * hex, $O string option. Numbers are converted by hand rather than through
+ * snprintf, and nothing is written past the end of the buffer: output that
+ * does not fit is cut off. Loops that emit many numbers can call the typed
+ * emitters directly and skip parsing the format string.
+ */
 class BufferFiller {
 	char *start; //!< Pointer to start of buffer
 	char *ptr; //!< Pointer to cursor position
@@ -46,58 +74,116 @@ public:
 	char* buffer () const { return start; }
 	size_t length () const { return len; }
 	unsigned int position () const { return ptr - start; }
+	void rewind (unsigned int pos) { ptr = start + pos; *ptr = 0; } // drop what was emitted after pos
+
+	void emit_char (char c) {
+		if (ptr < last()) *ptr++ = c;
+		*ptr = 0;
+	}
+
+	void emit_uint (uint32_t v) {
+		char tmp[10];
+		unsigned char n = 0;
+		if (v <= 0xFFFF) {
+			// 16-bit division is much cheaper on AVR
+			uint16_t w = v;
+			do {
+				tmp[n++] = '0' + w % 10;
+				w /= 10;
+			} while (w);
+		} else {
+			do {
+				tmp[n++] = '0' + v % 10;
+				v /= 10;
+			} while (v);
+		}
+		char *end = last();
+		while (n && ptr < end) *ptr++ = tmp[--n];
+		*ptr = 0;
+	}
+
+	void emit_int (int32_t v) {
+		if (v < 0) {
+			emit_char('-');
+			emit_uint(0 - (uint32_t)v);
+		} else {
+			emit_uint(v);
+		}
+	}
+
+	void emit_str (const char *s) {
+		char *end = last();
+		while (*s && ptr < end) *ptr++ = *s++;
+		*ptr = 0;
+	}
+
+	void emit_str_P (PGM_P s) {
+		char *end = last();
+		char d;
+		while ((d = pgm_read_byte(s++)) != 0 && ptr < end) *ptr++ = d;
+		*ptr = 0;
+	}
+
+	void emit_hex (unsigned char d) {
+		emit_char(dec2hexchar((d >> 4) & 0x0F));
+		emit_char(dec2hexchar(d & 0x0F));
+	}
+
+	void emit_sopt (unsigned char oid) {
+		uint16_t n = last() - ptr;
+#if !defined(ARDUINO)
+		ptr += ::emit_sopt(oid, ptr, n);
+#else
+		if (n > MAX_SOPTS_SIZE) n = MAX_SOPTS_SIZE;
+		file_read_block(SOPTS_FILENAME, ptr, oid*MAX_SOPTS_SIZE, n);
+		ptr[n] = 0;
+		ptr += strlen(ptr);
+#endif
+	}
 
 	void emit_p(PGM_P fmt, ...) {
 		va_list ap;
 		va_start(ap, fmt);
+		char *end = last();
 		for (;;) {
 			char c = pgm_read_byte(fmt++);
 			if (c == 0)
 				break;
 			if (c != '$') {
-				*ptr++ = c;
+				if (ptr < end) *ptr++ = c;
 				continue;
 			}
 			c = pgm_read_byte(fmt++);
 			switch (c) {
 			case 'D':
-				// itoa(va_arg(ap, int), (char*) ptr, 10);  // ray
-				snprintf((char*) ptr, len - position(),  "%d", va_arg(ap, int));
+				emit_int(va_arg(ap, int));
 				break;
 			case 'L':
-				// ultoa(va_arg(ap, uint32_t), (char*) ptr, 10);
-				snprintf((char*) ptr, len - position(), "%lu", (unsigned long) va_arg(ap, uint32_t));
+				emit_uint(va_arg(ap, uint32_t));
 				break;
 			case 'S':
-				strcpy((char*) ptr, va_arg(ap, const char*));
+				emit_str(va_arg(ap, const char*));
 				break;
-			case 'X': {
-				char d = va_arg(ap, int);
-				*ptr++ = dec2hexchar((d >> 4) & 0x0F);
-				*ptr++ = dec2hexchar(d & 0x0F);
-			}
-				continue;
-			case 'F': {
-				PGM_P s = va_arg(ap, PGM_P);
-				char d;
-				while ((d = pgm_read_byte(s++)) != 0)
-						*ptr++ = d;
-				continue;
-			}
-			case 'O': {
-				uint16_t oid = va_arg(ap, int);
-				file_read_block(SOPTS_FILENAME, (char*) ptr, oid*MAX_SOPTS_SIZE, MAX_SOPTS_SIZE);
-			}
+			case 'X':
+				emit_hex(va_arg(ap, int));
+				break;
+			case 'F':
+				emit_str_P(va_arg(ap, PGM_P));
+				break;
+			case 'O':
+				emit_sopt(va_arg(ap, int));
 				break;
 			default:
-				*ptr++ = c;
-				continue;
+				if (ptr < end) *ptr++ = c;
+				break;
 			}
-			ptr += strlen((char*) ptr);
 		}
-		*(ptr)=0;
+		*ptr = 0;
 		va_end(ap);
 	}
+
+private:
+	char *last () const { return start + len - 1; } // the last byte is kept for the terminating 0
 };
 
 
@@ -35,95 +35,464 @@
 unsigned char ProgramData::nprograms = 0;
 unsigned char ProgramData::nqueue = 0;
 RuntimeQueueStruct ProgramData::queue[RUNTIME_QUEUE_SIZE];
+unsigned char ProgramData::qhead = 0xFF;
+unsigned char ProgramData::qtail = 0xFF;
+unsigned char ProgramData::qfree = 0xFF;
 unsigned char ProgramData::station_qid[MAX_NUM_STATIONS];
+unsigned char ProgramData::group_qid[NUM_SEQ_GROUPS];
+time_os_t ProgramData::seq_end_times[NUM_SEQ_GROUPS];
+unsigned char ProgramData::seq_dirty = 0;
 LogStruct ProgramData::lastrun;
 time_os_t ProgramData::last_seq_stop_times[NUM_SEQ_GROUPS];
+bool ProgramData::sched_dirty = true;
+#if !defined(ARDUINO)
+ProgramTableStruct ProgramData::table;
+ProgramStruct ProgramData::programs[MAX_NUM_PROGRAMS];
+ScheduleIndexStruct ProgramData::sched_heap[MAX_NUM_PROGRAMS];
+unsigned char ProgramData::nsched = 0;
+#endif
 
 extern char tmp_buffer[];
 
 void ProgramData::init() {
 	reset_runtime();
-	load_count();
+	load_table();
+#if !defined(ARDUINO)
+	load_programs();
+	sched_dirty = true;
+#endif
 }
 
+/** Runtime queue
+ * Queue elements live in a fixed pool of slots and never move while they are
+ * in the queue, so a qid stays valid until the element is dequeued. Free slots
+ * are chained through next. Elements in use are chained in start time order
+ * (next/prev from qhead), per station in start time order (snext from station_qid)
+ * and per sequential group (gnext from group_qid). Elements that have not been
+ * scheduled yet have st==0 and sit at the front of the start time list.
+ */
 void ProgramData::reset_runtime() {
 	memset(station_qid, 0xFF, MAX_NUM_STATIONS);  // reset station qid to 0xFF
+	memset(group_qid, 0xFF, NUM_SEQ_GROUPS);
 	nqueue = 0;
+	qhead = qtail = 0xFF;
+	for (unsigned char i = 0; i < RUNTIME_QUEUE_SIZE; i++) {
+		queue[i].next = (i < RUNTIME_QUEUE_SIZE-1) ? i+1 : 0xFF;
+	}
+	qfree = 0;
 	memset(last_seq_stop_times, 0, sizeof(last_seq_stop_times));
+	memset(seq_end_times, 0, sizeof(seq_end_times));
+	seq_dirty = 0;
 }
 
 /** Insert a new element to the queue
- * This function returns pointer to the next available element in the queue
- * and returns NULL if the queue is full
+ * This function returns pointer to a free element in the queue
+ * and returns NULL if the queue is full. The element is pending
+ * until the scheduler assigns its start time.
  */
 RuntimeQueueStruct* ProgramData::enqueue() {
-	if (nqueue < RUNTIME_QUEUE_SIZE) {
-		nqueue ++;
-		return queue + (nqueue-1);
-	} else {
-		return NULL;
-	}
+	if (qfree == 0xFF) return NULL;
+	unsigned char qid = qfree;
+	RuntimeQueueStruct *q = queue + qid;
+	qfree = q->next;
+	q->st = 0;
+	q->deque_time = 0;
+	q->snext = 0xFF;
+	q->gnext = 0xFF;
+	q->gid = 0xFF;
+	time_insert(qid);
+	nqueue++;
+	return q;
 }
 
 /** Remove an element from the queue
- * This function copies the last element of
- * the queue to overwrite the requested
- * element, therefore removing the requested element.
+ * The element is unlinked from all lists and its slot is
+ * returned to the free list; no other element moves.
  */
-// this removes an element from the queue
 void ProgramData::dequeue(unsigned char qid) {
-	if (qid>=nqueue)	return;
-	if (qid<nqueue-1) {
-		queue[qid] = queue[nqueue-1]; // copy the last element to the dequeud element to fill the space
-		if(station_qid[queue[qid].sid] == nqueue-1) // fix queue index if necessary
-			station_qid[queue[qid].sid] = qid;
-	}
+	if (qid >= RUNTIME_QUEUE_SIZE) return;
+	time_remove(qid);
+	station_remove(qid);
+	group_remove(qid);
+	queue[qid].next = qfree;
+	qfree = qid;
 	nqueue--;
 }
 
-/** Load program count from program file */
-void ProgramData::load_count() {
+/** Re-link an element whose start time or duration has changed */
+void ProgramData::requeue(unsigned char qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	// only move in the start time list if it is out of order
+	if ((q->prev != 0xFF && queue[q->prev].st > q->st) || (q->next != 0xFF && queue[q->next].st < q->st)) {
+		time_remove(qid);
+		time_insert(qid);
+	}
+	station_remove(qid);
+	station_insert(qid);
+	if (q->gid == 0xFF) group_insert(qid);
+	else seq_dirty |= (1<<q->gid);
+}
+
+/** Rebuild all queue lists
+ * Call after the start times of many elements have changed,
+ * or after station groups have changed.
+ */
+void ProgramData::reindex() {
+	unsigned char qids[RUNTIME_QUEUE_SIZE];
+	unsigned char n = 0, i, qid;
+	for (qid = qhead; qid != 0xFF; qid = queue[qid].next) qids[n++] = qid;
+	qhead = qtail = 0xFF;
+	memset(station_qid, 0xFF, MAX_NUM_STATIONS);
+	memset(group_qid, 0xFF, NUM_SEQ_GROUPS);
+	for (i = 0; i < n; i++) {
+		qid = qids[i];
+		queue[qid].gid = 0xFF;
+		time_insert(qid);
+		station_insert(qid);
+		group_insert(qid);
+	}
+	seq_dirty = (1<<NUM_SEQ_GROUPS)-1;
+}
+
+/** Get the elements that have not been scheduled yet, in the order they were queued */
+unsigned char ProgramData::get_pending(unsigned char *qids) {
+	unsigned char n = 0;
+	for (unsigned char qid = qhead; qid != 0xFF && !queue[qid].st; qid = queue[qid].next) {
+		qids[n++] = qid;
+	}
+	return n;
+}
+
+/** Mark the stations whose first queue element has started by time t
+ * bits has one byte per board. Only elements that have started are visited.
+ */
+void ProgramData::get_started_stations(time_os_t t, unsigned char *bits) {
+	memset(bits, 0, MAX_NUM_BOARDS);
+	for (unsigned char qid = qhead; qid != 0xFF; qid = queue[qid].next) {
+		RuntimeQueueStruct *q = queue + qid;
+		if (!q->st) continue;
+		if (q->st > t) break;
+		if (station_qid[q->sid] == qid) bits[q->sid>>3] |= 1<<(q->sid&0x07);
+	}
+}
+
+/** Calculate the last stop time of each sequential group
+ * The latest end time of a group is only recalculated when
+ * elements of that group have changed.
+ */
+void ProgramData::update_seq_stop_times(time_os_t curr_time) {
+	unsigned char re = os.iopts[IOPT_REMOTE_EXT_MODE];
+	for (unsigned char gid = 0; gid < NUM_SEQ_GROUPS; gid++) {
+		if (seq_dirty & (1<<gid)) {
+			time_os_t end = 0;
+			for (unsigned char qid = group_qid[gid]; qid != 0xFF; qid = queue[qid].gnext) {
+				time_os_t sst = queue[qid].st + queue[qid].dur;
+				if (sst > end) end = sst;
+			}
+			seq_end_times[gid] = end;
+		}
+		// only need to report stop times that are in the future
+		last_seq_stop_times[gid] = (!re && seq_end_times[gid] > curr_time) ? seq_end_times[gid] : 0;
+	}
+	seq_dirty = 0;
+}
+
+/** Insert an element into the start time list, after elements with the same start time */
+void ProgramData::time_insert(unsigned char qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	unsigned char p;
+	if (!q->st) {
+		// pending elements go after the other pending elements at the front
+		p = 0xFF;
+		for (unsigned char n = qhead; n != 0xFF && !queue[n].st; n = queue[n].next) p = n;
+	} else {
+		// search from the end, as newly scheduled elements usually start last
+		p = qtail;
+		while (p != 0xFF && queue[p].st > q->st) p = queue[p].prev;
+	}
+	q->prev = p;
+	q->next = (p == 0xFF) ? qhead : queue[p].next;
+	if (p == 0xFF) qhead = qid; else queue[p].next = qid;
+	if (q->next == 0xFF) qtail = qid; else queue[q->next].prev = qid;
+}
+
+void ProgramData::time_remove(unsigned char qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	if (q->prev == 0xFF) qhead = q->next; else queue[q->prev].next = q->next;
+	if (q->next == 0xFF) qtail = q->prev; else queue[q->next].prev = q->prev;
+}
+
+/** Insert an element into its station list
+ * An element goes before elements with the same start time, so
+ * of two elements starting together the one queued last is run.
+ */
+void ProgramData::station_insert(unsigned char qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	unsigned char *p = station_qid + q->sid;
+	while (*p != 0xFF && queue[*p].st < q->st) p = &queue[*p].snext;
+	q->snext = *p;
+	*p = qid;
+}
+
+void ProgramData::station_remove(unsigned char qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	unsigned char *p = station_qid + q->sid;
+	while (*p != 0xFF && *p != qid) p = &queue[*p].snext;
+	if (*p == qid) *p = q->snext;
+}
+
+/** Add an element to the list of its sequential group, if the station is sequential */
+void ProgramData::group_insert(unsigned char qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	unsigned char gid = os.get_station_gid(q->sid);
+	if (!os.is_sequential_station(q->sid) || gid >= NUM_SEQ_GROUPS) {
+		q->gid = 0xFF;
+		return;
+	}
+	q->gid = gid;
+	q->gnext = group_qid[gid];
+	group_qid[gid] = qid;
+	seq_dirty |= (1<<gid);
+}
+
+void ProgramData::group_remove(unsigned char qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	if (q->gid == 0xFF) return;
+	unsigned char *p = group_qid + q->gid;
+	while (*p != 0xFF && *p != qid) p = &queue[*p].gnext;
+	if (*p == qid) *p = q->gnext;
+	seq_dirty |= (1<<q->gid);
+	q->gid = 0xFF;
+}
+
+/** Load the program table from program file
+ * On Arduino the table is only the program count.
+ */
+void ProgramData::load_table() {
+#if !defined(ARDUINO)
+	memset(&table, 0, sizeof(table));
+	file_read_block(PROG_FILENAME, &table, 0, sizeof(table));
+	if (table.format != PROGRAM_TABLE_FORMAT) convert_table();
+	if (table.nprograms > MAX_NUM_PROGRAMS) table.nprograms = MAX_NUM_PROGRAMS;
+	nprograms = table.nprograms;
+#else
 	nprograms = file_read_byte(PROG_FILENAME, 0);
+#endif
+}
+
+#if !defined(ARDUINO)
+/** Move the programs of an old program file into slots
+ * Program i goes to slot i. The programs and the new table are written
+ * in one transaction, so a conversion cut short by a power loss is
+ * either finished or undone by the journal on the next start.
+ */
+void ProgramData::convert_table() {
+	unsigned char n = table.format; // the old program count
+	if (n > MAX_NUM_PROGRAMS) n = MAX_NUM_PROGRAMS;
+	FileTransaction txn;
+	if (n) {
+		file_read_block(PROG_FILENAME, programs, 1, (ulong)n*PROGRAMSTRUCT_SIZE);
+		file_write_block(PROG_FILENAME, programs, sizeof(ProgramTableStruct), (ulong)n*PROGRAMSTRUCT_SIZE);
+	}
+	for (unsigned char i = 0; i < n; i++) table.slots[i] = i;
+	nprograms = n;
+	save_table();
+	txn.commit();
+}
+
+/** Load all programs from program file into memory
+ * After this, reads are served from the in-memory table and
+ * every modification is written through to the program file.
+ */
+void ProgramData::load_programs() {
+	if (nprograms > MAX_NUM_PROGRAMS) nprograms = MAX_NUM_PROGRAMS;
+	for (unsigned char pid = 0; pid < nprograms; pid++) {
+		file_read_block(PROG_FILENAME, programs+pid, slot_pos(pid), PROGRAMSTRUCT_SIZE);
+	}
+}
+
+/** Add a program to the schedule index
+ * The next start time is searched from time t onwards. A program
+ * that does not match within the search window is re-checked when
+ * the window ends; disabled programs are left out.
+ */
+void ProgramData::sched_push(unsigned char pid, time_os_t t) {
+	ScheduleIndexStruct e;
+	e.pid = pid;
+	e.recheck = 0;
+	e.next = programs[pid].next_match(t, SCHEDULE_INDEX_DAYS);
+	if (!e.next) {
+		if (!programs[pid].enabled) return;
+		e.next = (t/86400L+SCHEDULE_INDEX_DAYS+1)*86400L;
+		e.recheck = 1;
+	}
+	// sift up
+	unsigned char i = nsched++;
+	while (i > 0) {
+		unsigned char parent = (i-1)/2;
+		if (sched_heap[parent].next <= e.next) break;
+		sched_heap[i] = sched_heap[parent];
+		i = parent;
+	}
+	sched_heap[i] = e;
+}
+
+void ProgramData::sched_sift_down(unsigned char i) {
+	ScheduleIndexStruct e = sched_heap[i];
+	while (true) {
+		unsigned char child = 2*i+1;
+		if (child >= nsched) break;
+		if (child+1 < nsched && sched_heap[child+1].next < sched_heap[child].next) child++;
+		if (e.next <= sched_heap[child].next) break;
+		sched_heap[i] = sched_heap[child];
+		i = child;
+	}
+	sched_heap[i] = e;
+}
+
+/** Rebuild the schedule index from time t */
+void ProgramData::sched_rebuild(time_os_t t) {
+	nsched = 0;
+	for(unsigned char pid=0; pid<nprograms; pid++) {
+		sched_push(pid, t);
+	}
+	sched_dirty = false;
+}
+
+/** Pop all programs whose next start time is due at time t
+ * The programs are returned in pids sorted by program index, so they
+ * are processed in the same order as a full scan would. Each popped
+ * program is pushed back with its next start time after this minute.
+ * The caller must still confirm each program with check_match.
+ */
+unsigned char ProgramData::sched_pop_due(time_os_t t, unsigned char *pids) {
+	if (sched_dirty) sched_rebuild(t);
+	unsigned char n = 0;
+	while (nsched > 0 && sched_heap[0].next <= t) {
+		pids[n++] = sched_heap[0].pid;
+		sched_heap[0] = sched_heap[--nsched];
+		sched_sift_down(0);
+	}
+	// insertion sort: the number of due programs is small
+	for(unsigned char i=1; i<n; i++) {
+		unsigned char v = pids[i];
+		unsigned char j = i;
+		for(; j>0 && pids[j-1]>v; j--) pids[j] = pids[j-1];
+		pids[j] = v;
+	}
+	time_os_t next_minute = (t/60+1)*60;
+	for(unsigned char i=0; i<n; i++) {
+		sched_push(pids[i], next_minute);
+	}
+	return n;
 }
 
-/** Save program count to program file */
-void ProgramData::save_count() {
+/** Earliest start time in the schedule index (0 if empty) */
+time_os_t ProgramData::sched_peek(time_os_t t) {
+	if (sched_dirty) sched_rebuild(t);
+	return nsched ? sched_heap[0].next : 0;
+}
+
+/** Next start time of a program according to the schedule index */
+time_os_t ProgramData::sched_next_start(unsigned char pid) {
+	for(unsigned char i=0; i<nsched; i++) {
+		if (sched_heap[i].pid == pid) return sched_heap[i].recheck ? 0 : sched_heap[i].next;
+	}
+	return 0;
+}
+#endif
+
+/** Save the program table to program file
+ * The bit map of slots in use is rebuilt from the slot list.
+ * On Arduino only the program count is written.
+ */
+void ProgramData::save_table() {
+#if defined(ARDUINO)
 	file_write_byte(PROG_FILENAME, 0, nprograms);
+#else
+	table.format = PROGRAM_TABLE_FORMAT;
+	table.nprograms = nprograms;
+	memset(table.used, 0, sizeof(table.used));
+	for (unsigned char pid = 0; pid < nprograms; pid++) {
+		table.used[table.slots[pid]>>3] |= 1<<(table.slots[pid]&7);
+	}
+	file_write_block(PROG_FILENAME, &table, 0, sizeof(table));
+#endif
 }
 
+#if !defined(ARDUINO)
+/** First slot not in use */
+unsigned char ProgramData::free_slot() {
+	unsigned char slot;
+	for (slot = 0; slot < MAX_NUM_PROGRAMS; slot++) {
+		if (!(table.used[slot>>3] & (1<<(slot&7)))) break;
+	}
+	return slot;
+}
+#endif
+
 /** Erase all program data */
 void ProgramData::eraseall() {
 	nprograms = 0;
-	save_count();
+	save_table();
+#if !defined(ARDUINO)
+	sched_dirty = true;
+#endif
+	os.state_changed(STATE_PROGRAMS);
 }
 
 /** Read a program from program file*/
 void ProgramData::read(unsigned char pid, ProgramStruct *buf) {
 	if (pid >= nprograms) return;
-	// first unsigned char is program counter, so 1+
-	file_read_block(PROG_FILENAME, buf, 1+(ulong)pid*PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE);
+#if !defined(ARDUINO)
+	memcpy(buf, programs+pid, PROGRAMSTRUCT_SIZE);
+#else
+	file_read_block(PROG_FILENAME, buf, slot_pos(pid), PROGRAMSTRUCT_SIZE);
+#endif
 }
 
 /** Add a program */
 unsigned char ProgramData::add(ProgramStruct *buf) {
 	if (nprograms >= MAX_NUM_PROGRAMS)	return 0;
-	file_write_block(PROG_FILENAME, buf, 1+(ulong)nprograms*PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE);
+#if !defined(ARDUINO)
+	memcpy(programs+nprograms, buf, PROGRAMSTRUCT_SIZE);
+	sched_dirty = true;
+#endif
+	os.state_changed(STATE_PROGRAMS);
+#if !defined(ARDUINO)
+	// the program goes into its slot before the table lists it
+	table.slots[nprograms] = free_slot();
+#endif
+	file_write_block(PROG_FILENAME, buf, slot_pos(nprograms), PROGRAMSTRUCT_SIZE);
 	nprograms ++;
-	save_count();
+	save_table();
 	return 1;
 }
 
 /** Move a program up (i.e. swap a program with the one above it) */
 void ProgramData::moveup(unsigned char pid) {
 	if(pid >= nprograms || pid == 0) return;
+	os.state_changed(STATE_PROGRAMS);
+#if !defined(ARDUINO)
+	// swap program pid-1 and pid: only their slots are swapped in the table
+	unsigned char slot = table.slots[pid-1];
+	table.slots[pid-1] = table.slots[pid];
+	table.slots[pid] = slot;
+	ProgramStruct tmp = programs[pid-1];
+	programs[pid-1] = programs[pid];
+	programs[pid] = tmp;
+	sched_dirty = true;
+	save_table();
+#else
 	// swap program pid-1 and pid
-	ulong pos = 1+(ulong)(pid-1)*PROGRAMSTRUCT_SIZE;
+	ulong pos = slot_pos(pid-1);
 	ulong next = pos+PROGRAMSTRUCT_SIZE;
 	char buf2[PROGRAMSTRUCT_SIZE];
 	file_read_block(PROG_FILENAME, tmp_buffer, pos, PROGRAMSTRUCT_SIZE);
 	file_read_block(PROG_FILENAME, buf2, next, PROGRAMSTRUCT_SIZE);
 	file_write_block(PROG_FILENAME, tmp_buffer, next, PROGRAMSTRUCT_SIZE);
 	file_write_block(PROG_FILENAME, buf2, pos, PROGRAMSTRUCT_SIZE);
+#endif
 }
 
 void ProgramData::toggle_pause(ulong delay) {
@@ -138,12 +507,15 @@ void ProgramData::toggle_pause(ulong delay) {
 }
 
 void ProgramData::set_pause() {
-	RuntimeQueueStruct *q = queue;
+	RuntimeQueueStruct *q;
+	unsigned char qid, sid;
 	time_os_t curr_t = os.now_tz();
 
-	for (; q < queue + nqueue; q++) {
-
-		turn_off_station(q->sid, curr_t);
+	for (sid = 0; sid < os.nstations; sid++) {
+		if (station_qid[sid] != 0xFF) turn_off_station(sid, curr_t);
+	}
+	for (qid = qhead; qid != 0xFF; qid = q->next) {
+		q = queue + qid;
 		if (curr_t>=q->st+q->dur) { // already finished running
 			continue;
 		} else if (curr_t>=q->st) { // currently running
@@ -153,21 +525,23 @@ void ProgramData::set_pause() {
 			q->st += os.pause_timer;
 		}
 		q->deque_time += os.pause_timer;
-		unsigned char gid = os.get_station_gid(q->sid);
-		if (q->st + q->dur > last_seq_stop_times[gid]) {
-			last_seq_stop_times[gid] = q->st + q->dur; // update last_seq_stop_times of the corresponding group
+		if (q->gid != 0xFF && q->st + q->dur > last_seq_stop_times[q->gid]) {
+			last_seq_stop_times[q->gid] = q->st + q->dur; // update last_seq_stop_times of the corresponding group
 		}
 	}
+	reindex(); // running stations now start after the others
 }
 
 void ProgramData::resume_stations() {
-	RuntimeQueueStruct *q = queue;
-	for (; q < queue + nqueue; q++) {
+	RuntimeQueueStruct *q;
+	for (unsigned char qid = qhead; qid != 0xFF; qid = q->next) {
+		q = queue + qid;
 		q->st -= os.pause_timer;
 		q->deque_time -= os.pause_timer;
 		q->st += 1; // adjust by 1 second to give time for scheduler
 		q->deque_time += 1;
 	}
+	reindex();
 	clear_pause();
 }
 
@@ -180,8 +554,12 @@ void ProgramData::clear_pause() {
 /** Modify a program */
 unsigned char ProgramData::modify(unsigned char pid, ProgramStruct *buf) {
 	if (pid >= nprograms)  return 0;
-	ulong pos = 1+(ulong)pid*PROGRAMSTRUCT_SIZE;
-	file_write_block(PROG_FILENAME, buf, pos, PROGRAMSTRUCT_SIZE);
+#if !defined(ARDUINO)
+	memcpy(programs+pid, buf, PROGRAMSTRUCT_SIZE);
+	sched_dirty = true;
+#endif
+	os.state_changed(STATE_PROGRAMS);
+	file_write_block(PROG_FILENAME, buf, slot_pos(pid), PROGRAMSTRUCT_SIZE);
 	return 1;
 }
 
@@ -189,28 +567,42 @@ unsigned char ProgramData::modify(unsigned char pid, ProgramStruct *buf) {
 unsigned char ProgramData::del(unsigned char pid) {
 	if (pid >= nprograms)  return 0;
 	if (nprograms == 0) return 0;
-	ulong pos = 1+(ulong)(pid+1)*PROGRAMSTRUCT_SIZE;
+#if !defined(ARDUINO)
+	// the slot of the program is freed, the programs after it stay where they are
+	memmove(table.slots+pid, table.slots+pid+1, nprograms-pid-1);
+	memmove(programs+pid, programs+pid+1, (ulong)(nprograms-pid-1)*PROGRAMSTRUCT_SIZE);
+	sched_dirty = true;
+#else
+	ulong pos = slot_pos(pid+1);
 	// erase by copying backward
-	for (; pos < 1+(ulong)nprograms*PROGRAMSTRUCT_SIZE; pos+=PROGRAMSTRUCT_SIZE) {
+	for (; pos < slot_pos(nprograms); pos+=PROGRAMSTRUCT_SIZE) {
 		file_copy_block(PROG_FILENAME, pos, pos-PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE, tmp_buffer);
 	}
+#endif
+	os.state_changed(STATE_PROGRAMS);
 	nprograms --;
-	save_count();
+	save_table();
 	return 1;
 }
 
 // set the enable bit
 unsigned char ProgramData::set_flagbit(unsigned char pid, unsigned char bid, unsigned char value) {
 	if (pid >= nprograms)  return 0;
-	unsigned char flag = file_read_byte(PROG_FILENAME, 1+(ulong)pid*PROGRAMSTRUCT_SIZE);
+#if !defined(ARDUINO)
+	unsigned char &flag = *(unsigned char*)(programs+pid); // flag bits are the first byte of the struct
+	sched_dirty = true;
+#else
+	unsigned char flag = file_read_byte(PROG_FILENAME, slot_pos(pid));
+#endif
 	if(value) flag|=(1<<bid);
 	else flag&=(~(1<<bid));
-	file_write_byte(PROG_FILENAME, 1+(ulong)pid*PROGRAMSTRUCT_SIZE, flag);
+	file_write_byte(PROG_FILENAME, slot_pos(pid), flag);
+	os.state_changed(STATE_PROGRAMS);
 	return 1;
 }
 
 /** Decode a sunrise/sunset start time to actual start time */
-int16_t ProgramStruct::starttime_decode(int16_t t) {
+int16_t ProgramStruct::starttime_decode(int16_t t) const {
 	if((t>>15)&1) return -1;
 	int16_t offset = t&0x7ff;
 	if((t>>STARTTIME_SIGN_BIT)&1) offset = -offset;
@@ -225,7 +617,7 @@ int16_t ProgramStruct::starttime_decode(int16_t t) {
 }
 
 /** Check if a given time matches the program's start day */
-unsigned char ProgramStruct::check_day_match(time_os_t t) {
+unsigned char ProgramStruct::check_day_match(time_os_t t) const {
 
 #if defined(ARDUINO)  // get current time from Arduino
 	unsigned char weekday_t = weekday(t);  // weekday ranges from [0,6] within Sunday being 1
@@ -312,7 +704,7 @@ unsigned char ProgramStruct::check_day_match(time_os_t t) {
 // day and ran over night
 // Return value: 0 if no match; otherwise return the n-th count of the match.
 // For example, if this is the first-run of the day, return 1 etc.
-unsigned char ProgramStruct::check_match(time_os_t t, bool *to_delete) {
+unsigned char ProgramStruct::check_match(time_os_t t, bool *to_delete) const {
 
 	// check program enable status
 	if (!enabled) return 0;
@@ -395,6 +787,55 @@ unsigned char ProgramStruct::check_match(time_os_t t, bool *to_delete) {
 	return 0;
 }
 
+/** Find the next time, at or after t, at which check_match would return a non-zero count.
+ * This evaluates each day's start times directly instead of testing minute by minute.
+ * The result is minute-aligned. Returns 0 if there is no match within ndays days.
+ */
+time_os_t ProgramStruct::next_match(time_os_t t, uint16_t ndays) const {
+	if (!enabled) return 0;
+
+	int16_t start = starttime_decode(starttimes[0]);
+	int16_t repeat = starttimes[1];
+	int16_t interval = starttimes[2];
+	time_os_t day = t / 86400L;
+	int16_t min_minute = (t % 86400L) / 60;
+	unsigned char prev_match = check_day_match((day-1)*86400L);
+
+	for(uint16_t d=0; d<=ndays; d++, day++, min_minute=0) {
+		unsigned char curr_match = check_day_match(day*86400L);
+		int32_t best = 1440;
+		if (curr_match) {
+			if (starttime_type) {
+				// given start time type
+				for(unsigned char i=0;i<MAX_NUM_STARTTIMES;i++) {
+					int16_t st = starttime_decode(starttimes[i]);
+					if (st >= min_minute && st < best) best = st;
+				}
+			} else if (start >= min_minute) {
+				// repeating type, first run of the day
+				best = start;
+			} else if (interval > 0) {
+				// repeating type, first repeat at or after min_minute
+				int32_t c = (min_minute - start + interval - 1) / interval;
+				if (c <= repeat) best = start + c * interval;
+			}
+		}
+		if (prev_match && !starttime_type && interval > 0) {
+			// repeats of a program that started the previous day and ran over night
+			int32_t c = (min_minute - start + 1440 + interval - 1) / interval;
+			if (c < 0) c = 0;
+			if (c <= repeat) {
+				int32_t m = start + c * interval - 1440;
+				if (m < best) best = m;
+			}
+		}
+		if (best < 1440) return day*86400L + best*60L;
+		prev_match = curr_match;
+	}
+	return 0;
+}
+
+#if defined(ARDUINO)
 struct StationNameSortElem {
 	unsigned char idx;
 	char *name;
@@ -407,6 +848,7 @@ int StationNameSortAscendCmp(const void *a, const void *b) {
 int StationNameSortDescendCmp(const void *a, const void *b) {
 	return StationNameSortAscendCmp(b, a);
 }
+#endif
 
 // generate station runorder based on the annotation in program names
 // alternating means on the odd numbered runs of the program, it uses one order; on the even runs, it uses the opposite order
@@ -443,6 +885,15 @@ void ProgramStruct::gen_station_runorder(uint16_t runcount, unsigned char *order
 			case 't': // alternating: odd-numbered runs ascending by name, even-numbered runs descending.
 			case 'T': // odd-numbered runs descending by name, even-numbered runs ascending
 			{
+#if !defined(ARDUINO)
+				// the station table keeps all stations sorted by name
+				bool ascend = (anno=='n') || ((anno=='t') && (runcount%2==1)) || ((anno=='T') && (runcount%2==0));
+				unsigned char k = 0;
+				for(i=0;i<MAX_NUM_STATIONS;i++) {
+					unsigned char sid = os.station_name_order[ascend ? i : MAX_NUM_STATIONS-1-i];
+					if(sid<ns) order[k++] = sid;
+				}
+#else
 				StationNameSortElem elems[ns];
 				for(i=0;i<ns;i++) {
 					elems[i].idx=i;
@@ -458,6 +909,7 @@ void ProgramStruct::gen_station_runorder(uint16_t runcount, unsigned char *order
 					order[i]=elems[i].idx;
 					free(elems[i].name);
 				}
+#endif
 			}
 			break;
 
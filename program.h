@@ -30,6 +30,7 @@
 #define PROGRAM_NAME_SIZE   32
 #define RUNTIME_QUEUE_SIZE  MAX_NUM_STATIONS
 #define PROGRAMSTRUCT_SIZE  sizeof(ProgramStruct)
+#define SCHEDULE_INDEX_DAYS 366 // how many days ahead the schedule index searches for the next start time
 #include "OpenSprinkler.h"
 #include "types.h"
 
@@ -104,13 +105,14 @@ public:
 	char name[PROGRAM_NAME_SIZE];
 
 	int16_t daterange[2] = {MIN_ENCODED_DATE, MAX_ENCODED_DATE}; // date range: start date, end date
-	unsigned char check_match(time_os_t t, bool *to_delete);
+	unsigned char check_match(time_os_t t, bool *to_delete) const;
 	void gen_station_runorder(uint16_t runcount, unsigned char *order);
-	int16_t starttime_decode(int16_t t);
+	int16_t starttime_decode(int16_t t) const;
+	time_os_t next_match(time_os_t t, uint16_t ndays) const;
 
 protected:
 
-	unsigned char check_day_match(time_os_t t);
+	unsigned char check_day_match(time_os_t t) const;
 
 };
 
@@ -123,13 +125,47 @@ public:
 	unsigned char  sid;
 	unsigned char  pid;
 	time_os_t   deque_time; // deque time, which can be larger than st+dur to allow positive master off adjustment time
+	unsigned char next;  // next element in start time order, or next free slot
+	unsigned char prev;  // previous element in start time order
+	unsigned char snext; // next element of the same station
+	unsigned char gnext; // next element of the same sequential group
+	unsigned char gid;   // sequential group this element is listed in, 255 if none
+};
+
+#if !defined(ARDUINO)
+/** Program table, at the start of the program file (Linux)
+ * Programs are stored in fixed slots after the table, and the table lists
+ * the slot of each program in program order. Moving or deleting a program
+ * only rewrites the table, and a new program takes a free slot. Files
+ * written by older firmware have the program count in the first byte and
+ * the programs in order after it; they are converted when loaded, and
+ * older firmware cannot read the converted file.
+ * Arduino builds keep the older format.
+ */
+#define PROGRAM_TABLE_FORMAT 0xA5 // first byte of the table, larger than any old program count
+
+struct ProgramTableStruct {
+	unsigned char format;
+	unsigned char nprograms;
+	unsigned char slots[MAX_NUM_PROGRAMS];           // slot of each program
+	unsigned char used[(MAX_NUM_PROGRAMS+7)/8];      // bit map of the slots in use
+};
+#endif
+
+/** Schedule index entry: next start time of a program */
+struct ScheduleIndexStruct {
+	time_os_t next; // next time the program may start
+	unsigned char pid;
+	unsigned char recheck; // 1 if nothing was found within the search window and next is only a re-check time
 };
 
 class ProgramData {
 public:
-	static RuntimeQueueStruct queue[];
+	static RuntimeQueueStruct queue[]; // slot pool, elements never move while in the queue
 	static unsigned char nqueue;  // number of queue elements
-	static unsigned char station_qid[];  // this array stores the queue element index for each scheduled station
+	static unsigned char qhead;   // first queue element in start time order, 255 if the queue is empty
+	static unsigned char station_qid[];  // the earliest starting queue element of each station, 255 if none
+	static unsigned char group_qid[];    // first queue element of each sequential group, 255 if none
 	static unsigned char nprograms;  // number of programs
 	static LogStruct lastrun;
 	static time_os_t last_seq_stop_times[]; // the last stop time of a sequential station (for each sequential group respectively)
@@ -142,6 +178,11 @@ public:
 	static void reset_runtime();
 	static RuntimeQueueStruct* enqueue(); // this returns a pointer to the next available slot in the queue
 	static void dequeue(unsigned char qid);  // this removes an element from the queue
+	static void requeue(unsigned char qid);  // call after the start time or duration of one element has changed
+	static void reindex(); // rebuild all queue lists, e.g. after station groups have changed
+	static unsigned char get_pending(unsigned char *qids); // elements that have not been scheduled yet
+	static void get_started_stations(time_os_t t, unsigned char *bits); // stations whose first element has started by time t
+	static void update_seq_stop_times(time_os_t curr_time);
 
 	static void init();
 	static void eraseall();
@@ -153,9 +194,49 @@ public:
 	static unsigned char del(unsigned char pid);
 	static void drem_to_relative(unsigned char days[2]); // absolute to relative reminder conversion
 	static void drem_to_absolute(unsigned char days[2]);
+	static void sched_invalidate() { sched_dirty = true; } // call when programs, sunrise/sunset or timezone change
+#if !defined(ARDUINO)
+	static const ProgramStruct* get(unsigned char pid) { return programs+pid; } // direct access to the in-memory program table
+
+	// schedule index: a min-heap of programs keyed on their next start time
+	static unsigned char sched_pop_due(time_os_t t, unsigned char *pids); // get programs due at time t, sorted by pid
+	static time_os_t sched_peek(time_os_t t); // earliest indexed start time
+	static time_os_t sched_next_start(unsigned char pid); // next start time of a program, 0 if none is known
+#endif
 private:
-	static void load_count();
-	static void save_count();
+	static void load_table();
+	static void save_table();
+#if !defined(ARDUINO)
+	static ProgramTableStruct table;
+	static void convert_table(); // from the format of older firmware
+	static unsigned char free_slot();
+	static ulong slot_pos(unsigned char pid) { return sizeof(ProgramTableStruct)+(ulong)table.slots[pid]*PROGRAMSTRUCT_SIZE; }
+#else
+	// first unsigned char is program counter, so 1+
+	static ulong slot_pos(unsigned char pid) { return 1+(ulong)pid*PROGRAMSTRUCT_SIZE; }
+#endif
+	static bool sched_dirty;
+
+	static unsigned char qtail; // last queue element in start time order
+	static unsigned char qfree; // first free slot
+	static time_os_t seq_end_times[]; // latest end time of the elements in each sequential group
+	static unsigned char seq_dirty;   // bit mask of groups whose end time needs to be recalculated
+	static void time_insert(unsigned char qid);
+	static void time_remove(unsigned char qid);
+	static void station_insert(unsigned char qid);
+	static void station_remove(unsigned char qid);
+	static void group_insert(unsigned char qid);
+	static void group_remove(unsigned char qid);
+#if !defined(ARDUINO)
+	static ProgramStruct programs[]; // in-memory copy of prog.dat, kept in sync on every write
+	static void load_programs();
+
+	static ScheduleIndexStruct sched_heap[];
+	static unsigned char nsched;
+	static void sched_rebuild(time_os_t t);
+	static void sched_push(unsigned char pid, time_os_t t);
+	static void sched_sift_down(unsigned char i);
+#endif
 };
 
 #endif  // _PROGRAM_H
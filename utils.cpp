@@ -40,6 +40,10 @@ extern OpenSprinkler os;
 #else // RPI/LINUX
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 char* get_runtime_path() {
 	static char path[PATH_MAX];
@@ -290,6 +294,311 @@ BoardType get_board_type() {
 #endif
 
 
+#if !defined(ARDUINO)
+/** Data files mapped into memory
+ * Each data file is opened and mapped the first time it is used, so reads
+ * and writes are memory copies instead of a fopen/fclose each. Writes past
+ * the end of a file grow it to the end of the write, so the files on disk
+ * are the same as those written with stdio. The kernel writes the mapped
+ * pages back, and file_sync() forces them to disk. Files that cannot be
+ * mapped (e.g. read-only ones) are still read and written with stdio */
+#define MAPPED_FILES_MAX 16
+
+struct MappedFile {
+	char name[32];
+	int fd;
+	unsigned char *data; // NULL while the file is empty
+	ulong size;
+	bool dirty;          // written since the last file_sync()
+};
+
+static MappedFile mapped_files[MAPPED_FILES_MAX];
+static unsigned char nmapped = 0;
+static pthread_mutex_t mapped_mutex = PTHREAD_MUTEX_INITIALIZER; // the I/O worker writes files too
+
+/** Find the mapping of a file, mapping it if it is not yet.
+ * Returns NULL if the file does not exist (and create is false) or cannot be mapped */
+static MappedFile *file_map(const char *fn, bool create) {
+	unsigned char i;
+	for(i=0;i<nmapped;i++) {
+		if(!strcmp(mapped_files[i].name, fn)) return mapped_files+i;
+	}
+	if(nmapped>=MAPPED_FILES_MAX || strlen(fn)>=sizeof(mapped_files[0].name)) return NULL;
+	int fd = open(get_filename_fullpath(fn), O_RDWR|O_CLOEXEC|(create?O_CREAT:0), 0666);
+	if(fd<0) return NULL;
+	struct stat st;
+	MappedFile *m = mapped_files+nmapped;
+	m->data = NULL;
+	m->size = 0;
+	if(fstat(fd, &st)==0 && st.st_size>0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if(p==MAP_FAILED) {
+			close(fd);
+			return NULL;
+		}
+		m->data = (unsigned char*)p;
+		m->size = st.st_size;
+	}
+	strcpy(m->name, fn);
+	m->fd = fd;
+	m->dirty = false;
+	nmapped++;
+	return m;
+}
+
+/** Grow a mapped file so that it has at least size bytes */
+static bool file_grow(MappedFile *m, ulong size) {
+	if(size<=m->size) return true;
+	if(ftruncate(m->fd, size)) return false;
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, m->fd, 0);
+	if(p==MAP_FAILED) return false;
+	if(m->data) munmap(m->data, m->size);
+	m->data = (unsigned char*)p;
+	m->size = size;
+	return true;
+}
+
+static void file_unmap(MappedFile *m) {
+	if(m->data) munmap(m->data, m->size);
+	close(m->fd);
+	*m = mapped_files[--nmapped];
+}
+
+/** Write the changed pages of the mapped files to disk */
+void file_sync() {
+	pthread_mutex_lock(&mapped_mutex);
+	for(unsigned char i=0;i<nmapped;i++) {
+		MappedFile *m = mapped_files+i;
+		if(m->dirty && m->data) msync(m->data, m->size, MS_SYNC);
+		m->dirty = false;
+	}
+	pthread_mutex_unlock(&mapped_mutex);
+}
+
+/** Read a block, returns the number of bytes read (fewer at the end of the file) */
+static ulong file_read_now(const char *fn, void *dst, ulong pos, ulong len) {
+	pthread_mutex_lock(&mapped_mutex);
+	MappedFile *m = file_map(fn, false);
+	if(m) {
+		// like fread, only the bytes before the end of the file are read
+		ulong n = (pos<m->size) ? ((len<m->size-pos)?len:m->size-pos) : 0;
+		if(n) memcpy(dst, m->data+pos, n);
+		pthread_mutex_unlock(&mapped_mutex);
+		return n;
+	}
+	pthread_mutex_unlock(&mapped_mutex);
+
+	ulong n = 0;
+	FILE *fp = fopen(get_filename_fullpath(fn), "rb");
+	if(fp) {
+		fseek(fp, pos, SEEK_SET);
+		n = fread(dst, 1, len, fp);
+		fclose(fp);
+	}
+	return n;
+}
+
+static void file_write_now(const char *fn, const void *src, ulong pos, ulong len) {
+	pthread_mutex_lock(&mapped_mutex);
+	MappedFile *m = file_map(fn, true);
+	if(m && file_grow(m, pos+len)) {
+		memcpy(m->data+pos, src, len);
+		m->dirty = true;
+		pthread_mutex_unlock(&mapped_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&mapped_mutex);
+
+	FILE *fp = fopen(get_filename_fullpath(fn), "rb+");
+	if(!fp) {
+		fp = fopen(get_filename_fullpath(fn), "wb+");
+	}
+	if(fp) {
+		fseek(fp, pos, SEEK_SET); //this fails silently without the above change
+		fwrite(src, 1, len, fp);
+		fclose(fp);
+	}
+}
+
+/** Transactions
+ * Between file_begin() and file_commit(), the writes of the thread that
+ * began are staged in memory (and seen by its reads); file_abort() drops
+ * them instead. The commit writes them all to a journal file and syncs it
+ * and the data folder, then applies them to the data files and syncs those,
+ * then removes the journal. After a power loss, a complete journal is
+ * applied again by file_recover(), and a torn one is dropped, so the data
+ * files have either all the writes or none of them */
+struct JournalHeader {
+	uint32_t magic;
+	uint32_t len; // bytes of records that follow
+	uint32_t sum; // checksum of the records
+};
+
+struct JournalRecord {
+	char name[32];
+	uint32_t pos;
+	uint32_t len; // bytes of data that follow
+};
+
+#define JOURNAL_MAGIC 0x4A4E534F // "OSNJ"
+
+static thread_local unsigned char txn_depth = 0; // transactions begun and not yet committed by this thread
+static thread_local bool txn_aborted = false; // a nested transaction was aborted, so the outermost one drops the writes
+static unsigned char *txn_buf = NULL; // staged records, only used by one thread at a time
+static ulong txn_len = 0, txn_size = 0;
+
+static uint32_t journal_sum(const unsigned char *p, ulong len) {
+	uint32_t h = 2166136261u; // FNV-1a
+	while(len--) h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static void file_stage(const char *fn, const void *src, ulong pos, ulong len) {
+	if(strlen(fn)>=sizeof(JournalRecord::name)) {
+		file_write_now(fn, src, pos, len);
+		return;
+	}
+	ulong need = txn_len+sizeof(JournalRecord)+len;
+	if(need>txn_size) {
+		ulong size = txn_size ? txn_size : 1024;
+		while(size<need) size *= 2;
+		unsigned char *p = (unsigned char*)realloc(txn_buf, size);
+		if(!p) {
+			file_write_now(fn, src, pos, len); // not atomic, but not lost
+			return;
+		}
+		txn_buf = p;
+		txn_size = size;
+	}
+	JournalRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	strcpy(rec.name, fn);
+	rec.pos = pos;
+	rec.len = len;
+	memcpy(txn_buf+txn_len, &rec, sizeof(rec));
+	memcpy(txn_buf+txn_len+sizeof(rec), src, len);
+	txn_len = need;
+}
+
+/** Lay the staged writes of a file over a block read from it (n bytes of len).
+ * Returns the number of bytes the block will have once they are applied */
+static ulong file_overlay(const char *fn, unsigned char *dst, ulong pos, ulong len, ulong n) {
+	JournalRecord rec;
+	ulong i, end = 0;
+	// staged writes past the end of the file grow it, with zeros in between
+	for(i=0;i<txn_len;i+=sizeof(rec)+rec.len) {
+		memcpy(&rec, txn_buf+i, sizeof(rec));
+		if(!strcmp(rec.name, fn) && rec.pos+rec.len>end) end = rec.pos+rec.len;
+	}
+	if(end>pos+n) {
+		ulong m = (end-pos<len) ? end-pos : len;
+		memset(dst+n, 0, m-n);
+		n = m;
+	}
+	for(i=0;i<txn_len;i+=sizeof(rec)+rec.len) {
+		memcpy(&rec, txn_buf+i, sizeof(rec));
+		if(strcmp(rec.name, fn) || rec.pos>=pos+len || rec.pos+rec.len<=pos) continue;
+		ulong from = (rec.pos>pos) ? rec.pos : pos;
+		ulong to = (rec.pos+rec.len<pos+len) ? rec.pos+rec.len : pos+len;
+		memcpy(dst+(from-pos), txn_buf+i+sizeof(rec)+(from-rec.pos), to-from);
+	}
+	return n;
+}
+
+static void journal_apply(const unsigned char *p, ulong len) {
+	JournalRecord rec;
+	for(ulong i=0;i+sizeof(rec)<=len;i+=sizeof(rec)+rec.len) {
+		memcpy(&rec, p+i, sizeof(rec));
+		rec.name[sizeof(rec.name)-1] = 0;
+		if(i+sizeof(rec)+rec.len>len) break;
+		file_write_now(rec.name, p+i+sizeof(rec), rec.pos, rec.len);
+	}
+	file_sync();
+}
+
+/** Put the entries of the data folder on disk, so that the journal is
+ * found after a power loss once it is written, and not once it is removed */
+static void dir_sync() {
+	int fd = open(get_data_dir(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(fd<0) return;
+	fsync(fd);
+	close(fd);
+}
+
+static void txn_drop() {
+	txn_len = 0;
+	if(txn_size>4096) { // do not hold on to the memory of a large transaction
+		free(txn_buf);
+		txn_buf = NULL;
+		txn_size = 0;
+	}
+}
+
+bool file_transaction() {
+	return txn_depth>0;
+}
+
+void file_begin() {
+	if(txn_depth++==0) {
+		txn_len = 0;
+		txn_aborted = false;
+	}
+}
+
+bool file_abort() {
+	if(!txn_depth) return false;
+	txn_aborted = true;
+	if(--txn_depth) return false;
+	bool dropped = txn_len>0;
+	txn_drop();
+	return dropped;
+}
+
+bool file_commit() {
+	if(!txn_depth || --txn_depth) return true;
+	if(txn_aborted) {
+		txn_drop();
+		return false;
+	}
+	if(!txn_len) return true;
+	bool journaled = false;
+	JournalHeader hdr;
+	hdr.magic = JOURNAL_MAGIC;
+	hdr.len = txn_len;
+	hdr.sum = journal_sum(txn_buf, txn_len);
+	int fd = open(get_filename_fullpath(JOURNAL_FILENAME), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if(fd>=0) {
+		journaled = write(fd, &hdr, sizeof(hdr))==(ssize_t)sizeof(hdr) &&
+			write(fd, txn_buf, txn_len)==(ssize_t)txn_len && fdatasync(fd)==0;
+		close(fd);
+	}
+	if(journaled) dir_sync();
+	else DEBUG_PRINTLN("journal write failed");
+	journal_apply(txn_buf, txn_len);
+	remove(get_filename_fullpath(JOURNAL_FILENAME));
+	dir_sync();
+	txn_drop();
+	return journaled;
+}
+
+void file_recover() {
+	int fd = open(get_filename_fullpath(JOURNAL_FILENAME), O_RDONLY|O_CLOEXEC);
+	if(fd<0) return;
+	JournalHeader hdr;
+	unsigned char *p = NULL;
+	if(read(fd, &hdr, sizeof(hdr))==(ssize_t)sizeof(hdr) && hdr.magic==JOURNAL_MAGIC &&
+			(p = (unsigned char*)malloc(hdr.len ? hdr.len : 1)) != NULL &&
+			read(fd, p, hdr.len)==(ssize_t)hdr.len && journal_sum(p, hdr.len)==hdr.sum) {
+		DEBUG_PRINTLN("applying the journal of an unfinished change");
+		journal_apply(p, hdr.len);
+	}
+	free(p);
+	close(fd);
+	remove(get_filename_fullpath(JOURNAL_FILENAME));
+	dir_sync();
+}
+#endif
+
 void remove_file(const char *fn) {
 #if defined(ESP8266)
 
@@ -304,6 +613,14 @@ void remove_file(const char *fn) {
 
 #else
 
+	pthread_mutex_lock(&mapped_mutex);
+	for(unsigned char i=0;i<nmapped;i++) {
+		if(!strcmp(mapped_files[i].name, fn)) {
+			file_unmap(mapped_files+i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mapped_mutex);
 	remove(get_filename_fullpath(fn));
 
 #endif
@@ -353,12 +670,8 @@ void file_read_block(const char *fn, void *dst, ulong pos, ulong len) {
 
 #else
 
-	FILE *fp = fopen(get_filename_fullpath(fn), "rb");
-	if(fp) {
-		fseek(fp, pos, SEEK_SET);
-		fread(dst, 1, len, fp);
-		fclose(fp);
-	}
+	ulong n = file_read_now(fn, dst, pos, len);
+	if(txn_depth) file_overlay(fn, (unsigned char*)dst, pos, len, n);
 
 #endif
 }
@@ -386,15 +699,8 @@ void file_write_block(const char *fn, const void *src, ulong pos, ulong len) {
 
 #else
 
-	FILE *fp = fopen(get_filename_fullpath(fn), "rb+");
-	if(!fp) {
-		fp = fopen(get_filename_fullpath(fn), "wb+");
-	}
-	if(fp) {
-		fseek(fp, pos, SEEK_SET); //this fails silently without the above change
-		fwrite(src, 1, len, fp);
-		fclose(fp);
-	}
+	if(txn_depth) file_stage(fn, src, pos, len);
+	else file_write_now(fn, src, pos, len);
 
 #endif
 
@@ -428,6 +734,27 @@ void file_copy_block(const char *fn, ulong from, ulong to, ulong len, void *tmp)
 
 #else
 
+	if(txn_depth) {
+		ulong n = file_read_now(fn, tmp, from, len);
+		n = file_overlay(fn, (unsigned char*)tmp, from, len, n);
+		if(n) file_stage(fn, tmp, to, n);
+		return;
+	}
+
+	pthread_mutex_lock(&mapped_mutex);
+	MappedFile *m = file_map(fn, false);
+	if(m) {
+		if(from<m->size && file_grow(m, to+len)) {
+			if(len>m->size-from) len = m->size-from;
+			memcpy(tmp, m->data+from, len);
+			memcpy(m->data+to, tmp, len);
+			m->dirty = true;
+		}
+		pthread_mutex_unlock(&mapped_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&mapped_mutex);
+
 	FILE *fp = fopen(get_filename_fullpath(fn), "rb+");
 	if(!fp) return;
 	fseek(fp, from, SEEK_SET);
@@ -473,6 +800,35 @@ unsigned char file_cmp_block(const char *fn, const char *buf, ulong pos) {
 
 #else
 
+	if(txn_depth) {
+		// compare with what the file will hold, a piece at a time
+		unsigned char piece[64];
+		while(true) {
+			ulong n = file_read_now(fn, piece, pos, sizeof(piece));
+			n = file_overlay(fn, piece, pos, sizeof(piece), n);
+			for(ulong i=0;i<sizeof(piece);i++,buf++) {
+				char c = (i<n) ? piece[i] : (char)EOF;
+				if(!*buf || c!=*buf) return (*buf==c)?0:1;
+			}
+			pos += sizeof(piece);
+		}
+	}
+
+	pthread_mutex_lock(&mapped_mutex);
+	MappedFile *m = file_map(fn, false);
+	if(m) {
+		// past the end of the file reads as EOF, as with fgetc
+		char c = (pos<m->size) ? m->data[pos] : (char)EOF;
+		while(*buf && (c==*buf)) {
+			buf++;
+			pos++;
+			c = (pos<m->size) ? m->data[pos] : (char)EOF;
+		}
+		pthread_mutex_unlock(&mapped_mutex);
+		return (*buf==c)?0:1;
+	}
+	pthread_mutex_unlock(&mapped_mutex);
+
 	FILE *fp = fopen(get_filename_fullpath(fn), "rb");
 	if(fp) {
 		fseek(fp, pos, SEEK_SET);
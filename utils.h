@@ -80,6 +80,12 @@ void str2mac(const char *_str, unsigned char mac[]);
 	const char* get_data_dir();
 	void set_data_dir(const char *new_data_dir);
 	char* get_filename_fullpath(const char *filename);
+	void file_sync(); // write the changes to the data files to disk
+	void file_begin(); // stage the data file writes of this thread until file_commit
+	bool file_commit(); // write the staged writes together, false if they could not be journaled or were aborted
+	bool file_abort(); // drop the staged writes, true if there were any
+	void file_recover(); // finish a commit cut short by a power loss
+	bool file_transaction(); // true if this thread is staging its writes
 	void delay(ulong ms);
 	void delayMicroseconds(ulong us);
 	void delayMicrosecondsHard(ulong us);
@@ -113,4 +119,25 @@ void str2mac(const char *_str, unsigned char mac[]);
 	BoardType get_board_type();
 #endif
 
+/** Groups the data file writes of a request, so that they reach the files
+ * all together or not at all (Linux). The writes are dropped when it goes
+ * out of scope without commit(), e.g. on an error return; reload is then
+ * called to bring what the request changed in memory back from the files */
+class FileTransaction {
+public:
+#if defined(ARDUINO)
+	FileTransaction(void (*)()=NULL) {}
+	void commit() {}
+	void abort() {}
+#else
+	FileTransaction(void (*reload)()=NULL) : open(true), reload(reload) { file_begin(); }
+	~FileTransaction() { abort(); }
+	void commit() { if(open) { open = false; file_commit(); } }
+	void abort() { if(open) { open = false; if(file_abort() && reload) reload(); } }
+private:
+	bool open;
+	void (*reload)();
+#endif
+};
+
 #endif // _UTILS_H
@@ -28,8 +28,10 @@
 #include "weather.h"
 #include "main.h"
 #include "types.h"
+#include "program.h"
 
 extern OpenSprinkler os; // OpenSprinkler object
+extern ProgramData pd;
 extern char tmp_buffer[];
 extern char ether_buffer[];
 char wt_rawData[TMP_BUFFER_SIZE];
@@ -52,6 +54,7 @@ static void getweather_callback(char* buffer) {
 		p++;
 	}
 	if (*p != '&')	return;
+	KeyValIndex kv(p);
 	int v;
 	bool save_nvdata = false;
 	// first check errCode, only update lswc timestamp if errCode is 0
@@ -77,6 +80,7 @@ static void getweather_callback(char* buffer) {
 			os.nvdata.sunrise_time = v;
 			save_nvdata = true;
 			os.weather_update_flag |= WEATHER_UPDATE_SUNRISE;
+			pd.sched_invalidate();
 		}
 	}
 
@@ -86,6 +90,7 @@ static void getweather_callback(char* buffer) {
 			os.nvdata.sunset_time = v;
 			save_nvdata = true;
 			os.weather_update_flag |= WEATHER_UPDATE_SUNSET;
+			pd.sched_invalidate();
 		}
 	}
 
@@ -106,6 +111,7 @@ static void getweather_callback(char* buffer) {
 				os.iopts[IOPT_TIMEZONE] = v;
 				os.iopts_save();
 				os.weather_update_flag |= WEATHER_UPDATE_TZ;
+				pd.sched_invalidate();
 			}
 		}
 	}